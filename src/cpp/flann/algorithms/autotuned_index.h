@@ -134,6 +134,20 @@ public:
             bestIndex_->addPoints(points, rebuild_threshold);
         }
     }
+
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        if (bestIndex_) {
+            bestIndex_->removePoint(id, rebuild_threshold);
+        }
+    }
+
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        if (bestIndex_) {
+            bestIndex_->removePoints(ids, rebuild_threshold);
+        }
+    }
     
     
     /**
@@ -0,0 +1,334 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2011  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2011  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_CENTER_CHOOSER_H_
+#define FLANN_CENTER_CHOOSER_H_
+
+#include <vector>
+#include <limits>
+
+#include "flann/util/chunked_matrix.h"
+#include "flann/util/random.h"
+
+#ifdef TBB
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#endif
+
+namespace flann
+{
+
+/**
+ * Chooses the initial cluster centers using the k-means|| algorithm
+ * (Bahmani et al., "Scalable K-Means++").
+ *
+ * Instead of picking the k centers one at a time as k-means++ does, a few
+ * rounds each sample many candidate centers independently, with a
+ * probability proportional to the distance to the closest candidate. The
+ * distances to the new candidates of each round are computed in one pass
+ * over the points, split among the threads when running in parallel. The
+ * candidates are then weighted by the number of points closest to them and
+ * reduced to k centers by a weighted k-means++.
+ *
+ * The random choices only depend on the state of the random number
+ * generator given, and the potentials are summed in the order of the points,
+ * so the centers don't depend on the number of threads.
+ */
+template <typename Distance>
+class KMeansParallelCenterChooser
+{
+public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    /**
+     * Constructor.
+     *
+     * Params:
+     *     distance = the distance between the points
+     *     dataset = the points
+     *     parallel = if true, the passes over the points are split among the TBB threads
+     *     random = the random number generator
+     */
+    KMeansParallelCenterChooser(const Distance& distance, const ChunkedMatrix<ElementType>& dataset, bool parallel,
+                                RandomState& random) :
+        distance_(distance), dataset_(dataset), parallel_(parallel), random_(random)
+    {
+    }
+
+    /**
+     * Chooses the centers.
+     *
+     * Params:
+     *     k = number of centers
+     *     indices = indices in the dataset of the points to cluster
+     *     indices_length = length of indices vector
+     *     centers = receives the indices in the dataset of the centers
+     *     centers_length = receives the number of centers found, less than k
+     *                      only when there are fewer distinct points
+     */
+    void operator()(int k, int* indices, int indices_length, int* centers, int& centers_length)
+    {
+        int n = indices_length;
+        std::vector<DistanceType> closest(n, (std::numeric_limits<DistanceType>::max)());
+        std::vector<int> nearest(n);
+
+        // candidates, as positions in indices
+        std::vector<int> candidates;
+        candidates.push_back(random_.rand_int(n));
+        double potential = updateDistances(indices, n, candidates, 0, closest, nearest);
+
+        double oversampling = double(k)/OVERSAMPLING_DIVISOR;
+        for (int round=0; round<ROUNDS && potential>0; ++round) {
+            unsigned int seed = random_.next();
+            size_t first = candidates.size();
+            for (int i=0; i<n; ++i) {
+                if (closest[i]>0 && uniform(seed, i)*potential<oversampling*closest[i]) {
+                    candidates.push_back(i);
+                }
+            }
+            if (candidates.size()==first) continue;
+            potential = updateDistances(indices, n, candidates, first, closest, nearest);
+        }
+
+        // a round can sample several copies of the same point: only the first
+        // one is the nearest candidate of its own position
+        int m = (int)candidates.size();
+        int distinct = 0;
+        for (int c=0; c<m; ++c) {
+            if (nearest[candidates[c]]==c) ++distinct;
+        }
+
+        // the rounds can sample fewer than k candidates: the missing ones are
+        // picked as by k-means++, until there are no distinct points left
+        while (distinct<k && potential>0) {
+            candidates.push_back(pick(closest, potential));
+            potential = updateDistances(indices, n, candidates, m, closest, nearest);
+            ++m;
+            ++distinct;
+        }
+
+        if (distinct<=k) {
+            centers_length = 0;
+            for (int c=0; c<m; ++c) {
+                if (nearest[candidates[c]]==c) centers[centers_length++] = indices[candidates[c]];
+            }
+            return;
+        }
+
+        std::vector<double> weights(m, 0);
+        for (int i=0; i<n; ++i) {
+            weights[nearest[i]] += 1;
+        }
+        reduceCandidates(k, indices, candidates, weights, centers, centers_length);
+    }
+
+private:
+    enum
+    {
+        /**
+         * Number of sampling rounds
+         */
+        ROUNDS = 5,
+        /**
+         * The expected number of candidates sampled in a round is k divided
+         * by this (the passes over the points cost one distance per point and
+         * candidate, so the total is close to the 2k distances per point of
+         * k-means++)
+         */
+        OVERSAMPLING_DIVISOR = 2,
+        /**
+         * Minimum number of points for splitting a pass among the threads
+         */
+        PARALLEL_SIZE = 10000,
+        PARALLEL_GRAIN_SIZE = 1024
+    };
+
+    /**
+     * Updates the distances from a range of points to the closest candidate
+     * with the candidates added in the last round.
+     */
+    struct UpdateBody
+    {
+        UpdateBody(const KMeansParallelCenterChooser* chooser, const int* indices, const std::vector<int>& candidates,
+                   size_t first, DistanceType* closest, int* nearest) :
+            chooser_(chooser), indices_(indices), candidates_(candidates), first_(first), closest_(closest),
+            nearest_(nearest) {}
+
+#ifdef TBB
+        void operator()(const tbb::blocked_range<int>& r) const
+        {
+            process(r.begin(), r.end());
+        }
+#endif
+
+        void process(int begin, int end) const
+        {
+            const ChunkedMatrix<ElementType>& dataset = chooser_->dataset_;
+            for (int i=begin; i<end; ++i) {
+                const ElementType* vec = dataset[indices_[i]];
+                for (size_t c=first_; c<candidates_.size(); ++c) {
+                    DistanceType dist = chooser_->distance_(vec, dataset[indices_[candidates_[c]]], dataset.cols);
+                    if (dist<closest_[i]) {
+                        closest_[i] = dist;
+                        nearest_[i] = int(c);
+                    }
+                }
+            }
+        }
+
+        const KMeansParallelCenterChooser* chooser_;
+        const int* indices_;
+        const std::vector<int>& candidates_;
+        size_t first_;
+        DistanceType* closest_;
+        int* nearest_;
+    };
+
+    /**
+     * Takes into account the candidates starting at first and returns the
+     * sum of the distances to the closest candidate.
+     */
+    double updateDistances(const int* indices, int n, const std::vector<int>& candidates, size_t first,
+                           std::vector<DistanceType>& closest, std::vector<int>& nearest)
+    {
+        UpdateBody body(this, indices, candidates, first, &closest[0], &nearest[0]);
+#ifdef TBB
+        if (parallel_ && n>PARALLEL_SIZE) {
+            tbb::parallel_for(tbb::blocked_range<int>(0, n, PARALLEL_GRAIN_SIZE), body);
+        }
+        else {
+            body.process(0, n);
+        }
+#else
+        body.process(0, n);
+#endif
+
+        // summed in order, not per thread, for the same rounding on any number of threads
+        double potential = 0;
+        for (int i=0; i<n; ++i) {
+            potential += closest[i];
+        }
+        return potential;
+    }
+
+    /**
+     * Chooses k of the candidates with a k-means++ seeding where each
+     * candidate counts as many times as its weight.
+     */
+    void reduceCandidates(int k, const int* indices, const std::vector<int>& candidates, const std::vector<double>& weights,
+                          int* centers, int& centers_length)
+    {
+        int m = (int)candidates.size();
+        std::vector<double> closest(m, (std::numeric_limits<double>::max)());
+
+        // the first center is drawn in proportion to the weights only
+        double total = 0;
+        for (int c=0; c<m; ++c) {
+            total += weights[c];
+        }
+        int index = pick(weights, total);
+
+        centers_length = 0;
+        while (true) {
+            const ElementType* center = dataset_[indices[candidates[index]]];
+            centers[centers_length++] = indices[candidates[index]];
+            if (centers_length==k) break;
+
+            std::vector<double> weighted(m);
+            double potential = 0;
+            for (int c=0; c<m; ++c) {
+                double dist = distance_(dataset_[indices[candidates[c]]], center, dataset_.cols);
+                if (dist<closest[c]) {
+                    closest[c] = dist;
+                }
+                weighted[c] = weights[c]*closest[c];
+                potential += weighted[c];
+            }
+            if (potential<=0) break;
+            index = pick(weighted, potential);
+        }
+    }
+
+    /**
+     * Draws an element with a probability proportional to its value.
+     */
+    template <typename T>
+    int pick(const std::vector<T>& values, double total)
+    {
+        // be careful to return a valid answer even accounting for rounding errors
+        double rand_val = random_.rand_double(total);
+        int last = -1;
+        for (size_t c=0; c<values.size(); ++c) {
+            if (values[c]<=0) continue;
+            last = int(c);
+            if (rand_val<=values[c]) break;
+            rand_val -= values[c];
+        }
+        return last;
+    }
+
+    /**
+     * Returns a pseudo-random number in [0,1) computed from a seed and a
+     * point position, so that the points can be sampled in any order.
+     */
+    static double uniform(unsigned int seed, int i)
+    {
+        unsigned int h = seed ^ (unsigned int)i*0x9e3779b9u;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h / 4294967296.0;
+    }
+
+    /**
+     * The distance between the points
+     */
+    const Distance& distance_;
+
+    /**
+     * The dataset containing the points
+     */
+    const ChunkedMatrix<ElementType>& dataset_;
+
+    /**
+     * If true, the passes over the points are split among the threads
+     */
+    bool parallel_;
+
+    /**
+     * The random number generator
+     */
+    RandomState& random_;
+};
+
+}
+
+#endif //FLANN_CENTER_CHOOSER_H_
@@ -149,6 +149,18 @@ public:
         kdtree_index_->addPoints(points, rebuild_threshold);
     }
 
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        kmeans_index_->removePoint(id, rebuild_threshold);
+        kdtree_index_->removePoint(id, rebuild_threshold);
+    }
+
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        kmeans_index_->removePoints(ids, rebuild_threshold);
+        kdtree_index_->removePoints(ids, rebuild_threshold);
+    }
+
     /**
      * \brief Saves the index to a stream
      * \param stream The stream to save the index to
@@ -798,6 +798,33 @@ struct KL_Divergence
     }
 };
 
+
+/**
+ * Tells whether a distance is preserved by rotations of the space
+ * (used by the rotated kd-trees).
+ */
+template<typename Distance>
+struct is_rotation_invariant { enum { value = false }; };
+
+template<typename T>
+struct is_rotation_invariant<L2_Simple<T> > { enum { value = true }; };
+
+template<typename T>
+struct is_rotation_invariant<L2<T> > { enum { value = true }; };
+
+/**
+ * Tells whether a distance is the squared Euclidean distance, whose square
+ * root satisfies the triangle inequality (used by the accelerated k-means).
+ */
+template<typename Distance>
+struct is_squared_euclidean { enum { value = false }; };
+
+template<typename T>
+struct is_squared_euclidean<L2_Simple<T> > { enum { value = true }; };
+
+template<typename T>
+struct is_squared_euclidean<L2<T> > { enum { value = true }; };
+
 }
 
 #endif //FLANN_DIST_H_
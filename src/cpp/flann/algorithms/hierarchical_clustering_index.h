@@ -41,13 +41,24 @@
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
 #include "flann/algorithms/dist.h"
+#include "flann/algorithms/center_chooser.h"
 #include "flann/util/matrix.h"
+#include "flann/util/chunked_matrix.h"
+#include "flann/util/dynamic_bitset.h"
+#include "flann/util/visited_set.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
 #include "flann/util/allocator.h"
 #include "flann/util/random.h"
 #include "flann/util/saving.h"
 
+#ifdef TBB
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_group.h>
+#include <tbb/task_scheduler_init.h>
+#endif
+
 
 namespace flann
 {
@@ -56,7 +67,8 @@ struct HierarchicalClusteringIndexParams : public IndexParams
 {
     HierarchicalClusteringIndexParams(int branching = 32,
                                       flann_centers_init_t centers_init = FLANN_CENTERS_RANDOM,
-                                      int trees = 4, int leaf_size = 100)
+                                      int trees = 4, int leaf_size = 100, bool pack_leaves = false,
+                                      int cores = 1)
     {
         (*this)["algorithm"] = FLANN_INDEX_HIERARCHICAL;
         // The branching factor used in the hierarchical clustering
@@ -67,6 +79,10 @@ struct HierarchicalClusteringIndexParams : public IndexParams
         (*this)["trees"] = trees;
         // maximum leaf size
         (*this)["leaf_size"] = leaf_size;
+        // store copies of the leaf points contiguously, in leaf order
+        (*this)["pack_leaves"] = pack_leaves;
+        // how many cores to use when building the trees (only used with TBB)
+        (*this)["cores"] = cores;
     }
 };
 
@@ -258,6 +274,24 @@ private:
     }
 
 
+    /**
+     * Chooses the initial centers using the k-means|| algorithm, which
+     * samples many candidate centers in a few passes over the points and
+     * then reduces them to k centers.
+     *
+     * Params:
+     *     k = number of centers
+     *     indices = indices in the dataset
+     *     indices_length = length of indices vector
+     */
+    void chooseCentersKMeansParallel(int k, int* indices, int indices_length, int* centers, int& centers_length)
+    {
+        RandomState random(rand_int());
+        KMeansParallelCenterChooser<Distance> chooser(distance_, dataset_, parallel_build_, random);
+        chooser(k, indices, indices_length, centers, centers_length);
+    }
+
+
 public:
 
 
@@ -270,17 +304,23 @@ public:
      */
     HierarchicalClusteringIndex(const Matrix<ElementType>& inputData, const IndexParams& index_params = HierarchicalClusteringIndexParams(),
                                 Distance d = Distance())
-        : dataset_(inputData), index_params_(index_params), distance_(d)
+        : dataset_(inputData, get_param(index_params,"copy_dataset",false)), index_params_(index_params), distance_(d)
     {
         memoryCounter_ = 0;
 
         size_ = dataset_.rows;
         veclen_ = dataset_.cols;
+        removed_points_.resize(size_);
+        removed_count_ = 0;
+        removed_at_build_ = 0;
 
         branching_ = get_param(index_params_,"branching",32);
         centers_init_ = get_param(index_params_,"centers_init", FLANN_CENTERS_RANDOM);
         trees_ = get_param(index_params_,"trees",4);
         leaf_size_ = get_param(index_params_,"leaf_size",100);
+        pack_leaves_ = get_param(index_params_,"pack_leaves",false);
+        cores_ = get_param(index_params_,"cores",1);
+        parallel_build_ = false;
 
         if (centers_init_==FLANN_CENTERS_RANDOM) {
             chooseCenters = &HierarchicalClusteringIndex::chooseCentersRandom;
@@ -291,16 +331,12 @@ public:
         else if (centers_init_==FLANN_CENTERS_KMEANSPP) {
             chooseCenters = &HierarchicalClusteringIndex::chooseCentersKMeanspp;
         }
+        else if (centers_init_==FLANN_CENTERS_KMEANSPARALLEL) {
+            chooseCenters = &HierarchicalClusteringIndex::chooseCentersKMeansParallel;
+        }
         else {
             throw FLANNException("Unknown algorithm for choosing initial centers.");
         }
-        ownDataset_ = get_param(index_params_, "copy_dataset", false);
-        if (ownDataset_) {
-            dataset_ = Matrix<ElementType>(new ElementType[inputData.rows * inputData.cols], inputData.rows, inputData.cols);
-            for (size_t i=0;i<inputData.rows;++i) {
-                std::copy(inputData[i], inputData[i]+inputData.cols, dataset_[i]);
-            }        
-        }
         
         trees_ = get_param(index_params_,"trees",4);
     }
@@ -315,9 +351,7 @@ public:
      */
     virtual ~HierarchicalClusteringIndex()
     {
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
+        freeTrees();
     }
 
     /**
@@ -343,7 +377,11 @@ public:
      */
     int usedMemory() const
     {
-        return pool_.usedMemory+pool_.wastedMemory+memoryCounter_;
+        int pools_memory = 0;
+        for (size_t i=0; i<pools_.size(); ++i) {
+            pools_memory += pools_[i]->usedMemory+pools_[i]->wastedMemory;
+        }
+        return pools_memory+memoryCounter_+int(packed_points_.size()*sizeof(ElementType));
     }
 
     /**
@@ -354,17 +392,41 @@ public:
         if (branching_<2) {
             throw FLANNException("Branching factor must be at least 2");
         }
-        tree_roots_.resize(trees_);
-        for (int i=0; i<trees_; ++i) {
-            indices_.resize(size_);
-            for (size_t j=0; j<size_; ++j) {
-                indices_[j] = j;
+        if (removed_count_>0) {
+            dataset_.release(removed_points_);
+            removed_count_ = 0;
+        }
+        indices_.clear();
+        for (size_t j=0; j<size_; ++j) {
+            if (!removed_points_.test(j)) {
+                indices_.push_back(j);
+            }
+        }
+        allocateTrees();
+#ifdef TBB
+        if (cores_ == 1) {
+#endif
+            for (int i=0; i<trees_; ++i) {
+                buildTree(i);
             }
-            tree_roots_[i] = new(pool_) Node();
-            computeClustering(tree_roots_[i], &indices_[0], size_, branching_,0);
+#ifdef TBB
         }
+        else {
+            // Initialise the task scheduler for the use of Intel TBB parallel constructs
+            tbb::task_scheduler_init task_sched(cores_);
+            parallel_build_ = true;
+            tbb::task_group group;
+            for (int i=0; i<trees_; ++i) {
+                group.run(BuildTreeTask(this, i));
+            }
+            group.wait();
+            parallel_build_ = false;
+        }
+#endif
+        packLeaves();
         
-        size_at_build_ = size_;
+        size_at_build_ = indices_.size();
+        removed_at_build_ = size_ - size_at_build_;
     }
 
     
@@ -373,35 +435,46 @@ public:
         assert(points.cols==veclen());
         size_t old_size = size_;
 
-        size_t rows = dataset_.rows + points.rows;
-        Matrix<ElementType> new_dataset(new ElementType[rows * veclen()], rows, veclen());
-        for (size_t i=0;i<dataset_.rows;++i) {
-            std::copy(dataset_[i], dataset_[i]+dataset_.cols, new_dataset[i]);
-        }
-        for (size_t i=0;i<points.rows;++i) {
-            std::copy(points[i], points[i]+points.cols, new_dataset[dataset_.rows+i]);
-        }
-        
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
-        dataset_ = new_dataset;
+        dataset_.append(points);
         size_ += points.rows;
-        ownDataset_ = true;
+        removed_points_.resize(size_);
         
-        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_) {
-            pool_.free();
+        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_-removed_at_build_-removed_count_) {
             buildIndex();
         }
         else {
             for (size_t i=0;i<points.rows;++i) {
                 for (int j = 0; j < trees_; j++) {
-                    addPointToTree(tree_roots_[j], old_size + i);
+                    addPointToTree(tree_roots_[j], old_size + i, *pools_[j]);
                 }
             }            
         }
     }
 
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        removePoints(std::vector<size_t>(1, id), rebuild_threshold);
+    }
+
+    /**
+     * Marks points as removed, they are skipped by the searches. When the
+     * number of removed points exceeds rebuild_threshold times the number
+     * of points in the trees, the trees are rebuilt without them.
+     */
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        for (size_t i=0;i<ids.size();++i) {
+            if (ids[i]<size_ && !removed_points_.test(ids[i])) {
+                removed_points_.set(ids[i]);
+                removed_count_++;
+            }
+        }
+
+        if (rebuild_threshold>0 && removed_count_>size_at_build_*rebuild_threshold) {
+            buildIndex();
+        }
+    }
+
 
     flann_algorithm_t getType() const
     {
@@ -411,35 +484,43 @@ public:
 
     void saveIndex(FILE* stream)
     {
+        // the removed points are saved since format 2
+        save_format(stream, "hierarchical 2");
         save_value(stream, branching_);
         save_value(stream, trees_);
         save_value(stream, centers_init_);
         save_value(stream, leaf_size_);
         save_value(stream, memoryCounter_);
+        save_value(stream, pack_leaves_);
         for (int i=0; i<trees_; ++i) {
             save_tree(stream, tree_roots_[i], i);
         }
-
+        save_removed(stream);
     }
 
 
     void loadIndex(FILE* stream)
     {
+        load_format(stream, "hierarchical 2");
         load_value(stream, branching_);
         load_value(stream, trees_);
         load_value(stream, centers_init_);
         load_value(stream, leaf_size_);
         load_value(stream, memoryCounter_);
-        tree_roots_.resize(trees_);
+        load_value(stream, pack_leaves_);
+        allocateTrees();
         for (int i=0; i<trees_; ++i) {
             load_tree(stream, tree_roots_[i], i);
         }
+        load_removed(stream);
+        packLeaves();
 
         index_params_["algorithm"] = getType();
         index_params_["branching"] = branching_;
         index_params_["trees"] = trees_;
         index_params_["centers_init"] = centers_init_;
         index_params_["leaf_size"] = leaf_size_;
+        index_params_["pack_leaves"] = pack_leaves_;
     }
 
 
@@ -457,24 +538,31 @@ public:
     {
 
         int maxChecks = searchParams.checks;
+        // the branches and the points checked start with room for a leaf of
+        // each tree, or the checks if fewer, and grow as the search needs
+        int expected = trees_*leaf_size_;
+        if (maxChecks>0 && maxChecks<expected) expected = maxChecks;
 
         // Priority queue storing intermediate branches in the best-bin-first search
-        Heap<BranchSt>* heap = new Heap<BranchSt>(size_);
+        Heap<BranchSt> heap((int)size_, expected);
+
+        // a point is in a single leaf of each tree, so it can only be checked
+        // twice when searching several trees
+        VisitedSet checked_set(expected);
+        VisitedSet* checked = (trees_>1) ? &checked_set : NULL;
+
+        std::vector<DistanceType> domain_distances(branching_);
 
-        std::vector<bool> checked(size_,false);
         int checks = 0;
         for (int i=0; i<trees_; ++i) {
-            findNN(tree_roots_[i], result, vec, checks, maxChecks, heap, checked);
+            findNN(tree_roots_[i], result, vec, checks, maxChecks, &heap, checked, &domain_distances[0]);
         }
 
         BranchSt branch;
-        while (heap->popMin(branch) && (checks<maxChecks || !result.full())) {
+        while (heap.popMin(branch) && (checks<maxChecks || !result.full())) {
             NodePtr node = branch.node;
-            findNN(node, result, vec, checks, maxChecks, heap, checked);
+            findNN(node, result, vec, checks, maxChecks, &heap, checked, &domain_distances[0]);
         }
-
-        delete heap;
-
     }
 
     IndexParams getParameters() const
@@ -506,6 +594,12 @@ private:
          * Node points (only for terminal nodes)
          */
         std::vector<int> indices;
+        /**
+         * Copies of the node points in the order of indices, in the packed
+         * storage of the index (only for terminal nodes when the leaves are
+         * packed, NULL for a leaf changed since the last packing)
+         */
+        ElementType* points;
         /**
          * Level
          */
@@ -524,12 +618,16 @@ private:
 
     void save_tree(FILE* stream, NodePtr node, int num)
     {
-        save_value(stream, *node);
-        if (node->childs.empty()) {
+        save_value(stream, node->pivot);
+        save_value(stream, node->size);
+        save_value(stream, node->level);
+        size_t childs_size = node->childs.size();
+        save_value(stream, childs_size);
+        if (childs_size==0) {
             save_value(stream, node->indices);
         }
         else {
-            for(int i=0; i<branching_; ++i) {
+            for(size_t i=0; i<childs_size; ++i) {
                 save_tree(stream, node->childs[i], num);
             }
         }
@@ -538,40 +636,241 @@ private:
 
     void load_tree(FILE* stream, NodePtr& node, int num)
     {
-        node = new(pool_) Node();
-        load_value(stream, *node);
-        if (node->childs.empty()) {
+        node = new(*pools_[num]) Node();
+        load_value(stream, node->pivot);
+        load_value(stream, node->size);
+        load_value(stream, node->level);
+        size_t childs_size;
+        load_value(stream, childs_size);
+        if (childs_size==0) {
             load_value(stream, node->indices);
         }
         else {
-            node->childs.resize(branching_);
-            for(int i=0; i<branching_; ++i) {
+            node->childs.resize(childs_size);
+            for(size_t i=0; i<childs_size; ++i) {
                 load_tree(stream, node->childs[i], num);
             }
         }
     }
 
 
+    /**
+     * Copies the points of the leaves of all the trees into packed_points_,
+     * in leaf order, when the leaves are packed.
+     */
+    void packLeaves()
+    {
+        std::vector<ElementType>().swap(packed_points_);
+        if (!pack_leaves_) return;
 
+        size_t count = 0;
+        for (size_t i=0; i<tree_roots_.size(); ++i) {
+            count += countLeafPoints(tree_roots_[i]);
+        }
+        packed_points_.resize(count*veclen_);
+        ElementType* points = packed_points_.empty() ? NULL : &packed_points_[0];
+        for (size_t i=0; i<tree_roots_.size(); ++i) {
+            packLeaves(tree_roots_[i], points);
+        }
+    }
 
-    void computeLabels(int* indices, int indices_length,  int* centers, int centers_length, int* labels, DistanceType& cost)
+    size_t countLeafPoints(NodePtr node)
+    {
+        if (node->childs.empty()) {
+            return node->indices.size();
+        }
+        size_t count = 0;
+        for (size_t i=0; i<node->childs.size(); ++i) {
+            count += countLeafPoints(node->childs[i]);
+        }
+        return count;
+    }
+
+    void packLeaves(NodePtr node, ElementType*& points)
+    {
+        if (node->childs.empty()) {
+            node->points = points;
+            for (size_t i=0; i<node->indices.size(); ++i) {
+                const ElementType* point = dataset_[node->indices[i]];
+                std::copy(point, point+veclen_, points);
+                points += veclen_;
+            }
+            return;
+        }
+        for (size_t i=0; i<node->childs.size(); ++i) {
+            packLeaves(node->childs[i], points);
+        }
+    }
+
+
+
+
+    void save_removed(FILE* stream)
     {
-        cost = 0;
-        for (int i=0; i<indices_length; ++i) {
-            ElementType* point = dataset_[indices[i]];
-            DistanceType dist = distance_(point, dataset_[centers[0]], veclen_);
-            labels[i] = 0;
-            for (int j=1; j<centers_length; ++j) {
-                DistanceType new_dist = distance_(point, dataset_[centers[j]], veclen_);
-                if (dist>new_dist) {
-                    labels[i] = j;
-                    dist = new_dist;
+        std::vector<size_t> removed;
+        for (size_t i=0; i<size_; ++i) {
+            if (removed_points_.test(i)) removed.push_back(i);
+        }
+        save_value(stream, removed);
+        save_value(stream, removed_count_);
+    }
+
+    void load_removed(FILE* stream)
+    {
+        std::vector<size_t> removed;
+        load_value(stream, removed);
+        load_value(stream, removed_count_);
+        removed_points_.resize(size_);
+        removed_points_.reset();
+        for (size_t i=0; i<removed.size(); ++i) {
+            removed_points_.set(removed[i]);
+        }
+        size_at_build_ = size_ - removed.size() + removed_count_;
+        removed_at_build_ = removed.size() - removed_count_;
+    }
+
+
+    /**
+     * Assigns a range of points to their closest center and sums the
+     * distances to it.
+     */
+    struct LabelsBody
+    {
+        LabelsBody(const HierarchicalClusteringIndex* index, const int* indices, const int* centers, int centers_length,
+                   int* labels) :
+            index_(index), indices_(indices), centers_(centers), centers_length_(centers_length), labels_(labels),
+            cost_(0) {}
+
+#ifdef TBB
+        LabelsBody(LabelsBody& other, tbb::split) :
+            index_(other.index_), indices_(other.indices_), centers_(other.centers_),
+            centers_length_(other.centers_length_), labels_(other.labels_), cost_(0) {}
+
+        void operator()(const tbb::blocked_range<int>& r)
+        {
+            process(r.begin(), r.end());
+        }
+
+        void join(const LabelsBody& other)
+        {
+            cost_ += other.cost_;
+        }
+#endif
+
+        void process(int begin, int end)
+        {
+            const ChunkedMatrix<ElementType>& dataset = index_->dataset_;
+            size_t veclen = index_->veclen_;
+            for (int i=begin; i<end; ++i) {
+                ElementType* point = dataset[indices_[i]];
+                DistanceType dist = index_->distance_(point, dataset[centers_[0]], veclen);
+                labels_[i] = 0;
+                for (int j=1; j<centers_length_; ++j) {
+                    DistanceType new_dist = index_->distance_(point, dataset[centers_[j]], veclen);
+                    if (dist>new_dist) {
+                        labels_[i] = j;
+                        dist = new_dist;
+                    }
                 }
+                cost_ += dist;
+            }
+        }
+
+        const HierarchicalClusteringIndex* index_;
+        const int* indices_;
+        const int* centers_;
+        int centers_length_;
+        int* labels_;
+        DistanceType cost_;
+    };
+
+    void computeLabels(int* indices, int indices_length,  int* centers, int centers_length, int* labels, DistanceType& cost)
+    {
+        LabelsBody body(this, indices, centers, centers_length, labels);
+#ifdef TBB
+        if (parallel_build_ && indices_length>PARALLEL_BUILD_SIZE) {
+            tbb::parallel_reduce(tbb::blocked_range<int>(0, indices_length, PARALLEL_GRAIN_SIZE), body);
+            cost = body.cost_;
+            return;
+        }
+#endif
+        body.process(0, indices_length);
+        cost = body.cost_;
+    }
+
+    /**
+     * Creates an empty pool for the nodes of each tree, after releasing the
+     * current trees.
+     */
+    void allocateTrees()
+    {
+        freeTrees();
+        tree_roots_.resize(trees_);
+        pools_.resize(trees_);
+        for (int i=0; i<trees_; ++i) {
+            pools_[i] = new PooledAllocator();
+        }
+    }
+
+    /**
+     * Releases the trees and the pools holding their nodes.
+     */
+    void freeTrees()
+    {
+        for (size_t i=0; i<tree_roots_.size(); ++i) {
+            if (tree_roots_[i]!=NULL) {
+                destroyNodes(tree_roots_[i]);
             }
-            cost += dist;
         }
+        tree_roots_.clear();
+        for (size_t i=0; i<pools_.size(); ++i) {
+            delete pools_[i];
+        }
+        pools_.clear();
+    }
+
+    /**
+     * Runs the destructors of the nodes of a subtree, their memory belongs
+     * to the pool of the tree.
+     */
+    void destroyNodes(NodePtr node)
+    {
+        for (size_t i=0; i<node->childs.size(); ++i) {
+            destroyNodes(node->childs[i]);
+        }
+        node->~Node();
     }
 
+    /**
+     * Builds one of the trees from all the points.
+     */
+    void buildTree(int tree)
+    {
+        // each tree reorders its own copy of the point indices
+        std::vector<int> indices(indices_);
+        tree_roots_[tree] = new(*pools_[tree]) Node();
+        computeClustering(tree_roots_[tree], indices.empty() ? NULL : &indices[0], indices.size(), branching_, 0,
+                          *pools_[tree]);
+    }
+
+#ifdef TBB
+    /**
+     * Builds a tree in a separate task
+     */
+    struct BuildTreeTask
+    {
+        BuildTreeTask(HierarchicalClusteringIndex* index, int tree) : index_(index), tree_(tree) {}
+
+        void operator()() const
+        {
+            index_->buildTree(tree_);
+        }
+
+        HierarchicalClusteringIndex* index_;
+        int tree_;
+    };
+#endif
+
     /**
      * The method responsible with actually doing the recursive hierarchical
      * clustering
@@ -580,10 +879,12 @@ private:
      *     node = the node to cluster
      *     indices = indices of the points belonging to the current node
      *     branching = the branching factor to use in the clustering
+     *     pool = the pool of the tree, receiving the new nodes
      *
      * TODO: for 1-sized clusters don't store a cluster center (it's the same as the single cluster point)
      */
-    void computeClustering(NodePtr node, int* indices, int indices_length, int branching, int level)
+    void computeClustering(NodePtr node, int* indices, int indices_length, int branching, int level,
+                           PooledAllocator& pool)
     {
         node->size = indices_length;
         node->level = level;
@@ -627,10 +928,10 @@ private:
                 }
             }
 
-            node->childs[i] = new(pool_) Node();
+            node->childs[i] = new(pool) Node();
             node->childs[i]->pivot = centers[i];
             node->childs[i]->indices.clear();
-            computeClustering(node->childs[i],indices+start, end-start, branching, level+1);
+            computeClustering(node->childs[i],indices+start, end-start, branching, level+1, pool);
             start=end;
         }
     }
@@ -647,12 +948,16 @@ private:
      *      vec = query points
      *      checks = how many points in the dataset have been checked so far
      *      maxChecks = maximum dataset points to checks
+     *      heap = the branches not explored yet
+     *      checked = the points already checked, or NULL if the points can't
+     *                be reached twice
+     *      domain_distances = space for the distances to the children of a node
      */
 
 
     template<typename ResultSet>
     void findNN(NodePtr node, ResultSet& result, const ElementType* vec, int& checks, int maxChecks,
-                Heap<BranchSt>* heap, std::vector<bool>& checked)
+                Heap<BranchSt>* heap, VisitedSet* checked, DistanceType* domain_distances)
     {
         if (node->childs.empty()) {
             if (checks>=maxChecks) {
@@ -661,15 +966,15 @@ private:
             checks += node->size;
             for (int i=0; i<node->size; ++i) {
                 int index = node->indices[i];
-                if (!checked[index]) {
-                    DistanceType dist = distance_(dataset_[index], vec, veclen_);
+                if (removed_count_>0 && removed_points_.test(index)) continue;
+                if (checked==NULL || checked->insert(index)) {
+                    const ElementType* point = (node->points!=NULL) ? node->points+i*veclen_ : dataset_[index];
+                    DistanceType dist = distance_(point, vec, veclen_);
                     result.addPoint(dist, index);
-                    checked[index] = true;
                 }
             }
         }
         else {
-            DistanceType* domain_distances = new DistanceType[branching_];
             int best_index = 0;
             domain_distances[best_index] = distance_(vec, dataset_[node->childs[best_index]->pivot], veclen_);
             for (int i=1; i<branching_; ++i) {
@@ -683,22 +988,23 @@ private:
                     heap->insert(BranchSt(node->childs[i],domain_distances[i]));
                 }
             }
-            delete[] domain_distances;
-            findNN(node->childs[best_index],result,vec, checks, maxChecks, heap, checked);
+            findNN(node->childs[best_index],result,vec, checks, maxChecks, heap, checked, domain_distances);
         }
     }
     
-    void addPointToTree(NodePtr node, size_t index)
+    void addPointToTree(NodePtr node, size_t index, PooledAllocator& pool)
     {
         ElementType* point = dataset_[index];
         node->size++;
         
         if (node->childs.empty()) { // leaf node
+            // the leaf is read from the dataset until the leaves are packed again
+            node->points = NULL;
             node->indices.push_back(index);
             if (node->indices.size()>=size_t(branching_)) {
                 std::vector<int> indices;
                 indices.swap(node->indices);
-                computeClustering(node, &indices[0], indices.size(), branching_, node->level);
+                computeClustering(node, &indices[0], indices.size(), branching_, node->level, pool);
             }
         }
         else {            
@@ -714,7 +1020,7 @@ private:
                     closest = i;
                 }
             }
-            addPointToTree(node->childs[closest], index);
+            addPointToTree(node->childs[closest], index, pool);
         }                
     }
 
@@ -724,7 +1030,7 @@ private:
     /**
      * The dataset used by this index
      */
-    Matrix<ElementType> dataset_;
+    ChunkedMatrix<ElementType> dataset_;
 
     /**
      * Parameters used by this index
@@ -742,6 +1048,21 @@ private:
      */
     size_t size_at_build_;
 
+    /**
+     * Points removed from the index
+     */
+    DynamicBitset removed_points_;
+
+    /**
+     * Number of removed points still stored in the trees
+     */
+    size_t removed_count_;
+
+    /**
+     * Number of removed points left out of the trees when it was last built
+     */
+    size_t removed_at_build_;
+
     /**
      * Length of each feature.
      */
@@ -764,13 +1085,25 @@ private:
     Distance distance_;
 
     /**
-     * Pooled memory allocator.
+     * If true, copies of the leaf points are stored contiguously in packed_points_
+     */
+    bool pack_leaves_;
+
+    /**
+     * Copies of the points of the leaves of all the trees, in leaf order
+     * (when pack_leaves_ is set)
+     */
+    std::vector<ElementType> packed_points_;
+
+    /**
+     * Pooled memory allocators, one per tree, so that the trees can be
+     * built concurrently.
      *
      * Using a pooled memory allocator is more efficient
      * than allocating memory directly when there is a large
      * number small of memory allocations.
      */
-    PooledAllocator pool_;
+    std::vector<PooledAllocator*> pools_;
 
     /**
      * Memory occupied by the index.
@@ -797,11 +1130,30 @@ private:
      * Max size of leaf nodes
      */
     int leaf_size_;
-    
+
     /**
-     *  Does the index have a copy of the dataset?
+     * Number of threads used to build the trees (only used with TBB)
      */
-    bool ownDataset_;
+    int cores_;
+
+    /**
+     * True while the trees are being built in parallel
+     */
+    bool parallel_build_;
+
+    enum
+    {
+        /**
+         * Nodes with more points than this have their points assigned to
+         * the centers in parallel when the trees are built in parallel.
+         */
+        PARALLEL_BUILD_SIZE = 10000,
+        /**
+         * Number of points processed by a task when assigning the points
+         * to the centers in parallel.
+         */
+        PARALLEL_GRAIN_SIZE = 1024
+    };
 };
 
 }
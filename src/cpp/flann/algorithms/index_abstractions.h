@@ -49,6 +49,10 @@ public:
 
     virtual size_t size() const = 0;
 
+    virtual void removePoint(size_t id, float rebuild_threshold) = 0;
+
+    virtual void removePoints(const std::vector<size_t>& ids, float rebuild_threshold) = 0;
+
     virtual flann_algorithm_t getType() const = 0;
 
     virtual int usedMemory() const = 0;
@@ -125,6 +129,16 @@ public:
         index_->addPoints(points, rebuild_threshold);
     }
 
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        index_->removePoint(id, rebuild_threshold);
+    }
+
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        index_->removePoints(ids, rebuild_threshold);
+    }
+
     size_t veclen() const
     {
         return index_->veclen();
@@ -32,14 +32,18 @@
 #define FLANN_KDTREE_INDEX_H_
 
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <cassert>
 #include <cstring>
+#include <cmath>
 
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
+#include "flann/algorithms/dist.h"
 #include "flann/util/dynamic_bitset.h"
 #include "flann/util/matrix.h"
+#include "flann/util/chunked_matrix.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
 #include "flann/util/allocator.h"
@@ -52,10 +56,17 @@ namespace flann
 
 struct KDTreeIndexParams : public IndexParams
 {
-    KDTreeIndexParams(int trees = 4)
+    KDTreeIndexParams(int trees = 4, int leaf_max_size = 1, bool reorder = false, bool rotate = false)
     {
         (*this)["algorithm"] = FLANN_INDEX_KDTREE;
+        // number of randomized trees to use
         (*this)["trees"] = trees;
+        // maximum number of points stored in a leaf
+        (*this)["leaf_max_size"] = leaf_max_size;
+        // store a copy of the dataset in the leaf order of the first tree
+        (*this)["reorder"] = reorder;
+        // build each tree on the data rotated by a different random orthogonal matrix
+        (*this)["rotate"] = rotate;
     }
 };
 
@@ -84,21 +95,33 @@ public:
      */
     KDTreeIndex(const Matrix<ElementType>& inputData, const IndexParams& params = KDTreeIndexParams(),
                 Distance d = Distance() ) :
-        dataset_(inputData), index_params_(params), distance_(d)
+        dataset_(inputData, get_param(params,"copy_dataset",false)), index_params_(params), distance_(d)
     {
         size_ = dataset_.rows;
         veclen_ = dataset_.cols;
 
         trees_ = get_param(index_params_,"trees",4);
-        tree_roots_ = new NodePtr[trees_];
-        
-        ownDataset_ = get_param(index_params_, "copy_dataset", false);
-        if (ownDataset_) {
-            dataset_ = Matrix<ElementType>(new ElementType[inputData.rows * inputData.cols], inputData.rows, inputData.cols);
-            for (size_t i=0;i<inputData.rows;++i) {
-                std::copy(inputData[i], inputData[i]+inputData.cols, dataset_[i]);
-            }        
+        leaf_max_size_ = get_param(index_params_,"leaf_max_size",1);
+        if (leaf_max_size_<1) {
+            throw FLANNException("leaf_max_size must be at least 1");
+        }
+        reorder_ = get_param(index_params_,"reorder",false);
+        rotate_ = get_param(index_params_,"rotate",false);
+        if (rotate_ && !is_rotation_invariant<Distance>::value) {
+            throw FLANNException("Rotated kd-trees can only be used with the Euclidean distance");
+        }
+        tree_nodes_.resize(trees_);
+        if (reorder_) {
+            ids_.resize(size_);
+            for (size_t i=0; i<size_; ++i) {
+                ids_[i] = int(i);
+            }
         }
+
+        removed_points_.resize(size_);
+        removed_count_ = 0;
+        removed_at_build_ = 0;
+        dead_points_ = 0;
     }
 
     KDTreeIndex(const KDTreeIndex&);
@@ -109,12 +132,6 @@ public:
      */
     ~KDTreeIndex()
     {
-        if (tree_roots_!=NULL) {
-            delete[] tree_roots_;
-        }
-        if (ownDataset_) {
-            delete[] dataset_.ptr();            
-        }
     }
 
     /**
@@ -122,61 +139,112 @@ public:
      */
     void buildIndex()
     {
-        // Create a permutable array of indices to the input vectors.
-        vind_.resize(size_);
-        for (size_t i = 0; i < size_; ++i) {
-            vind_[i] = int(i);
+        // Create a permutable array of indices to the input vectors,
+        // leaving out the removed points.
+        vind_.clear();
+        for (size_t i = 0; i < dataset_.rows; ++i) {
+            if (!removed_points_.test(reorder_ ? ids_[i] : i)) {
+                vind_.push_back(int(i));
+            }
         }
+        if (!reorder_ && removed_count_>0) {
+            dataset_.release(removed_points_);
+        }
+        removed_count_ = 0;
 
         mean_ = new DistanceType[veclen_];
         var_ = new DistanceType[veclen_];
 
         /* Construct the randomized trees. */
+        tree_points_.clear();
+        dead_points_ = 0;
+        rotations_.resize(rotate_ ? trees_ : 0);
         for (int i = 0; i < trees_; i++) {
             /* Randomize the order of vectors to allow for unbiased sampling. */
             std::random_shuffle(vind_.begin(), vind_.end());
-            tree_roots_[i] = divideTree(&vind_[0], int(size_) );
+            int* ind = vind_.empty() ? NULL : &vind_[0];
+            if (rotate_) {
+                randomRotation(rotations_[i]);
+                /* The splits need random access to the rotated coordinates of
+                   all the points: they are computed once for the tree, which
+                   costs a copy of the dataset (in DistanceType values) while
+                   the tree is built. */
+                Matrix<DistanceType> rotated(new DistanceType[dataset_.rows*veclen_], dataset_.rows, veclen_);
+                for (size_t j=0; j<vind_.size(); ++j) {
+                    rotateVector(&rotations_[i][0], dataset_[vind_[j]], rotated[vind_[j]]);
+                }
+                freezeTree(divideTree(rotated, ind, int(vind_.size()) ), int(tree_points_.size()), tree_nodes_[i]);
+                delete[] rotated.ptr();
+            }
+            else {
+                freezeTree(divideTree(dataset_, ind, int(vind_.size()) ), int(tree_points_.size()), tree_nodes_[i]);
+            }
+            pool_.free();
+            if (i==0 && reorder_) {
+                reorderDataset();
+            }
+            tree_points_.insert(tree_points_.end(), vind_.begin(), vind_.end());
         }
         delete[] mean_;
         delete[] var_;
         
-        size_at_build_ = size_;
+        size_at_build_ = vind_.size();
+        removed_at_build_ = size_ - size_at_build_;
     }
     
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
         assert(points.cols==veclen());
         size_t old_size = size_;
+        size_t old_rows = dataset_.rows;
 
-        size_t rows = dataset_.rows + points.rows;
-        Matrix<ElementType> new_dataset(new ElementType[rows * veclen()], rows, veclen());
-        for (size_t i=0;i<dataset_.rows;++i) {
-            std::copy(dataset_[i], dataset_[i]+dataset_.cols, new_dataset[i]);
-        }
-        for (size_t i=0;i<points.rows;++i) {
-            std::copy(points[i], points[i]+points.cols, new_dataset[dataset_.rows+i]);
-        }
-        
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
-        dataset_ = new_dataset;
+        dataset_.append(points);
         size_ += points.rows;
-        ownDataset_ = true;
+        removed_points_.resize(size_);
+        if (reorder_) {
+            for (size_t i=0;i<points.rows;++i) {
+                ids_.push_back(int(old_size + i));
+            }
+        }
         
-        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_) {
-            pool_.free();
+        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_-removed_at_build_-removed_count_) {
             buildIndex();
         }
         else {
             for (size_t i=0;i<points.rows;++i) {
                 for (int j = 0; j < trees_; j++) {
-                    addPointToTree(tree_roots_[j], old_size + i);
+                    addPointToTree(j, old_rows + i);
                 }
             }
         }        
     }
 
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        removePoints(std::vector<size_t>(1, id), rebuild_threshold);
+    }
+
+    /**
+     * Marks points as removed, they are skipped by the searches. When the
+     * number of removed points exceeds rebuild_threshold times the number
+     * of points in the index, the index is rebuilt without them and the
+     * memory used by their copy is released. The ids of the remaining
+     * points do not change.
+     */
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        for (size_t i=0;i<ids.size();++i) {
+            if (ids[i]<size_ && !removed_points_.test(ids[i])) {
+                removed_points_.set(ids[i]);
+                removed_count_++;
+            }
+        }
+
+        if (rebuild_threshold>0 && removed_count_>size_at_build_*rebuild_threshold) {
+            buildIndex();
+        }
+    }
+
 
     flann_algorithm_t getType() const
     {
@@ -186,27 +254,61 @@ public:
 
     void saveIndex(FILE* stream)
     {
+        // the removed points are saved since format 2
+        save_format(stream, "kdtree 2");
         save_value(stream, trees_);
+        save_value(stream, leaf_max_size_);
         for (int i=0; i<trees_; ++i) {
-            save_tree(stream, tree_roots_[i]);
+            save_value(stream, tree_nodes_[i]);
+        }
+        save_value(stream, tree_points_);
+        save_value(stream, reorder_);
+        if (reorder_) {
+            save_value(stream, ids_);
         }
+        save_value(stream, rotate_);
+        for (size_t i=0; i<rotations_.size(); ++i) {
+            save_value(stream, rotations_[i]);
+        }
+        save_removed(stream);
     }
 
 
 
     void loadIndex(FILE* stream)
     {
+        load_format(stream, "kdtree 2");
         load_value(stream, trees_);
-        if (tree_roots_!=NULL) {
-            delete[] tree_roots_;
-        }
-        tree_roots_ = new NodePtr[trees_];
+        load_value(stream, leaf_max_size_);
+        tree_nodes_.resize(trees_);
         for (int i=0; i<trees_; ++i) {
-            load_tree(stream,tree_roots_[i]);
+            load_value(stream, tree_nodes_[i]);
         }
+        load_value(stream, tree_points_);
+        dead_points_ = tree_points_.size()-countLeafPoints();
+        load_value(stream, reorder_);
+        if (reorder_) {
+            load_value(stream, ids_);
+            /* The dataset is given in the original order, lay it out again
+               in the order used by the trees. */
+            ChunkedMatrix<ElementType> data(veclen_);
+            for (size_t i=0; i<ids_.size(); ++i) {
+                data.push_back(dataset_[ids_[i]], ids_.size()-i);
+            }
+            dataset_.swap(data);
+        }
+        load_value(stream, rotate_);
+        rotations_.resize(rotate_ ? trees_ : 0);
+        for (size_t i=0; i<rotations_.size(); ++i) {
+            load_value(stream, rotations_[i]);
+        }
+        load_removed(stream);
 
         index_params_["algorithm"] = getType();
-        index_params_["trees"] = tree_roots_;
+        index_params_["trees"] = trees_;
+        index_params_["leaf_max_size"] = leaf_max_size_;
+        index_params_["reorder"] = reorder_;
+        index_params_["rotate"] = rotate_;
     }
 
     /**
@@ -231,7 +333,13 @@ public:
      */
     int usedMemory() const
     {
-        return int(pool_.usedMemory+pool_.wastedMemory+dataset_.rows*sizeof(int));  // pool memory and vind array memory
+        size_t nodes = 0;
+        for (int i=0; i<trees_; ++i) {
+            nodes += tree_nodes_[i].size();
+        }
+        // the leaf point indices include the slots left by the leaves moved by addPoints()
+        return int(nodes*sizeof(Node)+tree_points_.capacity()*sizeof(int)+ids_.size()*sizeof(int)+
+                   rotations_.size()*veclen_*veclen_*sizeof(DistanceType)+dataset_.usedMemory());  // tree nodes, leaf point indices, rotations and dataset memory
     }
 
     /**
@@ -266,49 +374,150 @@ private:
 
 
     /*--------------------- Internal Data Structures --------------------------*/
-    struct Node
+
+    /**
+     * Tree node used while building a tree. The built tree is
+     * frozen into an array of Node structures (see freezeTree()).
+     */
+    struct BuildNode
     {
         /**
-         * Dimension used for subdivision.
+         * Dimension used for subdivision (position of the first point
+         * in vind_ for leaf nodes).
          */
         int divfeat;
         /**
          * The values used for subdivision.
          */
         DistanceType divval;
+        /**
+         * Number of points in a leaf node.
+         */
+        int count;
         /**
          * The child nodes.
          */
-        Node* child1, * child2;
+        BuildNode* child1, * child2;
+    };
+    typedef BuildNode* BuildNodePtr;
+
+    /**
+     * Compact tree node. The nodes of a tree are stored contiguously in
+     * breadth-first order and the two children of a node are always
+     * adjacent, so a single relative offset is enough to reach them.
+     */
+    struct Node
+    {
+        /**
+         * Dimension used for subdivision. For leaf nodes, position of
+         * the first point of the leaf in the tree_points_ array.
+         */
+        int divfeat;
+        /**
+         * The value used for subdivision.
+         */
+        DistanceType divval;
+        /**
+         * Offset from this node to its first child (the second child
+         * follows it). For leaf nodes, minus the number of points
+         * stored in the leaf.
+         */
+        int child;
+    };
+    typedef const Node* NodePtr;
+
+    /**
+     * Branch not taken during a search, with the tree it belongs to so that
+     * the search can resume it with the query rotated for that tree.
+     */
+    struct BranchSt : public BranchStruct<NodePtr, DistanceType>
+    {
+        int tree;
+
+        BranchSt() {}
+        BranchSt(NodePtr node, DistanceType mindist, int tree_) :
+            BranchStruct<NodePtr, DistanceType>(node, mindist), tree(tree_) {}
     };
-    typedef Node* NodePtr;
-    typedef BranchStruct<NodePtr, DistanceType> BranchSt;
     typedef BranchSt* Branch;
 
 
+    /**
+     * Re-lays a tree built by divideTree() into a contiguous array of
+     * nodes in breadth-first order.
+     *
+     * Params:
+     *     root = root of the tree to freeze
+     *     offset = position in tree_points_ at which the vind_ array of
+     *              the tree is stored
+     *     nodes = the array receiving the tree nodes
+     */
+    void freezeTree(BuildNodePtr root, int offset, std::vector<Node>& nodes)
+    {
+        std::vector<BuildNodePtr> queue;
+        queue.push_back(root);
+        nodes.clear();
+        for (size_t i=0; i<queue.size(); ++i) {
+            BuildNodePtr node = queue[i];
+            Node flat;
+            flat.divfeat = node->divfeat;
+            flat.divval = node->divval;
+            if (node->child1!=NULL) {
+                flat.child = int(queue.size()-i);
+                queue.push_back(node->child1);
+                queue.push_back(node->child2);
+            }
+            else {
+                flat.divfeat += offset;
+                flat.child = -node->count;
+            }
+            nodes.push_back(flat);
+        }
+    }
+
 
-    void save_tree(FILE* stream, NodePtr tree)
+    void save_removed(FILE* stream)
     {
-        save_value(stream, *tree);
-        if (tree->child1!=NULL) {
-            save_tree(stream, tree->child1);
+        std::vector<size_t> removed;
+        for (size_t i=0; i<size_; ++i) {
+            if (removed_points_.test(i)) removed.push_back(i);
         }
-        if (tree->child2!=NULL) {
-            save_tree(stream, tree->child2);
+        save_value(stream, removed);
+        save_value(stream, removed_count_);
+    }
+
+    void load_removed(FILE* stream)
+    {
+        std::vector<size_t> removed;
+        load_value(stream, removed);
+        load_value(stream, removed_count_);
+        removed_points_.resize(size_);
+        removed_points_.reset();
+        for (size_t i=0; i<removed.size(); ++i) {
+            removed_points_.set(removed[i]);
         }
+        size_at_build_ = size_ - removed.size() + removed_count_;
+        removed_at_build_ = removed.size() - removed_count_;
     }
 
 
-    void load_tree(FILE* stream, NodePtr& tree)
+    /**
+     * Replaces the dataset with a private copy in which the points are
+     * stored in the order of the leaves of the first tree (the current
+     * order of vind_), so that the points of a leaf are contiguous in
+     * memory. vind_ is updated to refer to the new positions and ids_
+     * maps the new positions back to the original point indices.
+     */
+    void reorderDataset()
     {
-        tree = new(pool_) Node();
-        load_value(stream, *tree);
-        if (tree->child1!=NULL) {
-            load_tree(stream, tree->child1);
-        }
-        if (tree->child2!=NULL) {
-            load_tree(stream, tree->child2);
+        ChunkedMatrix<ElementType> data(veclen_);
+        std::vector<int> ids(vind_.size());
+        for (size_t i=0; i<vind_.size(); ++i) {
+            data.push_back(dataset_[vind_[i]], vind_.size()-i);
+            ids[i] = ids_[vind_[i]];
+            vind_[i] = int(i);
         }
+        dataset_.swap(data);
+        ids_.swap(ids);
     }
 
 
@@ -317,29 +526,31 @@ private:
      * to vind[last].  The routine is called recursively on each sublist.
      * Place a pointer to this new tree node in the location pTree.
      *
-     * Params: pTree = the new node to create
-     *                  first = index of the first vector
-     *                  last = index of the last vector
+     * Params: points = the coordinates of the points (the dataset or its rotation)
+     *                  ind = indices of the vectors
+     *                  count = number of vectors
      */
-    NodePtr divideTree(int* ind, int count)
+    template <typename Points>
+    BuildNodePtr divideTree(const Points& points, int* ind, int count)
     {
-        NodePtr node = new(pool_) Node(); // allocate memory
+        BuildNodePtr node = new(pool_) BuildNode(); // allocate memory
 
         /* If too few exemplars remain, then make this a leaf node. */
-        if ( count == 1) {
+        if ( count <= leaf_max_size_) {
             node->child1 = node->child2 = NULL;    /* Mark as leaf node. */
-            node->divfeat = *ind;    /* Store index of this vec. */
+            node->divfeat = vind_.empty() ? 0 : int(ind - &vind_[0]);    /* Store position of the first vec. */
+            node->count = count;
         }
         else {
             int idx;
             int cutfeat;
             DistanceType cutval;
-            meanSplit(ind, count, idx, cutfeat, cutval);
+            meanSplit(points, ind, count, idx, cutfeat, cutval);
 
             node->divfeat = cutfeat;
             node->divval = cutval;
-            node->child1 = divideTree(ind, idx);
-            node->child2 = divideTree(ind+idx, count-idx);
+            node->child1 = divideTree(points, ind, idx);
+            node->child2 = divideTree(points, ind+idx, count-idx);
         }
 
         return node;
@@ -351,7 +562,8 @@ private:
      * Make a random choice among those with the highest variance, and use
      * its variance as the threshold value.
      */
-    void meanSplit(int* ind, int count, int& index, int& cutfeat, DistanceType& cutval)
+    template <typename Points>
+    void meanSplit(const Points& points, int* ind, int count, int& index, int& cutfeat, DistanceType& cutval)
     {
         memset(mean_,0,veclen_*sizeof(DistanceType));
         memset(var_,0,veclen_*sizeof(DistanceType));
@@ -361,9 +573,8 @@ private:
          */
         int cnt = std::min((int)SAMPLE_MEAN+1, count);
         for (int j = 0; j < cnt; ++j) {
-            ElementType* v = dataset_[ind[j]];
             for (size_t k=0; k<veclen_; ++k) {
-                mean_[k] += v[k];
+                mean_[k] += points[ind[j]][k];
             }
         }
         for (size_t k=0; k<veclen_; ++k) {
@@ -372,9 +583,8 @@ private:
 
         /* Compute variances (no need to divide by count). */
         for (int j = 0; j < cnt; ++j) {
-            ElementType* v = dataset_[ind[j]];
             for (size_t k=0; k<veclen_; ++k) {
-                DistanceType dist = v[k] - mean_[k];
+                DistanceType dist = points[ind[j]][k] - mean_[k];
                 var_[k] += dist * dist;
             }
         }
@@ -383,7 +593,7 @@ private:
         cutval = mean_[cutfeat];
 
         int lim1, lim2;
-        planeSplit(ind, count, cutfeat, cutval, lim1, lim2);
+        planeSplit(points, ind, count, cutfeat, cutval, lim1, lim2);
 
         if (lim1>count/2) index = lim1;
         else if (lim2<count/2) index = lim2;
@@ -438,22 +648,23 @@ private:
      *  dataset[ind[lim1..lim2-1]][cutfeat]==cutval
      *  dataset[ind[lim2..count]][cutfeat]>cutval
      */
-    void planeSplit(int* ind, int count, int cutfeat, DistanceType cutval, int& lim1, int& lim2)
+    template <typename Points>
+    void planeSplit(const Points& points, int* ind, int count, int cutfeat, DistanceType cutval, int& lim1, int& lim2)
     {
         /* Move vector indices for left subtree to front of list. */
         int left = 0;
         int right = count-1;
         for (;; ) {
-            while (left<=right && dataset_[ind[left]][cutfeat]<cutval) ++left;
-            while (left<=right && dataset_[ind[right]][cutfeat]>=cutval) --right;
+            while (left<=right && points[ind[left]][cutfeat]<cutval) ++left;
+            while (left<=right && points[ind[right]][cutfeat]>=cutval) --right;
             if (left>right) break;
             std::swap(ind[left], ind[right]); ++left; --right;
         }
         lim1 = left;
         right = count-1;
         for (;; ) {
-            while (left<=right && dataset_[ind[left]][cutfeat]<=cutval) ++left;
-            while (left<=right && dataset_[ind[right]][cutfeat]>cutval) --right;
+            while (left<=right && points[ind[left]][cutfeat]<=cutval) ++left;
+            while (left<=right && points[ind[right]][cutfeat]>cutval) --right;
             if (left>right) break;
             std::swap(ind[left], ind[right]); ++left; --right;
         }
@@ -473,7 +684,14 @@ private:
             fprintf(stderr,"It doesn't make any sense to use more than one tree for exact search");
         }
         if (trees_>0) {
-            searchLevelExact(result, vec, tree_roots_[0], 0.0, epsError);
+            if (rotate_) {
+                std::vector<DistanceType> rotated(veclen_);
+                rotateVector(&rotations_[0][0], vec, &rotated[0]);
+                searchLevelExact(result, vec, &rotated[0], &tree_nodes_[0][0], 0.0, epsError);
+            }
+            else {
+                searchLevelExact(result, vec, vec, &tree_nodes_[0][0], 0.0, epsError);
+            }
         }
     }
 
@@ -492,14 +710,31 @@ private:
         Heap<BranchSt>* heap = new Heap<BranchSt>((int)size_);
         DynamicBitset checked(size_);
 
-        /* Search once through each tree down to root. */
-        for (i = 0; i < trees_; ++i) {
-            searchLevel(result, vec, tree_roots_[i], 0, checkCount, maxCheck, epsError, heap, checked);
+        if (rotate_) {
+            /* Rotate the query once for each tree, the trees are descended
+               using the rotated query. */
+            std::vector<DistanceType> rotated(trees_*veclen_);
+            for (i = 0; i < trees_; ++i) {
+                rotateVector(&rotations_[i][0], vec, &rotated[i*veclen_]);
+            }
+            for (i = 0; i < trees_; ++i) {
+                searchLevel(result, vec, &rotated[i*veclen_], &tree_nodes_[i][0], i, 0, checkCount, maxCheck, epsError, heap, checked);
+            }
+            while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
+                const DistanceType* query = &rotated[branch.tree*veclen_];
+                searchLevel(result, vec, query, branch.node, branch.tree, branch.mindist, checkCount, maxCheck, epsError, heap, checked);
+            }
         }
+        else {
+            /* Search once through each tree down to root. */
+            for (i = 0; i < trees_; ++i) {
+                searchLevel(result, vec, vec, &tree_nodes_[i][0], i, 0, checkCount, maxCheck, epsError, heap, checked);
+            }
 
-        /* Keep searching other branches from heap until finished. */
-        while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
-            searchLevel(result, vec, branch.node, branch.mindist, checkCount, maxCheck, epsError, heap, checked);
+            /* Keep searching other branches from heap until finished. */
+            while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
+                searchLevel(result, vec, vec, branch.node, branch.tree, branch.mindist, checkCount, maxCheck, epsError, heap, checked);
+            }
         }
 
         delete heap;
@@ -510,10 +745,11 @@ private:
     /**
      *  Search starting from a given node of the tree.  Based on any mismatches at
      *  higher levels, all exemplars below this level must have a distance of
-     *  at least "mindistsq".
+     *  at least "mindistsq". The tree is descended using the coordinates of
+     *  the query in tree space (the query itself or its rotation).
      */
-    template<typename ResultSet>
-    void searchLevel(ResultSet& result_set, const ElementType* vec, NodePtr node, DistanceType mindist, int& checkCount, int maxCheck,
+    template<typename ResultSet, typename QueryType>
+    void searchLevel(ResultSet& result_set, const ElementType* vec, const QueryType* query, NodePtr node, int tree, DistanceType mindist, int& checkCount, int maxCheck,
                      float epsError, Heap<BranchSt>* heap, DynamicBitset& checked)
     {
         if (result_set.worstDist()<mindist) {
@@ -521,66 +757,75 @@ private:
             return;
         }
 
-        /* If this is a leaf node, then do check and return. */
-        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
+        /* Descend to a leaf, following the closest child at each level. */
+        while (node->child>0) {
+            /* Which child branch should be taken first? */
+            QueryType val = query[node->divfeat];
+            DistanceType diff = val - node->divval;
+            NodePtr bestChild = (diff < 0) ? node+node->child : node+node->child+1;
+            NodePtr otherChild = (diff < 0) ? node+node->child+1 : node+node->child;
+
+            /* Create a branch record for the branch not taken.  Add distance
+                of this feature boundary (we don't attempt to correct for any
+                use of this feature in a parent node, which is unlikely to
+                happen and would have only a small effect).  Don't bother
+                adding more branches to heap after halfway point, as cost of
+                adding exceeds their value.
+             */
+
+            DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
+            //		if (2 * checkCount < maxCheck  ||  !result.full()) {
+            if ((new_distsq*epsError < result_set.worstDist())||  !result_set.full()) {
+                heap->insert( BranchSt(otherChild, new_distsq, tree) );
+            }
+
+            node = bestChild;
+        }
+
+        /* Check the points of the leaf. */
+        const int* points = &tree_points_[node->divfeat];
+        for (int i = 0; i < -node->child; ++i) {
             /*  Do not check same node more than once when searching multiple trees.
                 Once a vector is checked, we set its location in vind to the
                 current checkID.
              */
-            int index = node->divfeat;
-            if ( checked.test(index) || ((checkCount>=maxCheck)&& result_set.full()) ) return;
+            int index = points[i];
+            if (checked.test(index)) continue;
+            int id = reorder_ ? ids_[index] : index;
+            if (removed_count_>0 && removed_points_.test(id)) continue;
+            if ((checkCount>=maxCheck)&& result_set.full()) return;
             checked.set(index);
             checkCount++;
 
             DistanceType dist = distance_(dataset_[index], vec, veclen_);
-            result_set.addPoint(dist,index);
-
-            return;
+            result_set.addPoint(dist,id);
         }
-
-        /* Which child branch should be taken first? */
-        ElementType val = vec[node->divfeat];
-        DistanceType diff = val - node->divval;
-        NodePtr bestChild = (diff < 0) ? node->child1 : node->child2;
-        NodePtr otherChild = (diff < 0) ? node->child2 : node->child1;
-
-        /* Create a branch record for the branch not taken.  Add distance
-            of this feature boundary (we don't attempt to correct for any
-            use of this feature in a parent node, which is unlikely to
-            happen and would have only a small effect).  Don't bother
-            adding more branches to heap after halfway point, as cost of
-            adding exceeds their value.
-         */
-
-        DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
-        //		if (2 * checkCount < maxCheck  ||  !result.full()) {
-        if ((new_distsq*epsError < result_set.worstDist())||  !result_set.full()) {
-            heap->insert( BranchSt(otherChild, new_distsq) );
-        }
-
-        /* Call recursively to search next level down. */
-        searchLevel(result_set, vec, bestChild, mindist, checkCount, maxCheck, epsError, heap, checked);
     }
 
     /**
      * Performs an exact search in the tree starting from a node.
      */
-    template<typename ResultSet>
-    void searchLevelExact(ResultSet& result_set, const ElementType* vec, const NodePtr node, DistanceType mindist, const float epsError)
+    template<typename ResultSet, typename QueryType>
+    void searchLevelExact(ResultSet& result_set, const ElementType* vec, const QueryType* query, const NodePtr node, DistanceType mindist, const float epsError)
     {
         /* If this is a leaf node, then do check and return. */
-        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
-            int index = node->divfeat;
-            DistanceType dist = distance_(dataset_[index], vec, veclen_);
-            result_set.addPoint(dist,index);
+        if (node->child<=0) {
+            const int* points = &tree_points_[node->divfeat];
+            for (int i = 0; i < -node->child; ++i) {
+                int index = points[i];
+                int id = reorder_ ? ids_[index] : index;
+                if (removed_count_>0 && removed_points_.test(id)) continue;
+                DistanceType dist = distance_(dataset_[index], vec, veclen_);
+                result_set.addPoint(dist,id);
+            }
             return;
         }
 
         /* Which child branch should be taken first? */
-        ElementType val = vec[node->divfeat];
+        QueryType val = query[node->divfeat];
         DistanceType diff = val - node->divval;
-        NodePtr bestChild = (diff < 0) ? node->child1 : node->child2;
-        NodePtr otherChild = (diff < 0) ? node->child2 : node->child1;
+        NodePtr bestChild = (diff < 0) ? node+node->child : node+node->child+1;
+        NodePtr otherChild = (diff < 0) ? node+node->child+1 : node+node->child;
 
         /* Create a branch record for the branch not taken.  Add distance
             of this feature boundary (we don't attempt to correct for any
@@ -593,55 +838,219 @@ private:
         DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
 
         /* Call recursively to search next level down. */
-        searchLevelExact(result_set, vec, bestChild, mindist, epsError);
+        searchLevelExact(result_set, vec, query, bestChild, mindist, epsError);
 
         if (new_distsq*epsError<=result_set.worstDist()) {
-            searchLevelExact(result_set, vec, otherChild, new_distsq, epsError);
+            searchLevelExact(result_set, vec, query, otherChild, new_distsq, epsError);
         }
     }
     
-    void addPointToTree(NodePtr node, int ind)
+    /**
+     * Inserts a point in a frozen tree. The points of the leaf reached by
+     * the new point are copied, together with it, at the end of the
+     * tree_points_ array. If the leaf overflows it is split in two and the
+     * new leaves are appended at the end of the node array, so existing
+     * nodes keep their position.
+     *
+     * The slots left by the moved leaves are reclaimed when they make up
+     * half of the array.
+     */
+    void addPointToTree(int tree, int ind)
     {
-        
-        ElementType* point = dataset_[ind];
-        
-        if (node->child1==NULL && node->child2==NULL) {
-            ElementType* leaf_point = dataset_[node->divfeat];
-            ElementType max_span = 0;
-            size_t div_feat = 0;
-            for (size_t i=0;i<veclen();++i) {
-                ElementType span = abs(point[i]-leaf_point[i]);
-                if (span > max_span) {
-                    max_span = span;
-                    div_feat = i;
-                }
+        if (2*dead_points_>tree_points_.size()) {
+            compactTreePoints();
+        }
+
+        std::vector<Node>& nodes = tree_nodes_[tree];
+        std::vector<DistanceType> rotated;
+        if (rotate_) {
+            rotated.resize(veclen_);
+            rotateVector(&rotations_[tree][0], dataset_[ind], &rotated[0]);
+        }
+
+        size_t pos = 0;
+        while (nodes[pos].child>0) {
+            const Node& node = nodes[pos];
+            DistanceType val = rotate_ ? rotated[node.divfeat] : DistanceType(dataset_[ind][node.divfeat]);
+            pos += node.child + ((val<node.divval) ? 0 : 1);
+        }
+
+        int first = nodes[pos].divfeat;
+        int count = -nodes[pos].child;
+        if (size_t(first+count)!=tree_points_.size()) {
+            /* The leaf is not at the end of the array, move it there. */
+            int new_first = int(tree_points_.size());
+            for (int i=0; i<count; ++i) {
+                tree_points_.push_back(tree_points_[first+i]);
             }
-            NodePtr left = new(pool_) Node();
-            left->child1 = left->child2 = NULL;
-            NodePtr right = new(pool_) Node();
-            right->child1 = right->child2 = NULL;
+            first = new_first;
+            dead_points_ += count;
+        }
+        tree_points_.push_back(ind);
+        ++count;
+
+        nodes[pos].divfeat = first;
+        nodes[pos].child = -count;
+        if (count<=leaf_max_size_) {
+            return;
+        }
 
-            if (point[div_feat]<leaf_point[div_feat]) {
-                left->divfeat = ind;
-                right->divfeat = node->divfeat;
+        int* ind_begin = &tree_points_[first];
+        int div_feat;
+        DistanceType div_val;
+        int lim1;
+        if (rotate_) {
+            /* Split the leaf using the rotated coordinates of its points. */
+            Matrix<DistanceType> points(new DistanceType[count*veclen_], count, veclen_);
+            std::vector<int> local(count);
+            for (int j=0; j<count; ++j) {
+                rotateVector(&rotations_[tree][0], dataset_[ind_begin[j]], points[j]);
+                local[j] = j;
             }
-            else {
-                left->divfeat = node->divfeat;                
-                right->divfeat = ind;
+            splitLeaf(points, &local[0], count, div_feat, div_val, lim1);
+            std::vector<int> leaf_points(ind_begin, ind_begin+count);
+            for (int j=0; j<count; ++j) {
+                ind_begin[j] = leaf_points[local[j]];
             }
-            node->divfeat = div_feat;
-            node->divval = (point[div_feat]+leaf_point[div_feat])/2;
-            node->child1 = left;
-            node->child2 = right;            
+            delete[] points.ptr();
         }
         else {
-            if (point[node->divfeat]<node->divval) {
-                addPointToTree(node->child1,ind);
+            splitLeaf(dataset_, ind_begin, count, div_feat, div_val, lim1);
+        }
+
+        Node left, right;
+        left.divfeat = first;
+        left.child = -lim1;
+        right.divfeat = first+lim1;
+        right.child = -(count-lim1);
+
+        nodes[pos].divfeat = div_feat;
+        nodes[pos].divval = div_val;
+        nodes[pos].child = int(nodes.size()-pos);
+        nodes.push_back(left);
+        nodes.push_back(right);
+    }
+
+    /**
+     * Returns the number of points in the leaves of all the trees.
+     */
+    size_t countLeafPoints() const
+    {
+        size_t count = 0;
+        for (int i=0; i<trees_; ++i) {
+            const std::vector<Node>& nodes = tree_nodes_[i];
+            for (size_t j=0; j<nodes.size(); ++j) {
+                if (nodes[j].child<=0) count += -nodes[j].child;
             }
-            else {
-                addPointToTree(node->child2,ind);                
+        }
+        return count;
+    }
+
+    /**
+     * Copies the points of the leaves of all the trees in a new array,
+     * dropping the slots left by the leaves moved by addPointToTree().
+     */
+    void compactTreePoints()
+    {
+        std::vector<int> points;
+        points.reserve(tree_points_.size()-dead_points_);
+        for (int i=0; i<trees_; ++i) {
+            std::vector<Node>& nodes = tree_nodes_[i];
+            for (size_t j=0; j<nodes.size(); ++j) {
+                if (nodes[j].child>0) continue;
+                int first = nodes[j].divfeat;
+                nodes[j].divfeat = int(points.size());
+                points.insert(points.end(), tree_points_.begin()+first, tree_points_.begin()+first-nodes[j].child);
+            }
+        }
+        tree_points_.swap(points);
+        dead_points_ = 0;
+    }
+
+    /**
+     * Splits the points of an overflowing leaf at the middle of the dimension
+     * with the largest span. On return the first lim1 indices belong to the
+     * left child.
+     */
+    template <typename Points>
+    void splitLeaf(const Points& points, int* ind, int count, int& div_feat, DistanceType& div_val, int& lim1)
+    {
+        DistanceType max_span = 0;
+        div_feat = 0;
+        div_val = 0;
+        for (size_t i=0;i<veclen_;++i) {
+            DistanceType min_elem = points[ind[0]][i];
+            DistanceType max_elem = min_elem;
+            for (int j=1; j<count; ++j) {
+                DistanceType val = points[ind[j]][i];
+                if (val<min_elem) min_elem = val;
+                if (val>max_elem) max_elem = val;
+            }
+            DistanceType span = max_elem-min_elem;
+            if (span > max_span) {
+                max_span = span;
+                div_feat = int(i);
+                div_val = (min_elem+max_elem)/2;
             }
         }
+
+        int lim2;
+        planeSplit(points, ind, count, div_feat, div_val, lim1, lim2);
+        /* All the points are identical, split in the middle. */
+        if (lim1==0 || lim1==count) lim1 = count/2;
+    }
+
+    /**
+     * Generates a random orthogonal matrix (stored by rows) by
+     * orthonormalizing a matrix of gaussian random numbers.
+     */
+    void randomRotation(std::vector<DistanceType>& rotation)
+    {
+        std::vector<double> m(veclen_*veclen_);
+        for (size_t i=0; i<m.size(); ++i) {
+            double u1 = 1-rand_double();
+            double u2 = rand_double();
+            m[i] = sqrt(-2*log(u1))*cos(6.28318530717958647692*u2);
+        }
+        /* Modified Gram-Schmidt on the rows. */
+        for (size_t i=0; i<veclen_; ++i) {
+            double* row = &m[i*veclen_];
+            for (size_t j=0; j<i; ++j) {
+                const double* prev = &m[j*veclen_];
+                double dot = 0;
+                for (size_t k=0; k<veclen_; ++k) dot += row[k]*prev[k];
+                for (size_t k=0; k<veclen_; ++k) row[k] -= dot*prev[k];
+            }
+            double norm = 0;
+            for (size_t k=0; k<veclen_; ++k) norm += row[k]*row[k];
+            norm = sqrt(norm);
+            for (size_t k=0; k<veclen_; ++k) row[k] /= norm;
+        }
+        rotation.assign(m.begin(), m.end());
+    }
+
+    /**
+     * Multiplies a vector by a rotation matrix. The loop is unrolled so that
+     * the compiler can vectorize it.
+     */
+    template <typename T>
+    void rotateVector(const DistanceType* rotation, const T* vec, DistanceType* result) const
+    {
+        for (size_t r=0; r<veclen_; ++r) {
+            const DistanceType* row = rotation+r*veclen_;
+            DistanceType acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+            size_t k = 0;
+            for (; k+4<=veclen_; k+=4) {
+                acc0 += row[k]*vec[k];
+                acc1 += row[k+1]*vec[k+1];
+                acc2 += row[k+2]*vec[k+2];
+                acc3 += row[k+3]*vec[k+3];
+            }
+            for (; k<veclen_; ++k) {
+                acc0 += row[k]*vec[k];
+            }
+            result[r] = acc0+acc1+acc2+acc3;
+        }
     }
 
 private:
@@ -670,6 +1079,46 @@ private:
      */
     int trees_;
 
+    /**
+     * Maximum number of points in a leaf
+     */
+    int leaf_max_size_;
+
+    /**
+     * Whether the dataset is copied in the leaf order of the first tree
+     */
+    bool reorder_;
+
+    /**
+     * Original indices of the points of the reordered dataset
+     */
+    std::vector<int> ids_;
+
+    /**
+     * Whether each tree is built on a rotation of the data
+     */
+    bool rotate_;
+
+    /**
+     * Rotation matrix of each tree (veclen_ x veclen_, stored by rows)
+     */
+    std::vector<std::vector<DistanceType> > rotations_;
+
+    /**
+     * Points removed from the index, indexed by their ids
+     */
+    DynamicBitset removed_points_;
+
+    /**
+     * Number of removed points still stored in the trees
+     */
+    size_t removed_count_;
+
+    /**
+     * Number of removed points left out of the trees when they were last built
+     */
+    size_t removed_at_build_;
+
     /**
      *  Array of indices to vectors in the dataset.
      */
@@ -678,9 +1127,7 @@ private:
     /**
      * The dataset used by this index
      */
-    Matrix<ElementType> dataset_;
-    
-    bool ownDataset_;
+    ChunkedMatrix<ElementType> dataset_;
 
     IndexParams index_params_;
 
@@ -692,12 +1139,26 @@ private:
     DistanceType* var_;
 
     /**
-     * Array of k-d trees used to find neighbours.
+     * Array of k-d trees used to find neighbours, each one stored as
+     * a contiguous array of nodes.
+     */
+    std::vector<std::vector<Node> > tree_nodes_;
+
+    /**
+     * Indices of the points stored in the leaves of the trees. The points
+     * of a leaf are contiguous in this array.
+     */
+    std::vector<int> tree_points_;
+
+    /**
+     * Number of slots of tree_points_ left by the leaves moved to the end of
+     * the array when points are added
      */
-    NodePtr* tree_roots_;
+    size_t dead_points_;
 
     /**
-     * Pooled memory allocator.
+     * Pooled memory allocator, used for the temporary nodes
+     * created while building a tree.
      *
      * Using a pooled memory allocator is more efficient
      * than allocating memory directly when there is a large
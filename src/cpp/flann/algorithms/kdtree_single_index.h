@@ -33,9 +33,18 @@
 
 #include <algorithm>
 #include <map>
+#include <deque>
 #include <cassert>
 #include <cstring>
 
+#ifdef TBB
+#include <tbb/task_group.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/spin_mutex.h>
+#include <tbb/task_scheduler_init.h>
+#endif
+
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
 #include "flann/util/matrix.h"
@@ -50,11 +59,13 @@ namespace flann
 
 struct KDTreeSingleIndexParams : public IndexParams
 {
-    KDTreeSingleIndexParams(int leaf_max_size = 10, bool reorder = true)
+    KDTreeSingleIndexParams(int leaf_max_size = 10, bool reorder = true, int cores = 1)
     {
         (*this)["algorithm"] = FLANN_INDEX_KDTREE_SINGLE;
         (*this)["leaf_max_size"] = leaf_max_size;
         (*this)["reorder"] = reorder;
+        // how many cores to use when building the tree (only used with TBB)
+        (*this)["cores"] = cores;
     }
 };
 
@@ -89,6 +100,8 @@ public:
         dim_ = dataset_.cols;
         leaf_max_size_ = get_param(params,"leaf_max_size",10);
         reorder_ = get_param(params,"reorder",true) || get_param(index_params_, "copy_dataset", false);  
+        cores_ = get_param(params,"cores",1);
+        parallel_build_ = false;
 
         // Create a permutable array of indices to the input vectors.
         vind_.resize(size_);
@@ -115,8 +128,20 @@ public:
      */
     void buildIndex()
     {
-        computeBoundingBox(root_bbox_);
-        root_node_ = divideTree(0, size_, root_bbox_ );   // construct the tree
+#ifdef TBB
+        if (cores_ == 1) {
+#endif
+            buildTree();
+#ifdef TBB
+        }
+        else {
+            // Initialise the task scheduler for the use of Intel TBB parallel constructs
+            tbb::task_scheduler_init task_sched(cores_);
+            parallel_build_ = true;
+            buildTree();
+            parallel_build_ = false;
+        }
+#endif
 
         if (reorder_) {
             data_ = flann::Matrix<ElementType>(new ElementType[size_*dim_], size_, dim_);
@@ -127,6 +152,7 @@ public:
         else {
             data_ = dataset_;
         }
+        packBlocks();
     }    
 
     flann_algorithm_t getType() const
@@ -164,6 +190,7 @@ public:
         else {
             data_ = dataset_;
         }
+        packBlocks();
         load_tree(stream, root_node_);
 
 
@@ -194,7 +221,8 @@ public:
      */
     int usedMemory() const
     {
-        return pool_.usedMemory+pool_.wastedMemory+dataset_.rows*sizeof(int);  // pool memory and vind array memory
+        // pool memory, vind array memory and blocks of low dimensional points
+        return pool_.usedMemory+pool_.wastedMemory+dataset_.rows*sizeof(int)+blocks_.size()*sizeof(ElementType);
     }
 
     IndexParams getParameters() const
@@ -216,9 +244,105 @@ public:
     {
         float epsError = 1+searchParams.eps;
 
-        std::vector<DistanceType> dists(dim_,0);
-        DistanceType distsq = computeInitialDistances(vec, dists);
-        searchLevel(result, vec, root_node_, distsq, dists, epsError);
+        switch (dim_) {
+        case 1:
+            findNeighborsFixed<1>(result, vec, epsError);
+            break;
+        case 2:
+            findNeighborsFixed<2>(result, vec, epsError);
+            break;
+        case 3:
+            findNeighborsFixed<3>(result, vec, epsError);
+            break;
+        case 4:
+            findNeighborsFixed<4>(result, vec, epsError);
+            break;
+        default:
+            std::vector<DistanceType> dists(dim_,0);
+            DistanceType distsq = computeInitialDistances(vec, &dists[0]);
+            searchLevel<0>(result, vec, root_node_, distsq, &dists[0], epsError);
+        }
+    }
+
+    /**
+     * \brief Finds the k nearest neighbors of a whole set of query points
+     *
+     * A kd-tree is built over the query points and traversed together with
+     * the tree of the index, so that pairs of query and dataset nodes that
+     * are too far apart are pruned at once. This is faster than searching
+     * the query points one by one when there are many query points. The
+     * search is exact unless params.eps is set, params.checks is ignored.
+     *
+     * \param[in] queries The query points for which to find the nearest neighbors
+     * \param[out] indices The indices of the nearest neighbors found
+     * \param[out] dists Distances to the nearest neighbors found
+     * \param[in] knn Number of nearest neighbors to return
+     * \param[in] params Search parameters
+     * \returns Number of neighbors found
+     */
+    int knnJoin(const Matrix<ElementType>& queries, Matrix<int>& indices, Matrix<DistanceType>& dists, size_t knn, const SearchParams& params)
+    {
+        assert(queries.cols == veclen());
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+
+        std::vector<KNNSimpleResultSet<DistanceType> > results(queries.rows, KNNSimpleResultSet<DistanceType>(knn));
+        join(queries, results, params, true);
+
+        int count = 0;
+        for (size_t i = 0; i < queries.rows; i++) {
+            results[i].copy(indices[i], dists[i], knn, params.sorted);
+            count += results[i].size();
+        }
+        return count;
+    }
+
+    /**
+     * \brief Finds the neighbors within a radius of a whole set of query points
+     *
+     * Uses the same dual-tree traversal as knnJoin().
+     *
+     * \param[in] queries The query points
+     * \param[out] indices The indices of the neighbors found within the given radius
+     * \param[out] dists The distances to the neighbors found
+     * \param[in] radius The radius used for search
+     * \param[in] params Search parameters
+     * \returns Number of neighbors found
+     */
+    int radiusJoin(const Matrix<ElementType>& queries, std::vector< std::vector<int> >& indices,
+                   std::vector<std::vector<DistanceType> >& dists, float radius, const SearchParams& params)
+    {
+        assert(queries.cols == veclen());
+        int count = 0;
+
+        // just count neighbors
+        if (params.max_neighbors==0) {
+            std::vector<CountRadiusResultSet<DistanceType> > results(queries.rows, CountRadiusResultSet<DistanceType>(radius));
+            join(queries, results, params, false);
+            for (size_t i = 0; i < queries.rows; i++) {
+                count += results[i].size();
+            }
+            return count;
+        }
+
+        if (indices.size() < queries.rows ) indices.resize(queries.rows);
+        if (dists.size() < queries.rows ) dists.resize(queries.rows);
+
+        if (params.max_neighbors<0) {
+            // search for all neighbors
+            std::vector<RadiusResultSet<DistanceType> > results(queries.rows, RadiusResultSet<DistanceType>(radius));
+            join(queries, results, params, false);
+            count = copyJoinResults(results, indices, dists, queries.rows, params);
+        }
+        else {
+            // number of neighbors limited to max_neighbors
+            std::vector<KNNRadiusResultSet<DistanceType> > results(queries.rows, KNNRadiusResultSet<DistanceType>(radius, params.max_neighbors));
+            join(queries, results, params, false);
+            count = copyJoinResults(results, indices, dists, queries.rows, params);
+        }
+        return count;
     }
 
 private:
@@ -257,6 +381,126 @@ private:
     typedef BranchStruct<NodePtr, DistanceType> BranchSt;
     typedef BranchSt* Branch;
 
+    /**
+     * Node of the query tree used by the joins
+     */
+    struct JoinNode
+    {
+        /**
+         * Range of the query points of the node in JoinTree::ind
+         */
+        int left, right;
+        /**
+         * Positions of the children in JoinTree::nodes, -1 for a leaf
+         */
+        int child1, child2;
+        /**
+         * Largest distance to the current worst neighbor of the query
+         * points of the node
+         */
+        DistanceType bound;
+    };
+
+    /**
+     * Flattened query tree, with the exact bounding box of each node
+     */
+    struct JoinTree
+    {
+        JoinTree(const Matrix<ElementType>& queries_, const float epsError_, bool split_queries_first_) :
+            queries(queries_), epsError(epsError_), split_queries_first(split_queries_first_) {}
+
+        const Matrix<ElementType>& queries;
+        const float epsError;
+        /**
+         * If set, the query nodes are split down to the leaves before the
+         * index nodes, otherwise the node with the larger box is split first
+         */
+        const bool split_queries_first;
+        std::vector<int> ind;
+        std::vector<JoinNode> nodes;
+        /**
+         * Bounding boxes of the nodes, veclen() intervals per node
+         */
+        std::vector<Interval> boxes;
+        /**
+         * Distances between the box of the query node and the box of the
+         * index node in each dimension, veclen() values per depth of the
+         * query node. They are updated incrementally as the index nodes are
+         * split, like the distances of the single query search.
+         */
+        std::vector<DistanceType> dists;
+    };
+
+    /**
+     * Bounding boxes of the right children along the current path of the
+     * recursive tree construction, indexed by depth. Reused from one node
+     * to the next to avoid allocating a bounding box for every node.
+     */
+    typedef std::deque<BoundingBox> BoundingBoxStack;
+
+#ifdef TBB
+    /**
+     * Builds a subtree in a separate task
+     */
+    struct DivideTreeTask
+    {
+        DivideTreeTask(KDTreeSingleIndex* index, int left, int right, BoundingBox& bbox, NodePtr& node) :
+            index_(index), left_(left), right_(right), bbox_(bbox), node_(node) {}
+
+        void operator()() const
+        {
+            BoundingBoxStack stack;
+            node_ = index_->divideTree(left_, right_, bbox_, stack, 0);
+        }
+
+        KDTreeSingleIndex* index_;
+        int left_, right_;
+        BoundingBox& bbox_;
+        NodePtr& node_;
+    };
+
+    /**
+     * Computes the range of values of some dimensions over a set of points
+     */
+    struct BoundsBody
+    {
+        BoundsBody(const KDTreeSingleIndex* index, const int* ind, size_t dim_begin, size_t dim_end) :
+            index_(index), ind_(ind), dim_begin_(dim_begin), dim_end_(dim_end), empty_(true), bbox_(dim_end-dim_begin) {}
+
+        BoundsBody(BoundsBody& other, tbb::split) :
+            index_(other.index_), ind_(other.ind_), dim_begin_(other.dim_begin_), dim_end_(other.dim_end_), empty_(true), bbox_(dim_end_-dim_begin_) {}
+
+        void operator()(const tbb::blocked_range<int>& r)
+        {
+            for (int k=r.begin(); k!=r.end(); ++k) {
+                const ElementType* point = index_->dataset_[ind_[k]];
+                for (size_t i=dim_begin_; i<dim_end_; ++i) {
+                    DistanceType val = (DistanceType)point[i];
+                    if (empty_ || val<bbox_[i-dim_begin_].low) bbox_[i-dim_begin_].low = val;
+                    if (empty_ || val>bbox_[i-dim_begin_].high) bbox_[i-dim_begin_].high = val;
+                }
+                empty_ = false;
+            }
+        }
+
+        void join(const BoundsBody& other)
+        {
+            if (other.empty_) return;
+            for (size_t i=0; i<bbox_.size(); ++i) {
+                if (empty_ || other.bbox_[i].low<bbox_[i].low) bbox_[i].low = other.bbox_[i].low;
+                if (empty_ || other.bbox_[i].high>bbox_[i].high) bbox_[i].high = other.bbox_[i].high;
+            }
+            empty_ = false;
+        }
+
+        const KDTreeSingleIndex* index_;
+        const int* ind_;
+        size_t dim_begin_, dim_end_;
+        bool empty_;
+        BoundingBox bbox_;
+    };
+#endif
+
 
 
 
@@ -285,9 +529,35 @@ private:
     }
 
 
+    /**
+     * Builds the tree, in parallel if parallel_build_ is set
+     */
+    void buildTree()
+    {
+        computeBoundingBox(root_bbox_);
+        BoundingBoxStack stack;
+        root_node_ = divideTree(0, size_, root_bbox_, stack, 0);   // construct the tree
+    }
+
+    NodePtr allocateNode()
+    {
+#ifdef TBB
+        tbb::spin_mutex::scoped_lock lock(pool_mutex_);
+#endif
+        return pool_.allocate<Node>();
+    }
+
     void computeBoundingBox(BoundingBox& bbox)
     {
         bbox.resize(dim_);
+#ifdef TBB
+        if (parallel_build_ && size_>PARALLEL_BUILD_SIZE) {
+            BoundsBody body(this, &vind_[0], 0, dim_);
+            tbb::parallel_reduce(tbb::blocked_range<int>(0, int(size_), PARALLEL_GRAIN_SIZE), body);
+            bbox = body.bbox_;
+            return;
+        }
+#endif
         for (size_t i=0; i<dim_; ++i) {
             bbox[i].low = (DistanceType)dataset_[0][i];
             bbox[i].high = (DistanceType)dataset_[0][i];
@@ -306,13 +576,16 @@ private:
      * to vind[last].  The routine is called recursively on each sublist.
      * Place a pointer to this new tree node in the location pTree.
      *
-     * Params: pTree = the new node to create
-     *                  first = index of the first vector
-     *                  last = index of the last vector
+     * Params: left = index of the first vector
+     *         right = index after the last vector
+     *         bbox = approximate bounding box of the vectors on input, set to
+     *                their exact bounding box on return
+     *         stack = bounding boxes used by the nodes of the current path
+     *         depth = depth of the node in the stack
      */
-    NodePtr divideTree(int left, int right, BoundingBox& bbox)
+    NodePtr divideTree(int left, int right, BoundingBox& bbox, BoundingBoxStack& stack, size_t depth)
     {
-        NodePtr node = pool_.allocate<Node>(); // allocate memory
+        NodePtr node = allocateNode(); // allocate memory
 
         /* If too few exemplars remain, then make this a leaf node. */
         if ( (right-left) <= leaf_max_size_) {
@@ -340,20 +613,34 @@ private:
 
             node->divfeat = cutfeat;
 
-            BoundingBox left_bbox(bbox);
-            left_bbox[cutfeat].high = cutval;
-            node->child1 = divideTree(left, left+idx, left_bbox);
-
-            BoundingBox right_bbox(bbox);
+            /* The left child works in place on bbox, the right child on a copy
+               kept in the stack. */
+            if (stack.size()<=depth) stack.resize(depth+1);
+            BoundingBox& right_bbox = stack[depth];
+            right_bbox = bbox;
             right_bbox[cutfeat].low = cutval;
-            node->child2 = divideTree(left+idx, right, right_bbox);
+            bbox[cutfeat].high = cutval;
+
+#ifdef TBB
+            if (parallel_build_ && right-left>PARALLEL_BUILD_SIZE) {
+                tbb::task_group group;
+                group.run(DivideTreeTask(this, left, left+idx, bbox, node->child1));
+                node->child2 = divideTree(left+idx, right, right_bbox, stack, depth+1);
+                group.wait();
+            }
+            else
+#endif
+            {
+                node->child1 = divideTree(left, left+idx, bbox, stack, depth+1);
+                node->child2 = divideTree(left+idx, right, right_bbox, stack, depth+1);
+            }
 
-            node->divlow = left_bbox[cutfeat].high;
+            node->divlow = bbox[cutfeat].high;
             node->divhigh = right_bbox[cutfeat].low;
 
             for (size_t i=0; i<dim_; ++i) {
-            	bbox[i].low = std::min(left_bbox[i].low, right_bbox[i].low);
-            	bbox[i].high = std::max(left_bbox[i].high, right_bbox[i].high);
+            	bbox[i].low = std::min(bbox[i].low, right_bbox[i].low);
+            	bbox[i].high = std::max(bbox[i].high, right_bbox[i].high);
             }
         }
 
@@ -362,6 +649,15 @@ private:
 
     void computeMinMax(int* ind, int count, int dim, ElementType& min_elem, ElementType& max_elem)
     {
+#ifdef TBB
+        if (parallel_build_ && count>PARALLEL_BUILD_SIZE) {
+            BoundsBody body(this, ind, dim, dim+1);
+            tbb::parallel_reduce(tbb::blocked_range<int>(0, count, PARALLEL_GRAIN_SIZE), body);
+            min_elem = (ElementType)body.bbox_[0].low;
+            max_elem = (ElementType)body.bbox_[0].high;
+            return;
+        }
+#endif
         min_elem = dataset_[ind[0]][dim];
         max_elem = dataset_[ind[0]][dim];
         for (int i=1; i<count; ++i) {
@@ -492,7 +788,21 @@ private:
         lim2 = left;
     }
 
-    DistanceType computeInitialDistances(const ElementType* vec, std::vector<DistanceType>& dists)
+    /**
+     * Search for data with a small, fixed dimensionality: the distances to
+     * the cells are kept on the stack and the compiler can unroll the
+     * distance computations.
+     */
+    template <int DIM, typename ResultSet>
+    void findNeighborsFixed(ResultSet& result, const ElementType* vec, const float epsError)
+    {
+        DistanceType dists[DIM];
+        std::fill(dists, dists+DIM, DistanceType(0));
+        DistanceType distsq = computeInitialDistances(vec, dists);
+        searchLevel<DIM>(result, vec, root_node_, distsq, dists, epsError);
+    }
+
+    DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists)
     {
         DistanceType distsq = 0.0;
 
@@ -510,19 +820,358 @@ private:
         return distsq;
     }
 
+    /**
+     * Searches the neighbors of all the query points with a dual-tree
+     * traversal, one result set per query point.
+     *
+     * With shrinking kNN bounds the query points should see their closest
+     * index leaves first, so the query tree is then split down to its
+     * leaves before the index tree; each query leaf then traverses the
+     * index tree once for all its points. With a fixed radius the larger of
+     * the two nodes is split first.
+     */
+    template <typename ResultSet>
+    void join(const Matrix<ElementType>& queries, std::vector<ResultSet>& results, const SearchParams& params, bool split_queries_first)
+    {
+        if (queries.rows==0) return;
+
+        // build the query tree with the same algorithm as the index tree
+        KDTreeSingleIndex query_index(queries, KDTreeSingleIndexParams(leaf_max_size_, false), distance_);
+        query_index.buildIndex();
+
+        JoinTree tree(queries, 1+params.eps, split_queries_first);
+        tree.ind = query_index.vind_;
+        flattenQueryTree(tree, query_index.root_node_, results[0].worstDist(), 0);
+
+        BoundingBox bbox(root_bbox_);
+        DistanceType distsq = boxDistance(&tree.boxes[0], bbox, &tree.dists[0]);
+        switch (dim_) {
+        case 1:
+            joinLevel<1>(tree, results, 0, 0, root_node_, bbox, distsq);
+            break;
+        case 2:
+            joinLevel<2>(tree, results, 0, 0, root_node_, bbox, distsq);
+            break;
+        case 3:
+            joinLevel<3>(tree, results, 0, 0, root_node_, bbox, distsq);
+            break;
+        case 4:
+            joinLevel<4>(tree, results, 0, 0, root_node_, bbox, distsq);
+            break;
+        default:
+            joinLevel<0>(tree, results, 0, 0, root_node_, bbox, distsq);
+        }
+    }
+
+    /**
+     * Copies the query tree rooted at a node into a JoinTree.
+     * Returns the position of the node.
+     */
+    int flattenQueryTree(JoinTree& tree, const NodePtr node, DistanceType bound, size_t depth)
+    {
+        int pos = tree.nodes.size();
+        tree.nodes.push_back(JoinNode());
+        tree.boxes.resize(tree.boxes.size()+dim_);
+        tree.dists.resize(std::max(tree.dists.size(), (depth+1)*dim_));
+        tree.nodes[pos].bound = bound;
+
+        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
+            tree.nodes[pos].left = node->left;
+            tree.nodes[pos].right = node->right;
+            tree.nodes[pos].child1 = tree.nodes[pos].child2 = -1;
+            Interval* box = &tree.boxes[pos*dim_];
+            for (size_t i=0; i<dim_; ++i) {
+                box[i].low = box[i].high = (DistanceType)tree.queries[tree.ind[node->left]][i];
+            }
+            for (int k=node->left+1; k<node->right; ++k) {
+                const ElementType* point = tree.queries[tree.ind[k]];
+                for (size_t i=0; i<dim_; ++i) {
+                    if (point[i]<box[i].low) box[i].low = (DistanceType)point[i];
+                    if (point[i]>box[i].high) box[i].high = (DistanceType)point[i];
+                }
+            }
+        }
+        else {
+            int child1 = flattenQueryTree(tree, node->child1, bound, depth+1);
+            int child2 = flattenQueryTree(tree, node->child2, bound, depth+1);
+            tree.nodes[pos].left = tree.nodes[child1].left;
+            tree.nodes[pos].right = tree.nodes[child2].right;
+            tree.nodes[pos].child1 = child1;
+            tree.nodes[pos].child2 = child2;
+            Interval* box = &tree.boxes[pos*dim_];
+            const Interval* box1 = &tree.boxes[child1*dim_];
+            const Interval* box2 = &tree.boxes[child2*dim_];
+            for (size_t i=0; i<dim_; ++i) {
+                box[i].low = std::min(box1[i].low, box2[i].low);
+                box[i].high = std::max(box1[i].high, box2[i].high);
+            }
+        }
+        return pos;
+    }
+
+    /**
+     * Lower bound of the distance between the points of two bounding boxes
+     * Params:
+     *     dists = receives the distance in each dimension
+     */
+    DistanceType boxDistance(const Interval* box1, const BoundingBox& box2, DistanceType* dists)
+    {
+        DistanceType distsq = 0;
+        for (size_t i=0; i<dim_; ++i) {
+            dists[i] = intervalDistance(box1[i], box2[i].low, box2[i].high, i);
+            distsq += dists[i];
+        }
+        return distsq;
+    }
+
+    /**
+     * Lower bound of the distance between the points of two intervals of a dimension
+     */
+    DistanceType intervalDistance(const Interval& interval, DistanceType low, DistanceType high, size_t dim)
+    {
+        if (interval.high<low) return distance_.accum_dist(interval.high, low, dim);
+        if (high<interval.low) return distance_.accum_dist(interval.low, high, dim);
+        return 0;
+    }
+
+    /**
+     * Lower bound of the distance between a point and the points of a
+     * bounding box
+     */
+    template <int DIM>
+    DistanceType pointDistance(const ElementType* vec, const BoundingBox& bbox)
+    {
+        const size_t dim = (DIM>0) ? DIM : dim_;
+        DistanceType distsq = 0;
+        for (size_t i=0; i<dim; ++i) {
+            if (vec[i]<bbox[i].low) {
+                distsq += distance_.accum_dist(vec[i], bbox[i].low, i);
+            }
+            else if (vec[i]>bbox[i].high) {
+                distsq += distance_.accum_dist(vec[i], bbox[i].high, i);
+            }
+        }
+        return distsq;
+    }
+
+    /**
+     * Largest side of a bounding box
+     */
+    DistanceType boxSize(const Interval* box)
+    {
+        DistanceType size = 0;
+        for (size_t i=0; i<dim_; ++i) {
+            size = std::max(size, box[i].high-box[i].low);
+        }
+        return size;
+    }
+
+    /**
+     * Searches the neighbors of the query points of a query tree node among
+     * the points of an index tree node.
+     *
+     * Params:
+     *     tree = the query tree
+     *     results = result sets of the query points
+     *     qnode = position of the query node
+     *     qdepth = depth of the query node, its distances to the index node
+     *              are in tree.dists
+     *     node = the index node
+     *     bbox = bounding box of the index node, restored on return
+     *     distsq = lower bound of the distance between the two nodes
+     *
+     * A pair of nodes is pruned when the lower bound of the distance between
+     * them is larger than the bound of the query node, the largest distance
+     * to the current worst neighbor of its query points.
+     *
+     * DIM is the dimensionality of the data when known at compile time, or 0.
+     */
+    template <int DIM, typename ResultSet>
+    void joinLevel(JoinTree& tree, std::vector<ResultSet>& results, int qnode, size_t qdepth, const NodePtr node,
+                   BoundingBox& bbox, DistanceType distsq)
+    {
+        JoinNode& query = tree.nodes[qnode];
+        if (distsq*tree.epsError>query.bound) return;
+
+        const Interval* qbox = &tree.boxes[qnode*dim_];
+        bool query_leaf = query.child1<0;
+        bool index_leaf = (node->child1 == NULL)&&(node->child2 == NULL);
+
+        if (query_leaf && index_leaf) {
+            DistanceType bound = 0;
+            for (int j=query.left; j<query.right; ++j) {
+                int q = tree.ind[j];
+                ResultSet& result_set = results[q];
+                const ElementType* vec = tree.queries[q];
+                DistanceType worst_dist = result_set.worstDist();
+                if (pointDistance<DIM>(vec, bbox)*tree.epsError>worst_dist) {
+                    bound = std::max(bound, worst_dist);
+                    continue;
+                }
+                if (DIM>0 && reorder_) {
+                    searchLeafFixed<DIM>(result_set, vec, node);
+                }
+                else {
+                    const size_t dim = (DIM>0) ? DIM : dim_;
+                    for (int i=node->left; i<node->right; ++i) {
+                        int index = reorder_ ? i : vind_[i];
+                        DistanceType dist = distance_(vec, data_[index], dim, worst_dist);
+                        if (dist<worst_dist) {
+                            result_set.addPoint(dist,vind_[i]);
+                        }
+                    }
+                }
+                bound = std::max(bound, result_set.worstDist());
+            }
+            query.bound = bound;
+            return;
+        }
+
+        if (index_leaf || (!query_leaf && (tree.split_queries_first || boxSize(qbox)>=boxSize(&bbox[0])))) {
+            // split the query node, the distances of the children are
+            // computed from scratch one level deeper in tree.dists
+            int child1 = query.child1;
+            int child2 = query.child2;
+            DistanceType* child_dists = &tree.dists[(qdepth+1)*dim_];
+            distsq = boxDistance(&tree.boxes[child1*dim_], bbox, child_dists);
+            joinLevel<DIM>(tree, results, child1, qdepth+1, node, bbox, distsq);
+            distsq = boxDistance(&tree.boxes[child2*dim_], bbox, child_dists);
+            joinLevel<DIM>(tree, results, child2, qdepth+1, node, bbox, distsq);
+            tree.nodes[qnode].bound = std::max(tree.nodes[child1].bound, tree.nodes[child2].bound);
+            return;
+        }
+
+        // split the index node, visiting the closest child first; the
+        // children only differ from the node in the split dimension
+        DistanceType* dists = &tree.dists[qdepth*dim_];
+        int idx = node->divfeat;
+        DistanceType high = bbox[idx].high;
+        DistanceType low = bbox[idx].low;
+        DistanceType dst = dists[idx];
+        DistanceType cut_dist1 = intervalDistance(qbox[idx], low, node->divlow, idx);
+        DistanceType cut_dist2 = intervalDistance(qbox[idx], node->divhigh, high, idx);
+        DistanceType dist1 = distsq + cut_dist1 - dst;
+        DistanceType dist2 = distsq + cut_dist2 - dst;
+
+        // on ties, start on the side of the center of the query node
+        // (the bound of the query node is checked again before the second
+        // child, it has shrunk while the first one was searched)
+        if (dist1<dist2 || (dist1==dist2 && qbox[idx].low+qbox[idx].high<=node->divlow+node->divhigh)) {
+            bbox[idx].high = node->divlow;
+            dists[idx] = cut_dist1;
+            joinLevel<DIM>(tree, results, qnode, qdepth, node->child1, bbox, dist1);
+            bbox[idx].high = high;
+            if (dist2*tree.epsError<=tree.nodes[qnode].bound) {
+                bbox[idx].low = node->divhigh;
+                dists[idx] = cut_dist2;
+                joinLevel<DIM>(tree, results, qnode, qdepth, node->child2, bbox, dist2);
+                bbox[idx].low = low;
+            }
+        }
+        else {
+            bbox[idx].low = node->divhigh;
+            dists[idx] = cut_dist2;
+            joinLevel<DIM>(tree, results, qnode, qdepth, node->child2, bbox, dist2);
+            bbox[idx].low = low;
+            if (dist1*tree.epsError<=tree.nodes[qnode].bound) {
+                bbox[idx].high = node->divlow;
+                dists[idx] = cut_dist1;
+                joinLevel<DIM>(tree, results, qnode, qdepth, node->child1, bbox, dist1);
+                bbox[idx].high = high;
+            }
+        }
+        dists[idx] = dst;
+    }
+
+    template <typename ResultSet>
+    int copyJoinResults(std::vector<ResultSet>& results, std::vector< std::vector<int> >& indices,
+                        std::vector<std::vector<DistanceType> >& dists, size_t rows, const SearchParams& params)
+    {
+        int count = 0;
+        for (size_t i = 0; i < rows; i++) {
+            size_t n = results[i].size();
+            count += n;
+            indices[i].resize(n);
+            dists[i].resize(n);
+            if (n > 0) {
+                results[i].copy(&indices[i][0], &dists[i][0], n, params.sorted);
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Copies the reordered points of low dimensional data in blocks_: each
+     * block holds LEAF_BLOCK_SIZE consecutive points stored by dimension,
+     * the last one is padded with zeros.
+     */
+    void packBlocks()
+    {
+        blocks_.clear();
+        if (!reorder_ || dim_>MAX_FIXED_DIM) return;
+        size_t block_count = (size_+LEAF_BLOCK_SIZE-1)/LEAF_BLOCK_SIZE;
+        blocks_.resize(block_count*dim_*LEAF_BLOCK_SIZE, ElementType(0));
+        for (size_t i=0; i<size_; ++i) {
+            ElementType* block = &blocks_[(i/LEAF_BLOCK_SIZE)*dim_*LEAF_BLOCK_SIZE];
+            for (size_t k=0; k<dim_; ++k) {
+                block[k*LEAF_BLOCK_SIZE+i%LEAF_BLOCK_SIZE] = data_[i][k];
+            }
+        }
+    }
+
+    /**
+     * Checks the points of a leaf when the dimensionality is known at compile
+     * time and the points are stored in tree order. The distances of all the
+     * points of each block overlapping the leaf are computed first, from the
+     * coordinates stored by dimension, so that the loops have a constant
+     * length and are vectorized. The closer points of the leaf are then
+     * added to the result set.
+     */
+    template<int DIM, typename ResultSet>
+    void searchLeafFixed(ResultSet& result_set, const ElementType* vec, const NodePtr node)
+    {
+        DistanceType leaf_dists[LEAF_BLOCK_SIZE];
+        for (int b=node->left/LEAF_BLOCK_SIZE; b*LEAF_BLOCK_SIZE<node->right; ++b) {
+            const ElementType* block = &blocks_[size_t(b)*DIM*LEAF_BLOCK_SIZE];
+            std::fill(leaf_dists, leaf_dists+LEAF_BLOCK_SIZE, DistanceType(0));
+            for (int k=0; k<DIM; ++k) {
+                const ElementType value = vec[k];
+                for (int j=0; j<LEAF_BLOCK_SIZE; ++j) {
+                    leaf_dists[j] += distance_.accum_dist(value, block[k*LEAF_BLOCK_SIZE+j], k);
+                }
+            }
+            int first = std::max(node->left, b*LEAF_BLOCK_SIZE);
+            int last = std::min(node->right, (b+1)*LEAF_BLOCK_SIZE);
+            DistanceType worst_dist = result_set.worstDist();
+            for (int i=first; i<last; ++i) {
+                DistanceType dist = leaf_dists[i-b*LEAF_BLOCK_SIZE];
+                if (dist<worst_dist) {
+                    result_set.addPoint(dist,vind_[i]);
+                }
+            }
+        }
+    }
+
     /**
      * Performs an exact search in the tree starting from a node.
+     *
+     * DIM is the dimensionality of the data when known at compile time, or 0.
      */
-    template<typename ResultSet>
+    template<int DIM, typename ResultSet>
     void searchLevel(ResultSet& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
-                     std::vector<DistanceType>& dists, const float epsError)
+                     DistanceType* dists, const float epsError)
     {
         /* If this is a leaf node, then do check and return. */
         if ((node->child1 == NULL)&&(node->child2 == NULL)) {
+            if (DIM>0 && reorder_) {
+                searchLeafFixed<DIM>(result_set, vec, node);
+                return;
+            }
+            const size_t dim = (DIM>0) ? DIM : dim_;
             DistanceType worst_dist = result_set.worstDist();
             for (int i=node->left; i<node->right; ++i) {
                 int index = reorder_ ? i : vind_[i];
-                DistanceType dist = distance_(vec, data_[index], dim_, worst_dist);
+                DistanceType dist = distance_(vec, data_[index], dim, worst_dist);
                 if (dist<worst_dist) {
                     result_set.addPoint(dist,vind_[i]);
                 }
@@ -551,19 +1200,43 @@ private:
         }
 
         /* Call recursively to search next level down. */
-        searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError);
+        searchLevel<DIM>(result_set, vec, bestChild, mindistsq, dists, epsError);
 
         DistanceType dst = dists[idx];
         mindistsq = mindistsq + cut_dist - dst;
         dists[idx] = cut_dist;
         if (mindistsq*epsError<=result_set.worstDist()) {
-            searchLevel(result_set, vec, otherChild, mindistsq, dists, epsError);
+            searchLevel<DIM>(result_set, vec, otherChild, mindistsq, dists, epsError);
         }
         dists[idx] = dst;
     }
 
 private:
 
+    enum
+    {
+        /**
+         * Subtrees with fewer points than this are built serially when the
+         * tree is built in parallel.
+         */
+        PARALLEL_BUILD_SIZE = 10000,
+        /**
+         * Number of points processed by a task when computing bounds in
+         * parallel.
+         */
+        PARALLEL_GRAIN_SIZE = 4096,
+        /**
+         * Number of leaf points whose distances are computed together when
+         * searching low dimensional data.
+         */
+        LEAF_BLOCK_SIZE = 8,
+        /**
+         * Largest dimensionality searched with a dimensionality known at
+         * compile time.
+         */
+        MAX_FIXED_DIM = 4
+    };
+
     /**
      * The dataset used by this index
      */
@@ -574,6 +1247,16 @@ private:
     int leaf_max_size_;
     bool reorder_;
 
+    /**
+     * Number of threads used to build the tree (only used with TBB)
+     */
+    int cores_;
+
+    /**
+     * Set while the tree is built in parallel
+     */
+    bool parallel_build_;
+
     /**
      *  Array of indices to vectors in the dataset.
      */
@@ -581,6 +1264,12 @@ private:
 
     Matrix<ElementType> data_;
 
+    /**
+     * The reordered points of low dimensional data, in blocks of points
+     * stored by dimension
+     */
+    std::vector<ElementType> blocks_;
+
     size_t size_;
     size_t dim_;
 
@@ -600,6 +1289,13 @@ private:
      */
     PooledAllocator pool_;
 
+#ifdef TBB
+    /**
+     * Serializes the node allocations of the build tasks
+     */
+    tbb::spin_mutex pool_mutex_;
+#endif
+
     Distance distance_;
 };   // class KDTree
 
@@ -38,10 +38,22 @@
 #include <limits>
 #include <cmath>
 
+#ifdef TBB
+#include <tbb/task_group.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/spin_mutex.h>
+#include <tbb/task_scheduler_init.h>
+#endif
+
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
 #include "flann/algorithms/dist.h"
+#include "flann/algorithms/center_chooser.h"
 #include "flann/util/matrix.h"
+#include "flann/util/chunked_matrix.h"
+#include "flann/util/dynamic_bitset.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
 #include "flann/util/allocator.h"
@@ -56,7 +68,9 @@ namespace flann
 struct KMeansIndexParams : public IndexParams
 {
     KMeansIndexParams(int branching = 32, int iterations = 11,
-                      flann_centers_init_t centers_init = FLANN_CENTERS_RANDOM, float cb_index = 0.2 )
+                      flann_centers_init_t centers_init = FLANN_CENTERS_RANDOM, float cb_index = 0.2, int cores = 1,
+                      flann_kmeans_assignment_t assignment = FLANN_KMEANS_LLOYD, int sample_size = 0,
+                      bool pack_leaves = false, int batch_levels = 0 )
     {
         (*this)["algorithm"] = FLANN_INDEX_KMEANS;
         // branching factor
@@ -67,6 +81,16 @@ struct KMeansIndexParams : public IndexParams
         (*this)["centers_init"] = centers_init;
         // cluster boundary index. Used when searching the kmeans tree
         (*this)["cb_index"] = cb_index;
+        // how many cores to use when building the tree (only used with TBB)
+        (*this)["cores"] = cores;
+        // algorithm used for assigning the points to the centers in the kmeans iterations
+        (*this)["assignment"] = assignment;
+        // number of points sampled for the kmeans iterations in the larger nodes (0 uses all the points)
+        (*this)["sample_size"] = sample_size;
+        // store copies of the leaf points contiguously, in leaf order
+        (*this)["pack_leaves"] = pack_leaves;
+        // number of top levels of the tree whose center distances are computed for blocks of queries at once
+        (*this)["batch_levels"] = batch_levels;
     }
 };
 
@@ -87,7 +111,7 @@ public:
     typedef bool needs_vector_space_distance;
 
 
-    typedef void (KMeansIndex::* centersAlgFunction)(int, int*, int, int*, int&);
+    typedef void (KMeansIndex::* centersAlgFunction)(int, int*, int, int*, int&, RandomState&);
 
     /**
      * The function used for choosing the cluster centers.
@@ -104,11 +128,16 @@ public:
      *     vecs = the dataset of points
      *     indices = indices in the dataset
      *     indices_length = length of indices vector
+     *     random = the random number generator
      *
      */
-    void chooseCentersRandom(int k, int* indices, int indices_length, int* centers, int& centers_length)
+    void chooseCentersRandom(int k, int* indices, int indices_length, int* centers, int& centers_length,
+                             RandomState& random)
     {
-        UniqueRandom r(indices_length);
+        // the positions not drawn yet are kept after the first 'drawn' ones
+        std::vector<int> positions(indices_length);
+        for (int i=0; i<indices_length; ++i) positions[i] = i;
+        int drawn = 0;
 
         int index;
         for (index=0; index<k; ++index) {
@@ -116,11 +145,12 @@ public:
             int rnd;
             while (duplicate) {
                 duplicate = false;
-                rnd = r.next();
-                if (rnd<0) {
+                if (drawn==indices_length) {
                     centers_length = index;
                     return;
                 }
+                std::swap(positions[drawn], positions[random.rand_int(indices_length, drawn)]);
+                rnd = positions[drawn++];
 
                 centers[index] = indices[rnd];
 
@@ -145,13 +175,15 @@ public:
      *     k = number of centers
      *     vecs = the dataset of points
      *     indices = indices in the dataset
+     *     random = the random number generator
      * Returns:
      */
-    void chooseCentersGonzales(int k, int* indices, int indices_length, int* centers, int& centers_length)
+    void chooseCentersGonzales(int k, int* indices, int indices_length, int* centers, int& centers_length,
+                               RandomState& random)
     {
         int n = indices_length;
 
-        int rnd = rand_int(n);
+        int rnd = random.rand_int(n);
         assert(rnd >=0 && rnd < n);
 
         centers[0] = indices[rnd];
@@ -196,9 +228,11 @@ public:
      *     k = number of centers
      *     vecs = the dataset of points
      *     indices = indices in the dataset
+     *     random = the random number generator
      * Returns:
      */
-    void chooseCentersKMeanspp(int k, int* indices, int indices_length, int* centers, int& centers_length)
+    void chooseCentersKMeanspp(int k, int* indices, int indices_length, int* centers, int& centers_length,
+                               RandomState& random)
     {
         int n = indices_length;
 
@@ -206,7 +240,7 @@ public:
         std::vector<DistanceType> closestDistSq(n);
 
         // Choose one random center and set the closestDistSq values
-        int index = rand_int(n);
+        int index = random.rand_int(n);
         assert(index >=0 && index < n);
         centers[0] = indices[index];
 
@@ -229,7 +263,7 @@ public:
 
                 // Choose our center - have to be slightly careful to return a valid answer even accounting
                 // for possible rounding errors
-                double randVal = rand_double(currentPot);
+                double randVal = random.rand_double(currentPot);
                 for (index = 0; index < n-1; index++) {
                     if (randVal <= closestDistSq[index]) break;
                     else randVal -= closestDistSq[index];
@@ -256,6 +290,25 @@ public:
     }
 
 
+    /**
+     * Chooses the initial centers using the k-means|| algorithm, which
+     * samples many candidate centers in a few passes over the points and
+     * then reduces them to k centers.
+     *
+     * Params:
+     *     k = number of centers
+     *     indices = indices in the dataset
+     *     indices_length = length of indices vector
+     *     random = the random number generator
+     */
+    void chooseCentersKMeansParallel(int k, int* indices, int indices_length, int* centers, int& centers_length,
+                                     RandomState& random)
+    {
+        KMeansParallelCenterChooser<Distance> chooser(distance_, dataset_, parallel_build_, random);
+        chooser(k, indices, indices_length, centers, centers_length);
+    }
+
+
 
 public:
 
@@ -273,12 +326,15 @@ public:
      */
     KMeansIndex(const Matrix<ElementType>& inputData, const IndexParams& params = KMeansIndexParams(),
                 Distance d = Distance())
-        : dataset_(inputData), index_params_(params), root_(NULL), distance_(d)
+        : dataset_(inputData, get_param(params,"copy_dataset",false)), index_params_(params), root_(NULL), distance_(d)
     {
         memoryCounter_ = 0;
 
         size_ = dataset_.rows;
         veclen_ = dataset_.cols;
+        removed_points_.resize(size_);
+        removed_count_ = 0;
+        removed_at_build_ = 0;
 
         branching_ = get_param(params,"branching",32);
         iterations_ = get_param(params,"iterations",11);
@@ -286,6 +342,21 @@ public:
             iterations_ = (std::numeric_limits<int>::max)();
         }
         centers_init_  = get_param(params,"centers_init",FLANN_CENTERS_RANDOM);
+        cores_ = get_param(params,"cores",1);
+        parallel_build_ = false;
+        assignment_ = get_param(params,"assignment",FLANN_KMEANS_LLOYD);
+        if (assignment_!=FLANN_KMEANS_LLOYD && !is_squared_euclidean<Distance>::value) {
+            Logger::warn("The accelerated k-means assignment needs the Euclidean distance, using Lloyd's algorithm\n");
+            assignment_ = FLANN_KMEANS_LLOYD;
+        }
+        sample_size_ = get_param(params,"sample_size",0);
+        pack_leaves_ = get_param(params,"pack_leaves",false);
+        batch_levels_ = get_param(params,"batch_levels",0);
+        if (batch_levels_>0 && !is_squared_euclidean<Distance>::value) {
+            Logger::warn("The batched k-means tree search needs the Euclidean distance, searching the queries one at a time\n");
+            batch_levels_ = 0;
+        }
+        batch_columns_ = 0;
 
         if (centers_init_==FLANN_CENTERS_RANDOM) {
             chooseCenters = &KMeansIndex::chooseCentersRandom;
@@ -296,18 +367,13 @@ public:
         else if (centers_init_==FLANN_CENTERS_KMEANSPP) {
             chooseCenters = &KMeansIndex::chooseCentersKMeanspp;
         }
+        else if (centers_init_==FLANN_CENTERS_KMEANSPARALLEL) {
+            chooseCenters = &KMeansIndex::chooseCentersKMeansParallel;
+        }
         else {
             throw FLANNException("Unknown algorithm for choosing initial centers.");
         }
         cb_index_ = 0.4f;
-        
-        ownDataset_ = get_param(index_params_, "copy_dataset", false);
-        if (ownDataset_) {
-            dataset_ = Matrix<ElementType>(new ElementType[inputData.rows * inputData.cols], inputData.rows, inputData.cols);
-            for (size_t i=0;i<inputData.rows;++i) {
-                std::copy(inputData[i], inputData[i]+inputData.cols, dataset_[i]);
-            }        
-        }
 
     }
 
@@ -327,9 +393,6 @@ public:
             freeNodes(root_);
             root_ = NULL;
         }
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
     }
 
     /**
@@ -360,7 +423,7 @@ public:
      */
     int usedMemory() const
     {
-        return pool_.usedMemory+pool_.wastedMemory+memoryCounter_;
+        return pool_.usedMemory+pool_.wastedMemory+memoryCounter_+int(packed_points_.size()*sizeof(ElementType));
     }
 
     /**
@@ -371,17 +434,45 @@ public:
         if (branching_<2) {
             throw FLANNException("Branching factor must be at least 2");
         }
+        if (sample_size_>0 && sample_size_<branching_) {
+            throw FLANNException("Sample size must be at least the branching factor");
+        }
 
-        indices_.resize(size_);
+        indices_.clear();
         for (size_t i=0; i<size_; ++i) {
-            indices_[i] = int(i);
+            if (!removed_points_.test(i)) {
+                indices_.push_back(int(i));
+            }
+        }
+        if (removed_count_>0) {
+            dataset_.release(removed_points_);
+            removed_count_ = 0;
         }
 
         root_ = new KMeansNode();
         computeNodeStatistics(root_, indices_);
-        computeClustering(root_, &indices_[0], (int)size_, branching_,0);
+        // each node draws its random numbers from its own generator, seeded by its parent,
+        // so that the tree is the same whatever the order the nodes are built in
+        unsigned int seed = (unsigned int)rand_int();
+#ifdef TBB
+        if (cores_ == 1) {
+#endif
+            computeClustering(root_, indices_.empty() ? NULL : &indices_[0], (int)indices_.size(), branching_, 0, seed);
+#ifdef TBB
+        }
+        else {
+            // Initialise the task scheduler for the use of Intel TBB parallel constructs
+            tbb::task_scheduler_init task_sched(cores_);
+            parallel_build_ = true;
+            computeClustering(root_, indices_.empty() ? NULL : &indices_[0], (int)indices_.size(), branching_, 0, seed);
+            parallel_build_ = false;
+        }
+#endif
+        packLeaves();
+        prepareBatchCenters();
         
-        size_at_build_ = size_;
+        size_at_build_ = indices_.size();
+        removed_at_build_ = size_ - size_at_build_;
     }
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
@@ -389,23 +480,11 @@ public:
         assert(points.cols==veclen());
         size_t old_size = size_;
 
-        size_t rows = dataset_.rows + points.rows;
-        Matrix<ElementType> new_dataset(new ElementType[rows * veclen()], rows, veclen());
-        for (size_t i=0;i<dataset_.rows;++i) {
-            std::copy(dataset_[i], dataset_[i]+dataset_.cols, new_dataset[i]);
-        }
-        for (size_t i=0;i<points.rows;++i) {
-            std::copy(points[i], points[i]+points.cols, new_dataset[dataset_.rows+i]);
-        }
-        
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
-        dataset_ = new_dataset;
+        dataset_.append(points);
         size_ += points.rows;
-        ownDataset_ = true;
+        removed_points_.resize(size_);
         
-        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_) {
+        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_-removed_at_build_-removed_count_) {
             freeNodes(root_);
             buildIndex();
         }
@@ -414,38 +493,77 @@ public:
                 DistanceType dist = distance_(root_->pivot, points[i], veclen_);
                 addPointToTree(root_, old_size + i, dist);
             }            
+            prepareBatchCenters();
+        }
+    }
+
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        removePoints(std::vector<size_t>(1, id), rebuild_threshold);
+    }
+
+    /**
+     * Marks points as removed, they are skipped by the searches. When the
+     * number of removed points exceeds rebuild_threshold times the number
+     * of points in the tree, the tree is rebuilt without them.
+     */
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        for (size_t i=0;i<ids.size();++i) {
+            if (ids[i]<size_ && !removed_points_.test(ids[i])) {
+                removed_points_.set(ids[i]);
+                removed_count_++;
+            }
+        }
+
+        if (rebuild_threshold>0 && removed_count_>size_at_build_*rebuild_threshold) {
+            freeNodes(root_);
+            buildIndex();
         }
     }
 
     void saveIndex(FILE* stream)
     {
+        // the removed points are saved since format 2
+        save_format(stream, "kmeans 2");
         save_value(stream, branching_);
         save_value(stream, iterations_);
         save_value(stream, memoryCounter_);
         save_value(stream, cb_index_);
+        save_value(stream, pack_leaves_);
+        save_value(stream, batch_levels_);
 
         save_tree(stream, root_);
+        save_removed(stream);
     }
 
 
     void loadIndex(FILE* stream)
     {
+        load_format(stream, "kmeans 2");
         load_value(stream, branching_);
         load_value(stream, iterations_);
         load_value(stream, memoryCounter_);
         load_value(stream, cb_index_);
+        load_value(stream, pack_leaves_);
+        load_value(stream, batch_levels_);
 
         if (root_!=NULL) {
             freeNodes(root_);
             root_ = NULL;
         }
         load_tree(stream, root_);
+        load_removed(stream);
+        packLeaves();
+        prepareBatchCenters();
 
         index_params_["algorithm"] = getType();
         index_params_["branching"] = branching_;
         index_params_["iterations"] = iterations_;
         index_params_["centers_init"] = centers_init_;
         index_params_["cb_index"] = cb_index_;
+        index_params_["pack_leaves"] = pack_leaves_;
+        index_params_["batch_levels"] = batch_levels_;
 
     }
 
@@ -458,9 +576,12 @@ public:
      *     result = the result object in which the indices of the nearest-neighbors are stored
      *     vec = the vector for which to search the nearest neighbors
      *     searchParams = parameters that influence the search algorithm (checks, cb_index)
+     *     center_dists = distances from vec to the centers of the top levels of the
+     *                    tree (see computeBatchDistances), or NULL
      */
     template <typename ResultSet>
-    void findNeighbors(ResultSet& result, const ElementType* vec, const SearchParams& searchParams)
+    void findNeighbors(ResultSet& result, const ElementType* vec, const SearchParams& searchParams,
+                       const DistanceType* center_dists = NULL)
     {
 
         int maxChecks = searchParams.checks;
@@ -473,12 +594,12 @@ public:
             Heap<BranchSt>* heap = new Heap<BranchSt>((int)size_);
 
             int checks = 0;
-            findNN(root_, result, vec, checks, maxChecks, heap);
+            findNN(root_, result, vec, checks, maxChecks, heap, center_dists);
 
             BranchSt branch;
             while (heap->popMin(branch) && (checks<maxChecks || !result.full())) {
                 KMeansNodePtr node = branch.node;
-                findNN(node, result, vec, checks, maxChecks, heap);
+                findNN(node, result, vec, checks, maxChecks, heap, center_dists);
             }
 
             delete heap;
@@ -486,6 +607,47 @@ public:
 
     }
 
+    using NNIndex<KMeansIndex<Distance>, ElementType, DistanceType>::knnSearch;
+
+    /**
+     * Perform k-nearest neighbor search. When the index has batch_levels
+     * set, the distances from blocks of queries to the centers of the top
+     * levels of the tree are computed at once, as a matrix product, and
+     * each query then descends the tree using them.
+     */
+    int knnSearch(const Matrix<ElementType>& queries, Matrix<int>& indices, Matrix<DistanceType>& dists, size_t knn,
+                  const SearchParams& params)
+    {
+        if (batch_columns_==0 || params.checks==FLANN_CHECKS_UNLIMITED) {
+            return NNIndex<KMeansIndex<Distance>, ElementType, DistanceType>::knnSearch(queries, indices, dists, knn, params);
+        }
+        assert(queries.cols == veclen());
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+
+        bool use_heap;
+        if (params.use_heap==FLANN_Undefined) {
+            use_heap = (knn>KNN_HEAP_THRESHOLD)?true:false;
+        }
+        else {
+            use_heap = (params.use_heap==FLANN_True)?true:false;
+        }
+
+        BatchSearchBody body(this, queries, indices, dists, knn, params, use_heap);
+#ifdef TBB
+        if (params.cores != 1) {
+            // Initialise the task scheduler for the use of Intel TBB parallel constructs
+            tbb::task_scheduler_init task_sched(params.cores);
+            tbb::parallel_reduce(tbb::blocked_range<size_t>(0, queries.rows, BATCH_SIZE), body);
+            return body.count_;
+        }
+#endif
+        body.process(0, queries.rows);
+        return body.count_;
+    }
+
     /**
      * Clustering function that takes a cut in the hierarchical k-means
      * tree and return the clusters centers of that clustering.
@@ -529,8 +691,12 @@ private:
      */
     struct KMeansNode
     {
+        KMeansNode() : pivot(NULL), radius(0), variance(0), size(0), child_centers(NULL), points(NULL), level(0),
+            column(-1), child_columns(-1) {}
+
         /**
-         * The cluster center.
+         * The cluster center (for a child node, a row of the child_centers
+         * of its parent).
          */
         DistanceType* pivot;
         /**
@@ -549,14 +715,37 @@ private:
          * Child nodes (only for non-terminal nodes)
          */
         std::vector<KMeansNode*> childs;
+        /**
+         * Centers of the child nodes, one row per child in a single block
+         * (only for non-terminal nodes)
+         */
+        DistanceType* child_centers;
+        /**
+         * Radiuses and variances of the child nodes, copied here so that the
+         * children are ranked without reading the child nodes
+         */
+        std::vector<DistanceType> child_radiuses;
+        std::vector<DistanceType> child_variances;
         /**
          * Node points (only for terminal nodes)
          */
         std::vector<int> indices;
+        /**
+         * Copies of the node points in the order of indices, in the packed
+         * storage of the index (only for terminal nodes when the leaves are
+         * packed, NULL for a leaf changed since the last packing)
+         */
+        ElementType* points;
         /**
          * Level
          */
         int level;
+        /**
+         * Columns of the pivot and of the first child center in the tables of
+         * distances computed for blocks of queries (-1 below the batched levels)
+         */
+        int column;
+        int child_columns;
     };
     typedef KMeansNode* KMeansNodePtr;
 
@@ -565,6 +754,604 @@ private:
      */
     typedef BranchStruct<KMeansNodePtr, DistanceType> BranchSt;
 
+    /**
+     * Assigns a range of points to their closest cluster centers, collecting
+     * the cluster radiuses and the changes in the cluster sizes.
+     */
+    struct AssignBody
+    {
+        AssignBody(const KMeansIndex* index, const int* indices, const Matrix<double>& dcenters, int branching,
+                   int* belongs_to, bool initial) :
+            index_(index), indices_(indices), dcenters_(dcenters), branching_(branching), belongs_to_(belongs_to),
+            initial_(initial), upper_(NULL), lower_(NULL), elkan_(false), radiuses_(branching,0), count_(branching,0),
+            changed_(false) {}
+
+        /**
+         * Sets the arrays receiving the initial bounds of the accelerated
+         * assignment
+         */
+        void setBounds(double* upper, double* lower, bool elkan)
+        {
+            upper_ = upper;
+            lower_ = lower;
+            elkan_ = elkan;
+        }
+
+#ifdef TBB
+        AssignBody(AssignBody& other, tbb::split) :
+            index_(other.index_), indices_(other.indices_), dcenters_(other.dcenters_), branching_(other.branching_),
+            belongs_to_(other.belongs_to_), initial_(other.initial_), upper_(other.upper_), lower_(other.lower_),
+            elkan_(other.elkan_), radiuses_(other.branching_,0), count_(other.branching_,0), changed_(false) {}
+
+        void operator()(const tbb::blocked_range<int>& r)
+        {
+            process(r.begin(), r.end());
+        }
+
+        void join(const AssignBody& other)
+        {
+            for (int j=0; j<branching_; ++j) {
+                radiuses_[j] = std::max(radiuses_[j], other.radiuses_[j]);
+                count_[j] += other.count_[j];
+            }
+            changed_ = changed_ || other.changed_;
+        }
+#endif
+
+        void process(int begin, int end)
+        {
+            size_t veclen = index_->veclen_;
+            for (int i=begin; i<end; ++i) {
+                const ElementType* vec = index_->dataset_[indices_[i]];
+                DistanceType sq_dist = index_->distance_(vec, dcenters_[0], veclen);
+                DistanceType second_sq = (std::numeric_limits<DistanceType>::max)();
+                int new_centroid = 0;
+                if (upper_!=NULL && elkan_) {
+                    lower_[size_t(i)*branching_] = sqrt(double(sq_dist));
+                }
+                for (int j=1; j<branching_; ++j) {
+                    DistanceType new_sq_dist = index_->distance_(vec, dcenters_[j], veclen);
+                    if (upper_!=NULL && elkan_) {
+                        lower_[size_t(i)*branching_+j] = sqrt(double(new_sq_dist));
+                    }
+                    if (sq_dist>new_sq_dist) {
+                        second_sq = sq_dist;
+                        new_centroid = j;
+                        sq_dist = new_sq_dist;
+                    }
+                    else if (second_sq>new_sq_dist) {
+                        second_sq = new_sq_dist;
+                    }
+                }
+                if (upper_!=NULL) {
+                    upper_[i] = sqrt(double(sq_dist));
+                    if (!elkan_) {
+                        lower_[i] = sqrt(double(second_sq));
+                    }
+                }
+                if (sq_dist>radiuses_[new_centroid]) {
+                    radiuses_[new_centroid] = sq_dist;
+                }
+                if (initial_) {
+                    belongs_to_[i] = new_centroid;
+                    count_[new_centroid]++;
+                }
+                else if (new_centroid != belongs_to_[i]) {
+                    count_[belongs_to_[i]]--;
+                    count_[new_centroid]++;
+                    belongs_to_[i] = new_centroid;
+                    changed_ = true;
+                }
+            }
+        }
+
+        const KMeansIndex* index_;
+        const int* indices_;
+        const Matrix<double>& dcenters_;
+        int branching_;
+        int* belongs_to_;
+        bool initial_;
+        double* upper_;
+        double* lower_;
+        bool elkan_;
+        std::vector<DistanceType> radiuses_;
+        std::vector<int> count_;
+        bool changed_;
+    };
+
+    /**
+     * Reassigns a range of points to their closest cluster centers, skipping
+     * the distance computations ruled out by the triangle inequality
+     * (Hamerly's or Elkan's algorithm). The distances used by the bounds
+     * are the square roots of the squared Euclidean distances.
+     *
+     * A distance is only skipped when its lower bound exceeds the upper bound
+     * of the distance to the current center by a small relative margin, and
+     * ties are broken as in the plain assignment, so that both give the same
+     * clusters.
+     */
+    struct BoundedAssignBody
+    {
+        BoundedAssignBody(const KMeansIndex* index, const int* indices, const Matrix<double>& dcenters, int branching,
+                          int* belongs_to, bool elkan, double* upper, double* lower, const double* drift,
+                          const double* half_cc, const double* half_min) :
+            index_(index), indices_(indices), dcenters_(dcenters), branching_(branching), belongs_to_(belongs_to),
+            elkan_(elkan), upper_(upper), lower_(lower), drift_(drift), half_cc_(half_cc), half_min_(half_min),
+            margin_(1+1e-4), count_(branching,0), changed_(false)
+        {
+            // the two largest center movements, for the Hamerly lower bounds
+            max_drift_ = 0;
+            second_drift_ = 0;
+            max_drift_index_ = 0;
+            for (int j=0; j<branching; ++j) {
+                if (drift[j]>max_drift_) {
+                    second_drift_ = max_drift_;
+                    max_drift_ = drift[j];
+                    max_drift_index_ = j;
+                }
+                else if (drift[j]>second_drift_) {
+                    second_drift_ = drift[j];
+                }
+            }
+        }
+
+#ifdef TBB
+        BoundedAssignBody(BoundedAssignBody& other, tbb::split) :
+            index_(other.index_), indices_(other.indices_), dcenters_(other.dcenters_), branching_(other.branching_),
+            belongs_to_(other.belongs_to_), elkan_(other.elkan_), upper_(other.upper_), lower_(other.lower_),
+            drift_(other.drift_), half_cc_(other.half_cc_), half_min_(other.half_min_),
+            max_drift_(other.max_drift_), second_drift_(other.second_drift_), max_drift_index_(other.max_drift_index_),
+            margin_(other.margin_), count_(other.branching_,0), changed_(false) {}
+
+        void operator()(const tbb::blocked_range<int>& r)
+        {
+            process(r.begin(), r.end());
+        }
+
+        void join(const BoundedAssignBody& other)
+        {
+            for (int j=0; j<branching_; ++j) {
+                count_[j] += other.count_[j];
+            }
+            changed_ = changed_ || other.changed_;
+        }
+#endif
+
+        void process(int begin, int end)
+        {
+            for (int i=begin; i<end; ++i) {
+                int old_centroid = belongs_to_[i];
+                int new_centroid = elkan_ ? assignElkan(i, old_centroid) : assignHamerly(i, old_centroid);
+                if (new_centroid != old_centroid) {
+                    count_[old_centroid]--;
+                    count_[new_centroid]++;
+                    belongs_to_[i] = new_centroid;
+                    changed_ = true;
+                }
+            }
+        }
+
+        DistanceType squaredDistance(int i, int j) const
+        {
+            return index_->distance_(index_->dataset_[indices_[i]], dcenters_[j], index_->veclen_);
+        }
+
+        int assignHamerly(int i, int a) const
+        {
+            double upper = upper_[i] + drift_[a];
+            double lower = std::max(0.0, lower_[i] - (a==max_drift_index_ ? second_drift_ : max_drift_));
+            double bound = std::max(half_min_[a], lower);
+
+            if (upper*margin_<bound) {
+                upper_[i] = upper;
+                lower_[i] = lower;
+                return a;
+            }
+            DistanceType a_sq = squaredDistance(i, a);
+            upper = sqrt(double(a_sq));
+            if (upper*margin_<bound) {
+                upper_[i] = upper;
+                lower_[i] = lower;
+                return a;
+            }
+
+            // same scan as the plain assignment
+            DistanceType sq_dist = (a==0) ? a_sq : squaredDistance(i, 0);
+            DistanceType second_sq = (std::numeric_limits<DistanceType>::max)();
+            int best = 0;
+            for (int j=1; j<branching_; ++j) {
+                DistanceType new_sq_dist = (a==j) ? a_sq : squaredDistance(i, j);
+                if (sq_dist>new_sq_dist) {
+                    second_sq = sq_dist;
+                    best = j;
+                    sq_dist = new_sq_dist;
+                }
+                else if (second_sq>new_sq_dist) {
+                    second_sq = new_sq_dist;
+                }
+            }
+            upper_[i] = sqrt(double(sq_dist));
+            lower_[i] = sqrt(double(second_sq));
+            return best;
+        }
+
+        int assignElkan(int i, int a) const
+        {
+            double* lower = lower_ + size_t(i)*branching_;
+            for (int j=0; j<branching_; ++j) {
+                lower[j] = std::max(0.0, lower[j] - drift_[j]);
+            }
+            double upper = upper_[i] + drift_[a];
+            if (upper*margin_<half_min_[a]) {
+                upper_[i] = upper;
+                return a;
+            }
+
+            bool tight = false;
+            DistanceType a_sq = 0;
+            for (int j=0; j<branching_; ++j) {
+                if (j==a) continue;
+                const double* half_cc = half_cc_ + size_t(a)*branching_;
+                if (upper*margin_<lower[j] || upper*margin_<half_cc[j]) continue;
+                if (!tight) {
+                    a_sq = squaredDistance(i, a);
+                    upper = sqrt(double(a_sq));
+                    lower[a] = upper;
+                    tight = true;
+                    if (upper*margin_<lower[j] || upper*margin_<half_cc[j]) continue;
+                }
+                DistanceType sq_dist = squaredDistance(i, j);
+                lower[j] = sqrt(double(sq_dist));
+                // the plain assignment keeps the first of equally close centers
+                if (sq_dist<a_sq || (sq_dist==a_sq && j<a)) {
+                    a = j;
+                    a_sq = sq_dist;
+                    upper = lower[j];
+                }
+            }
+            upper_[i] = upper;
+            return a;
+        }
+
+        const KMeansIndex* index_;
+        const int* indices_;
+        const Matrix<double>& dcenters_;
+        int branching_;
+        int* belongs_to_;
+        bool elkan_;
+        double* upper_;
+        double* lower_;
+        const double* drift_;
+        const double* half_cc_;
+        const double* half_min_;
+        double max_drift_;
+        double second_drift_;
+        int max_drift_index_;
+        /**
+         * Relative margin by which a lower bound must exceed an upper bound,
+         * covering the rounding errors of the bounds
+         */
+        double margin_;
+        std::vector<int> count_;
+        bool changed_;
+    };
+
+    /**
+     * Computes the movements of the centers in the last update, half of the
+     * distances between the centers and half of the distance from each
+     * center to its closest center.
+     */
+    void computeCenterDistances(const Matrix<double>& dcenters, const std::vector<double>& old_centers, int branching,
+                                std::vector<double>& drift, std::vector<double>& half_cc, std::vector<double>& half_min)
+    {
+        drift.resize(branching);
+        half_cc.resize(branching*branching);
+        half_min.assign(branching, (std::numeric_limits<double>::max)());
+        for (int i=0; i<branching; ++i) {
+            drift[i] = sqrt(euclideanSquared(dcenters[i], &old_centers[i*veclen_]));
+            half_cc[i*branching+i] = 0;
+            for (int j=0; j<i; ++j) {
+                double half_dist = sqrt(euclideanSquared(dcenters[i], dcenters[j]))/2;
+                half_cc[i*branching+j] = half_cc[j*branching+i] = half_dist;
+                half_min[i] = std::min(half_min[i], half_dist);
+                half_min[j] = std::min(half_min[j], half_dist);
+            }
+        }
+    }
+
+    double euclideanSquared(const double* a, const double* b)
+    {
+        double result = 0;
+        for (size_t k=0; k<veclen_; ++k) {
+            double diff = a[k]-b[k];
+            result += diff*diff;
+        }
+        return result;
+    }
+
+    /**
+     * Computes the centers of a range of clusters as the means of their
+     * points. The points of each cluster are summed in the order they are
+     * in, so the centers don't depend on how the clusters are split among
+     * the threads.
+     */
+    struct CentersBody
+    {
+        CentersBody(const KMeansIndex* index, const int* indices, const int* members, const int* starts,
+                    Matrix<double>& dcenters) :
+            index_(index), indices_(indices), members_(members), starts_(starts), dcenters_(dcenters) {}
+
+#ifdef TBB
+        void operator()(const tbb::blocked_range<int>& r) const
+        {
+            process(r.begin(), r.end());
+        }
+#endif
+
+        void process(int begin, int end) const
+        {
+            size_t veclen = index_->veclen_;
+            for (int c=begin; c<end; ++c) {
+                double* center = dcenters_[c];
+                std::fill(center, center+veclen, 0);
+                for (int j=starts_[c]; j<starts_[c+1]; ++j) {
+                    const ElementType* vec = index_->dataset_[indices_[members_[j]]];
+                    for (size_t k=0; k<veclen; ++k) {
+                        center[k] += vec[k];
+                    }
+                }
+                int cnt = starts_[c+1]-starts_[c];
+                for (size_t k=0; k<veclen; ++k) {
+                    center[k] /= cnt;
+                }
+            }
+        }
+
+        const KMeansIndex* index_;
+        const int* indices_;
+        const int* members_;
+        const int* starts_;
+        Matrix<double>& dcenters_;
+    };
+
+    /**
+     * Computes the new cluster centers, one cluster per task when building
+     * in parallel and the node is large enough.
+     */
+    void computeCenters(const int* indices, int indices_length, const int* belongs_to, int branching,
+                        Matrix<double>& dcenters)
+    {
+        // the positions of the points of each cluster, in order
+        std::vector<int> starts(branching+1, 0);
+        for (int i=0; i<indices_length; ++i) {
+            starts[belongs_to[i]+1]++;
+        }
+        for (int c=0; c<branching; ++c) {
+            starts[c+1] += starts[c];
+        }
+        std::vector<int> members(indices_length);
+        std::vector<int> next(starts.begin(), starts.end()-1);
+        for (int i=0; i<indices_length; ++i) {
+            members[next[belongs_to[i]]++] = i;
+        }
+
+        CentersBody body(this, indices, &members[0], &starts[0], dcenters);
+#ifdef TBB
+        if (parallel_build_ && indices_length>PARALLEL_BUILD_SIZE) {
+            tbb::parallel_for(tbb::blocked_range<int>(0, branching, 1), body);
+            return;
+        }
+#endif
+        body.process(0, branching);
+    }
+
+    /**
+     * Searches a range of queries, computing the distances to the centers of
+     * the top levels of the tree for blocks of BATCH_SIZE queries at once.
+     */
+    struct BatchSearchBody
+    {
+        BatchSearchBody(KMeansIndex* index, const Matrix<ElementType>& queries, Matrix<int>& indices,
+                        Matrix<DistanceType>& dists, size_t knn, const SearchParams& params, bool use_heap) :
+            index_(index), queries_(queries), indices_(indices), dists_(dists), knn_(knn), params_(params),
+            use_heap_(use_heap), count_(0) {}
+
+#ifdef TBB
+        BatchSearchBody(BatchSearchBody& other, tbb::split) :
+            index_(other.index_), queries_(other.queries_), indices_(other.indices_), dists_(other.dists_),
+            knn_(other.knn_), params_(other.params_), use_heap_(other.use_heap_), count_(0) {}
+
+        void operator()(const tbb::blocked_range<size_t>& r)
+        {
+            process(r.begin(), r.end());
+        }
+
+        void join(const BatchSearchBody& other)
+        {
+            count_ += other.count_;
+        }
+#endif
+
+        void process(size_t begin, size_t end)
+        {
+            if (use_heap_) {
+                KNNResultSet2<DistanceType> resultSet(knn_);
+                search(resultSet, begin, end);
+            }
+            else {
+                KNNSimpleResultSet<DistanceType> resultSet(knn_);
+                search(resultSet, begin, end);
+            }
+        }
+
+        template <typename ResultSet>
+        void search(ResultSet& resultSet, size_t begin, size_t end)
+        {
+            size_t width = index_->batch_columns_;
+            std::vector<DistanceType> table(BATCH_SIZE*width);
+            for (size_t block=begin; block<end; block+=BATCH_SIZE) {
+                size_t block_end = std::min(block+BATCH_SIZE, end);
+                index_->computeBatchDistances(queries_, block, block_end, &table[0]);
+                for (size_t i=block; i<block_end; ++i) {
+                    resultSet.clear();
+                    index_->findNeighbors(resultSet, queries_[i], params_, &table[(i-block)*width]);
+                    resultSet.copy(indices_[i], dists_[i], knn_, params_.sorted);
+                    count_ += resultSet.size();
+                }
+            }
+        }
+
+        KMeansIndex* index_;
+        const Matrix<ElementType>& queries_;
+        Matrix<int>& indices_;
+        Matrix<DistanceType>& dists_;
+        size_t knn_;
+        const SearchParams& params_;
+        bool use_heap_;
+        int count_;
+    };
+
+    /**
+     * Numbers the centers of the batched top levels of the tree and stores
+     * them transposed (one row per dimension) for computeBatchDistances.
+     */
+    void prepareBatchCenters()
+    {
+        batch_columns_ = 0;
+        batch_centers_.clear();
+        batch_norms_.clear();
+        if (batch_levels_>0 && root_!=NULL) {
+            prepareBatchCenters(root_, 0);
+        }
+    }
+
+    void prepareBatchCenters(KMeansNodePtr node, int level)
+    {
+        // the level is counted here because it isn't saved with the tree
+        if (node->childs.empty() || level>=batch_levels_) return;
+
+        node->child_columns = batch_columns_;
+        batch_columns_ += branching_;
+        size_t offset = batch_centers_.size();
+        batch_centers_.resize(offset+veclen_*branching_);
+        for (int c=0; c<branching_; ++c) {
+            const DistanceType* center = node->child_centers+c*veclen_;
+            DistanceType norm = 0;
+            for (size_t k=0; k<veclen_; ++k) {
+                batch_centers_[offset+k*branching_+c] = center[k];
+                norm += center[k]*center[k];
+            }
+            batch_norms_.push_back(norm);
+            node->childs[c]->column = node->child_columns+c;
+        }
+        for (int c=0; c<branching_; ++c) {
+            prepareBatchCenters(node->childs[c], level+1);
+        }
+    }
+
+    /**
+     * Computes the squared Euclidean distances from a block of queries to the
+     * centers of the batched levels as ||q||^2+||c||^2-2<q,c>, one row of
+     * batch_columns_ distances per query. The dot products are computed for
+     * groups of four queries against each transposed block of centers, so
+     * that the inner loop runs over contiguous centers.
+     */
+    void computeBatchDistances(const Matrix<ElementType>& queries, size_t begin, size_t end, DistanceType* table) const
+    {
+        size_t width = batch_columns_;
+        size_t blocks = width/branching_;
+        std::fill(table, table+(end-begin)*width, DistanceType(0));
+        // receives the products of the missing queries of the last group
+        std::vector<DistanceType> scratch;
+
+        for (size_t q=begin; q<end; q+=4) {
+            size_t group = std::min(size_t(4), end-q);
+            const ElementType* vecs[4];
+            DistanceType* rows[4];
+            for (size_t g=0; g<4; ++g) {
+                if (g<group) {
+                    vecs[g] = queries[q+g];
+                    rows[g] = table+(q+g-begin)*width;
+                }
+                else {
+                    scratch.assign(width, 0);
+                    vecs[g] = queries[q];
+                    rows[g] = &scratch[0];
+                }
+            }
+            for (size_t b=0; b<blocks; ++b) {
+                const DistanceType* centers = &batch_centers_[b*veclen_*branching_];
+                DistanceType* out0 = rows[0]+b*branching_;
+                DistanceType* out1 = rows[1]+b*branching_;
+                DistanceType* out2 = rows[2]+b*branching_;
+                DistanceType* out3 = rows[3]+b*branching_;
+                for (size_t k=0; k<veclen_; ++k) {
+                    const DistanceType* ck = centers+k*branching_;
+                    DistanceType q0 = vecs[0][k], q1 = vecs[1][k], q2 = vecs[2][k], q3 = vecs[3][k];
+                    for (int c=0; c<branching_; ++c) {
+                        out0[c] += q0*ck[c];
+                        out1[c] += q1*ck[c];
+                        out2[c] += q2*ck[c];
+                        out3[c] += q3*ck[c];
+                    }
+                }
+            }
+            for (size_t g=0; g<group; ++g) {
+                DistanceType norm = 0;
+                for (size_t k=0; k<veclen_; ++k) {
+                    norm += DistanceType(vecs[g][k])*vecs[g][k];
+                }
+                DistanceType* row = rows[g];
+                for (size_t j=0; j<width; ++j) {
+                    DistanceType dist = norm+batch_norms_[j]-2*row[j];
+                    row[j] = (dist>0) ? dist : 0;
+                }
+            }
+        }
+    }
+
+#ifdef TBB
+    /**
+     * Clusters a subtree in a separate task
+     */
+    struct ClusteringTask
+    {
+        ClusteringTask(KMeansIndex* index, KMeansNodePtr node, int* indices, int indices_length, int branching, int level,
+                       unsigned int seed) :
+            index_(index), node_(node), indices_(indices), indices_length_(indices_length), branching_(branching), level_(level),
+            seed_(seed) {}
+
+        void operator()() const
+        {
+            index_->computeClustering(node_, indices_, indices_length_, branching_, level_, seed_);
+        }
+
+        KMeansIndex* index_;
+        KMeansNodePtr node_;
+        int* indices_;
+        int indices_length_;
+        int branching_;
+        int level_;
+        unsigned int seed_;
+    };
+#endif
+
+    /**
+     * Runs a body over the points of a node, in parallel when building
+     * in parallel and the node is large enough.
+     */
+    template <typename Body>
+    void processPoints(Body& body, int indices_length)
+    {
+#ifdef TBB
+        if (parallel_build_ && indices_length>PARALLEL_BUILD_SIZE) {
+            tbb::parallel_reduce(tbb::blocked_range<int>(0, indices_length, PARALLEL_GRAIN_SIZE), body);
+            return;
+        }
+#endif
+        body.process(0, indices_length);
+    }
+
 
 
 
@@ -588,10 +1375,10 @@ private:
     }
 
 
-    void load_tree(FILE* stream, KMeansNodePtr& node)
+    void load_tree(FILE* stream, KMeansNodePtr& node, DistanceType* pivot = NULL)
     {
         node = new KMeansNode();
-        node->pivot = new DistanceType[veclen_];
+        node->pivot = (pivot!=NULL) ? pivot : new DistanceType[veclen_];
         load_value(stream, *(node->pivot), (int)veclen_);
         load_value(stream, node->radius);
         load_value(stream, node->variance);
@@ -604,27 +1391,103 @@ private:
         }
         else {
             node->childs.resize(childs_size);
+            node->child_centers = new DistanceType[childs_size*veclen_];
+            node->child_radiuses.resize(childs_size);
+            node->child_variances.resize(childs_size);
             for(size_t i=0; i<childs_size; ++i) {
-                load_tree(stream, node->childs[i]);
+                load_tree(stream, node->childs[i], node->child_centers+i*veclen_);
+                node->child_radiuses[i] = node->childs[i]->radius;
+                node->child_variances[i] = node->childs[i]->variance;
             }
         }
     }
 
 
+    void save_removed(FILE* stream)
+    {
+        std::vector<size_t> removed;
+        for (size_t i=0; i<size_; ++i) {
+            if (removed_points_.test(i)) removed.push_back(i);
+        }
+        save_value(stream, removed);
+        save_value(stream, removed_count_);
+    }
+
+    void load_removed(FILE* stream)
+    {
+        std::vector<size_t> removed;
+        load_value(stream, removed);
+        load_value(stream, removed_count_);
+        removed_points_.resize(size_);
+        removed_points_.reset();
+        for (size_t i=0; i<removed.size(); ++i) {
+            removed_points_.set(removed[i]);
+        }
+        size_at_build_ = size_ - removed.size() + removed_count_;
+        removed_at_build_ = removed.size() - removed_count_;
+    }
+
+
     /**
-     * Helper function
+     * Helper function. The pivots of the child nodes are freed with the
+     * child_centers of their parent.
      */
-    void freeNodes(KMeansNodePtr node)
+    void freeNodes(KMeansNodePtr node, bool free_pivot = true)
     {
-        delete[] node->pivot;
+        if (free_pivot) {
+            delete[] node->pivot;
+        }
         if (!node->childs.empty()) {
             for (int k=0; k<branching_; ++k) {
-                freeNodes(node->childs[k]);
+                freeNodes(node->childs[k], false);
             }
+            delete[] node->child_centers;
         }
         delete node;
     }
 
+    /**
+     * Copies the points of the leaves into packed_points_, in leaf order,
+     * when the leaves are packed.
+     */
+    void packLeaves()
+    {
+        std::vector<ElementType>().swap(packed_points_);
+        if (!pack_leaves_ || root_==NULL) return;
+
+        packed_points_.resize(countLeafPoints(root_)*veclen_);
+        ElementType* points = packed_points_.empty() ? NULL : &packed_points_[0];
+        packLeaves(root_, points);
+    }
+
+    size_t countLeafPoints(KMeansNodePtr node)
+    {
+        if (node->childs.empty()) {
+            return node->indices.size();
+        }
+        size_t count = 0;
+        for (size_t i=0; i<node->childs.size(); ++i) {
+            count += countLeafPoints(node->childs[i]);
+        }
+        return count;
+    }
+
+    void packLeaves(KMeansNodePtr node, ElementType*& points)
+    {
+        if (node->childs.empty()) {
+            node->points = points;
+            for (size_t i=0; i<node->indices.size(); ++i) {
+                const ElementType* point = dataset_[node->indices[i]];
+                std::copy(point, point+veclen_, points);
+                points += veclen_;
+            }
+            return;
+        }
+        for (size_t i=0; i<node->childs.size(); ++i) {
+            packLeaves(node->childs[i], points);
+        }
+    }
+
     /**
      * Computes the statistics of a node (mean, radius, variance).
      *
@@ -636,8 +1499,12 @@ private:
     {
         size_t size = indices.size();
 
-        DistanceType* mean = new DistanceType[veclen_];
-        memoryCounter_ += int(veclen_*sizeof(DistanceType));
+        // the pivot of a child node is updated in place in its parent
+        if (node->pivot==NULL) {
+            node->pivot = new DistanceType[veclen_];
+            memoryCounter_ += int(veclen_*sizeof(DistanceType));
+        }
+        DistanceType* mean = node->pivot;
         memset(mean,0,veclen_*sizeof(DistanceType));
 
         for (size_t i=0; i<size; ++i) {
@@ -663,7 +1530,6 @@ private:
 
         node->variance = variance;
         node->radius = radius;
-        node->pivot = mean;
     }
 
 
@@ -678,7 +1544,8 @@ private:
      *
      * TODO: for 1-sized clusters don't store a cluster center (it's the same as the single cluster point)
      */
-    void computeClustering(KMeansNodePtr node, int* indices, int indices_length, int branching, int level)
+    void computeClustering(KMeansNodePtr node, int* indices, int indices_length, int branching, int level,
+                           unsigned int seed)
     {
         node->size = indices_length;
         node->level = level;
@@ -690,9 +1557,21 @@ private:
             return;
         }
 
+        RandomState random(seed);
+
+        // the centers of the large nodes are learned from a random sample of
+        // their points, moved to the beginning of indices
+        int sample_length = indices_length;
+        if (sample_size_>0 && indices_length>sample_size_) {
+            sample_length = sample_size_;
+            for (int i=0; i<sample_length; ++i) {
+                std::swap(indices[i], indices[random.rand_int(indices_length, i)]);
+            }
+        }
+
         int* centers_idx = new int[branching];
         int centers_length;
-        (this->*chooseCenters)(branching, indices, indices_length, centers_idx, centers_length);
+        (this->*chooseCenters)(branching, indices, sample_length, centers_idx, centers_length, random);
 
         if (centers_length<branching) {
             node->indices.resize(indices_length);
@@ -712,72 +1591,64 @@ private:
         }
         delete[] centers_idx;
 
-        std::vector<DistanceType> radiuses(branching,0);
-        std::vector<int> count(branching,0);
+        // state of the accelerated assignment: bounds of the distances from
+        // each point to its center and to the other centers
+        bool bounded = (assignment_!=FLANN_KMEANS_LLOYD);
+        bool elkan = (assignment_==FLANN_KMEANS_ELKAN) ||
+                     (assignment_==FLANN_KMEANS_ACCELERATED && branching<=ELKAN_MAX_BRANCHING);
+        std::vector<double> upper, lower, old_centers, drift, half_cc, half_min;
+        // points moved to empty clusters in the last iteration, with their previous cluster
+        std::vector<std::pair<int,int> > moved;
+        if (bounded) {
+            upper.resize(sample_length);
+            lower.resize(elkan ? size_t(sample_length)*branching : sample_length);
+            old_centers.resize(branching*veclen_);
+        }
 
         //	assign points to clusters
-        std::vector<int> belongs_to(indices_length);
-        for (int i=0; i<indices_length; ++i) {
-
-            DistanceType sq_dist = distance_(dataset_[indices[i]], dcenters[0], veclen_);
-            belongs_to[i] = 0;
-            for (int j=1; j<branching; ++j) {
-                DistanceType new_sq_dist = distance_(dataset_[indices[i]], dcenters[j], veclen_);
-                if (sq_dist>new_sq_dist) {
-                    belongs_to[i] = j;
-                    sq_dist = new_sq_dist;
-                }
-            }
-            if (sq_dist>radiuses[belongs_to[i]]) {
-                radiuses[belongs_to[i]] = sq_dist;
-            }
-            count[belongs_to[i]]++;
+        std::vector<int> belongs_to(sample_length);
+        AssignBody assign(this, indices, dcenters, branching, &belongs_to[0], true);
+        if (bounded) {
+            assign.setBounds(&upper[0], &lower[0], elkan);
         }
+        processPoints(assign, sample_length);
+        std::vector<DistanceType> radiuses(assign.radiuses_);
+        std::vector<int> count(assign.count_);
 
         bool converged = false;
         int iteration = 0;
         while (!converged && iteration<iterations_) {
             converged = true;
             iteration++;
+            moved.clear();
+            if (bounded) {
+                std::copy(dcenters.ptr(), dcenters.ptr()+branching*veclen_, old_centers.begin());
+            }
 
             // compute the new cluster centers
-            for (int i=0; i<branching; ++i) {
-                memset(dcenters[i],0,sizeof(double)*veclen_);
-                radiuses[i] = 0;
-            }
-            for (int i=0; i<indices_length; ++i) {
-                ElementType* vec = dataset_[indices[i]];
-                double* center = dcenters[belongs_to[i]];
-                for (size_t k=0; k<veclen_; ++k) {
-                    center[k] += vec[k];
-                }
-            }
-            for (int i=0; i<branching; ++i) {
-                int cnt = count[i];
-                for (size_t k=0; k<veclen_; ++k) {
-                    dcenters[i][k] /= cnt;
-                }
-            }
+            computeCenters(indices, sample_length, &belongs_to[0], branching, dcenters);
 
             // reassign points to clusters
-            for (int i=0; i<indices_length; ++i) {
-                DistanceType sq_dist = distance_(dataset_[indices[i]], dcenters[0], veclen_);
-                int new_centroid = 0;
-                for (int j=1; j<branching; ++j) {
-                    DistanceType new_sq_dist = distance_(dataset_[indices[i]], dcenters[j], veclen_);
-                    if (sq_dist>new_sq_dist) {
-                        new_centroid = j;
-                        sq_dist = new_sq_dist;
-                    }
+            if (bounded) {
+                computeCenterDistances(dcenters, old_centers, branching, drift, half_cc, half_min);
+                BoundedAssignBody reassign(this, indices, dcenters, branching, &belongs_to[0], elkan,
+                                           &upper[0], &lower[0], &drift[0], &half_cc[0], &half_min[0]);
+                processPoints(reassign, sample_length);
+                for (int i=0; i<branching; ++i) {
+                    count[i] += reassign.count_[i];
                 }
-                if (sq_dist>radiuses[new_centroid]) {
-                    radiuses[new_centroid] = sq_dist;
+                if (reassign.changed_) {
+                    converged = false;
                 }
-                if (new_centroid != belongs_to[i]) {
-                    count[belongs_to[i]]--;
-                    count[new_centroid]++;
-                    belongs_to[i] = new_centroid;
-
+            }
+            else {
+                AssignBody reassign(this, indices, dcenters, branching, &belongs_to[0], false);
+                processPoints(reassign, sample_length);
+                radiuses = reassign.radiuses_;
+                for (int i=0; i<branching; ++i) {
+                    count[i] += reassign.count_[i];
+                }
+                if (reassign.changed_) {
                     converged = false;
                 }
             }
@@ -791,11 +1662,18 @@ private:
                         j = (j+1)%branching;
                     }
 
-                    for (int k=0; k<indices_length; ++k) {
+                    for (int k=0; k<sample_length; ++k) {
                         if (belongs_to[k]==j) {
                             belongs_to[k] = i;
                             count[j]--;
                             count[i]++;
+                            radiuses[i] = distance_(dataset_[indices[k]], dcenters[i], veclen_);
+                            if (bounded) {
+                                moved.push_back(std::make_pair(k, j));
+                                upper[k] = (std::numeric_limits<double>::max)();
+                                std::fill(lower.begin()+(elkan ? size_t(k)*branching : k),
+                                          lower.begin()+(elkan ? size_t(k+1)*branching : k+1), 0);
+                            }
                             break;
                         }
                     }
@@ -805,19 +1683,76 @@ private:
 
         }
 
-        std::vector<DistanceType*> centers(branching);
+        if (sample_length<indices_length) {
+            // a single pass assigns all the points to the centers learned from the sample
+            belongs_to.resize(indices_length);
+            AssignBody assign_all(this, indices, dcenters, branching, &belongs_to[0], true);
+            processPoints(assign_all, indices_length);
+            radiuses = assign_all.radiuses_;
+            count = assign_all.count_;
 
+            for (int i=0; i<branching; ++i) {
+                if (count[i]==0) {
+                    int j = (i+1)%branching;
+                    while (count[j]<=1) {
+                        j = (j+1)%branching;
+                    }
+                    for (int k=0; k<indices_length; ++k) {
+                        if (belongs_to[k]==j) {
+                            belongs_to[k] = i;
+                            count[j]--;
+                            count[i]++;
+                            // the radius of the cluster bounds the point moved, for the pruning of the search
+                            radiuses[i] = distance_(dataset_[indices[k]], dcenters[i], veclen_);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        else if (bounded && iteration>0) {
+            // the cluster radiuses, from the assignment of the last iteration
+            std::vector<int> assigned(belongs_to);
+            for (size_t k=0; k<moved.size(); ++k) {
+                assigned[moved[k].first] = moved[k].second;
+            }
+            std::fill(radiuses.begin(), radiuses.end(), 0);
+            for (int i=0; i<sample_length; ++i) {
+                DistanceType sq_dist = distance_(dataset_[indices[i]], dcenters[assigned[i]], veclen_);
+                if (sq_dist>radiuses[assigned[i]]) {
+                    radiuses[assigned[i]] = sq_dist;
+                }
+            }
+            // the points moved are also in the clusters they were moved to
+            for (size_t k=0; k<moved.size(); ++k) {
+                int i = moved[k].first;
+                DistanceType sq_dist = distance_(dataset_[indices[i]], dcenters[belongs_to[i]], veclen_);
+                if (sq_dist>radiuses[belongs_to[i]]) {
+                    radiuses[belongs_to[i]] = sq_dist;
+                }
+            }
+        }
+
+        {
+#ifdef TBB
+            tbb::spin_mutex::scoped_lock lock(memory_mutex_);
+#endif
+            memoryCounter_ += branching*(veclen_+2)*sizeof(DistanceType);
+        }
+        DistanceType* centers = new DistanceType[branching*veclen_];
         for (int i=0; i<branching; ++i) {
-            centers[i] = new DistanceType[veclen_];
-            memoryCounter_ += veclen_*sizeof(DistanceType);
             for (size_t k=0; k<veclen_; ++k) {
-                centers[i][k] = (DistanceType)dcenters[i][k];
+                centers[i*veclen_+k] = (DistanceType)dcenters[i][k];
             }
         }
+        node->child_centers = centers;
+        node->child_radiuses = radiuses;
+        node->child_variances.resize(branching);
 
 
         // compute kmeans clustering for each of the resulting clusters
         node->childs.resize(branching);
+        std::vector<int> starts(branching+1);
         int start = 0;
         int end = start;
         for (int c=0; c<branching; ++c) {
@@ -826,7 +1761,7 @@ private:
             DistanceType variance = 0;
             for (int i=0; i<indices_length; ++i) {
                 if (belongs_to[i]==c) {
-                    variance += distance_(centers[c], dataset_[indices[i]], veclen_);
+                    variance += distance_(centers+c*veclen_, dataset_[indices[i]], veclen_);
                     std::swap(indices[i],indices[end]);
                     std::swap(belongs_to[i],belongs_to[end]);
                     end++;
@@ -836,13 +1771,34 @@ private:
 
             node->childs[c] = new KMeansNode();
             node->childs[c]->radius = radiuses[c];
-            node->childs[c]->pivot = centers[c];
+            node->childs[c]->pivot = centers+c*veclen_;
             node->childs[c]->variance = variance;
-            computeClustering(node->childs[c],indices+start, end-start, branching, level+1);
+            node->child_variances[c] = variance;
+            starts[c] = start;
             start=end;
         }
-
+        starts[branching] = end;
         delete[] dcenters.ptr();
+
+        std::vector<unsigned int> seeds(branching);
+        for (int c=0; c<branching; ++c) {
+            seeds[c] = random.next();
+        }
+
+#ifdef TBB
+        if (parallel_build_ && indices_length>PARALLEL_BUILD_SIZE) {
+            tbb::task_group group;
+            for (int c=0; c<branching; ++c) {
+                group.run(ClusteringTask(this, node->childs[c], indices+starts[c], starts[c+1]-starts[c], branching, level+1,
+                                         seeds[c]));
+            }
+            group.wait();
+            return;
+        }
+#endif
+        for (int c=0; c<branching; ++c) {
+            computeClustering(node->childs[c], indices+starts[c], starts[c+1]-starts[c], branching, level+1, seeds[c]);
+        }
     }
 
 
@@ -862,21 +1818,13 @@ private:
 
     template<typename ResultSet>
     void findNN(KMeansNodePtr node, ResultSet& result, const ElementType* vec, int& checks, int maxChecks,
-                Heap<BranchSt>* heap)
+                Heap<BranchSt>* heap, const DistanceType* center_dists)
     {
         // Ignore those clusters that are too far away
-        {
-            DistanceType bsq = distance_(vec, node->pivot, veclen_);
-            DistanceType rsq = node->radius;
-            DistanceType wsq = result.worstDist();
-
-            DistanceType val = bsq-rsq-wsq;
-            DistanceType val2 = val*val-4*rsq*wsq;
-
-            //if (val>0) {
-            if ((val>0)&&(val2>0)) {
-                return;
-            }
+        DistanceType bsq = (center_dists!=NULL && node->column>=0) ? center_dists[node->column]
+                                                                   : distance_(vec, node->pivot, veclen_);
+        if (isOutside(bsq, node->radius, result.worstDist())) {
+            return;
         }
 
         if (node->childs.empty()) {
@@ -886,31 +1834,42 @@ private:
             checks += node->size;
             for (int i=0; i<node->size; ++i) {
                 int index = node->indices[i];
-                DistanceType dist = distance_(dataset_[index], vec, veclen_);
+                if (removed_count_>0 && removed_points_.test(index)) continue;
+                const ElementType* point = (node->points!=NULL) ? node->points+i*veclen_ : dataset_[index];
+                DistanceType dist = distance_(point, vec, veclen_);
                 result.addPoint(dist, index);
             }
         }
         else {
-            int closest_center = exploreNodeBranches(node, vec, heap);
-            findNN(node->childs[closest_center],result,vec, checks, maxChecks, heap);
+            int closest_center = exploreNodeBranches(node, vec, result.worstDist(), heap, center_dists);
+            findNN(node->childs[closest_center],result,vec, checks, maxChecks, heap, center_dists);
         }
     }
 
     /**
      * Helper function that computes the nearest childs of a node to a given query point.
+     * The other children are added to the heap, except those too far away to contain
+     * neighbors closer than the current worst distance.
      * Params:
      *     node = the node
      *     q = the query point
-     *     distances = array with the distances to each child node.
-     * Returns:
+     *     wsq = the current worst distance of the result set
+     *     center_dists = distances to the centers of the batched levels, or NULL
+     * Returns: the index of the nearest child
      */
-    int exploreNodeBranches(KMeansNodePtr node, const ElementType* q, Heap<BranchSt>* heap)
+    int exploreNodeBranches(KMeansNodePtr node, const ElementType* q, DistanceType wsq, Heap<BranchSt>* heap,
+                            const DistanceType* center_dists)
     {
         std::vector<DistanceType> domain_distances(branching_);
+        if (center_dists!=NULL && node->child_columns>=0) {
+            std::copy(center_dists+node->child_columns, center_dists+node->child_columns+branching_,
+                      domain_distances.begin());
+        }
+        else {
+            computeChildDistances(node, q, &domain_distances[0]);
+        }
         int best_index = 0;
-        domain_distances[best_index] = distance_(q, node->childs[best_index]->pivot, veclen_);
         for (int i=1; i<branching_; ++i) {
-            domain_distances[i] = distance_(q, node->childs[i]->pivot, veclen_);
             if (domain_distances[i]<domain_distances[best_index]) {
                 best_index = i;
             }
@@ -919,7 +1878,8 @@ private:
         //		float* best_center = node->childs[best_index]->pivot;
         for (int i=0; i<branching_; ++i) {
             if (i != best_index) {
-                domain_distances[i] -= cb_index_*node->childs[i]->variance;
+                if (isOutside(domain_distances[i], node->child_radiuses[i], wsq)) continue;
+                domain_distances[i] -= cb_index_*node->child_variances[i];
 
                 //				float dist_to_border = getDistanceToBorder(node.childs[i].pivot,best_center,q);
                 //				if (domain_distances[i]<dist_to_border) {
@@ -940,25 +1900,17 @@ private:
     void findExactNN(KMeansNodePtr node, ResultSet& result, const ElementType* vec)
     {
         // Ignore those clusters that are too far away
-        {
-            DistanceType bsq = distance_(vec, node->pivot, veclen_);
-            DistanceType rsq = node->radius;
-            DistanceType wsq = result.worstDist();
-
-            DistanceType val = bsq-rsq-wsq;
-            DistanceType val2 = val*val-4*rsq*wsq;
-
-            //                  if (val>0) {
-            if ((val>0)&&(val2>0)) {
-                return;
-            }
+        if (isOutside(distance_(vec, node->pivot, veclen_), node->radius, result.worstDist())) {
+            return;
         }
 
 
         if (node->childs.empty()) {
             for (int i=0; i<node->size; ++i) {
                 int index = node->indices[i];
-                DistanceType dist = distance_(dataset_[index], vec, veclen_);
+                if (removed_count_>0 && removed_points_.test(index)) continue;
+                const ElementType* point = (node->points!=NULL) ? node->points+i*veclen_ : dataset_[index];
+                DistanceType dist = distance_(point, vec, veclen_);
                 result.addPoint(dist, index);
             }
         }
@@ -981,9 +1933,11 @@ private:
      */
     void getCenterOrdering(KMeansNodePtr node, const ElementType* q, std::vector<int>& sort_indices)
     {
+        std::vector<DistanceType> child_distances(branching_);
+        computeChildDistances(node, q, &child_distances[0]);
         std::vector<DistanceType> domain_distances(branching_);
         for (int i=0; i<branching_; ++i) {
-            DistanceType dist = distance_(q, node->childs[i]->pivot, veclen_);
+            DistanceType dist = child_distances[i];
 
             int j=0;
             while (domain_distances[j]<dist && j<i) j++;
@@ -996,6 +1950,30 @@ private:
         }
     }
 
+    /**
+     * Computes the distances from a point to the centers of the children of
+     * a node, in one pass over the contiguous rows of child_centers.
+     */
+    void computeChildDistances(KMeansNodePtr node, const ElementType* q, DistanceType* distances)
+    {
+        const DistanceType* center = node->child_centers;
+        for (int i=0; i<branching_; ++i, center+=veclen_) {
+            distances[i] = distance_(q, center, veclen_);
+        }
+    }
+
+    /**
+     * Checks if a cluster is too far away from the query to contain points
+     * closer than the worst distance of the result set, from the (squared)
+     * distance to the cluster center, the cluster radius and the worst distance.
+     */
+    bool isOutside(DistanceType bsq, DistanceType rsq, DistanceType wsq) const
+    {
+        DistanceType val = bsq-rsq-wsq;
+        DistanceType val2 = val*val-4*rsq*wsq;
+        return (val>0)&&(val2>0);
+    }
+
     /**
      * Method that computes the squared distance from the query point q
      * from inside region with center c to the border between this
@@ -1079,31 +2057,60 @@ private:
         node->size++;
         
         if (node->childs.empty()) { // leaf node
+            // the leaf is read from the dataset until the leaves are packed again
+            node->points = NULL;
             node->indices.push_back(index);
             computeNodeStatistics(node, node->indices);
             if (node->indices.size()>=size_t(branching_)) {
                 std::vector<int> indices;
                 indices.swap(node->indices);
-                computeClustering(node, &indices[0], indices.size(), branching_, node->level);
+                computeClustering(node, &indices[0], indices.size(), branching_, node->level, (unsigned int)rand_int());
             }
         }
         else {            
             // find the closest child
+            std::vector<DistanceType> child_distances(branching_);
+            computeChildDistances(node, point, &child_distances[0]);
             int closest = 0;
-            DistanceType dist = distance_(node->childs[closest]->pivot, point, veclen_);
-            for (size_t i=1;i<size_t(branching_);++i) {
-                DistanceType crt_dist = distance_(node->childs[i]->pivot, point, veclen_);
-                if (crt_dist<dist) {
-                    dist = crt_dist;
+            for (int i=1;i<branching_;++i) {
+                if (child_distances[i]<child_distances[closest]) {
                     closest = i;
                 }
             }
-            addPointToTree(node->childs[closest], index, dist);
+            addPointToTree(node->childs[closest], index, child_distances[closest]);
+            node->child_radiuses[closest] = node->childs[closest]->radius;
+            node->child_variances[closest] = node->childs[closest]->variance;
         }                
     }
 
 
 private:
+    enum
+    {
+        /**
+         * Nodes with fewer points than this are clustered serially when the
+         * tree is built in parallel.
+         */
+        PARALLEL_BUILD_SIZE = 10000,
+        /**
+         * Number of points processed by a task in the parallel k-means
+         * iterations.
+         */
+        PARALLEL_GRAIN_SIZE = 1024,
+        /**
+         * Largest branching factor for which FLANN_KMEANS_ACCELERATED uses
+         * Elkan's algorithm rather than Hamerly's. Elkan's lower bounds take
+         * branching doubles per point (64 bytes at 8, 256 at the default 32,
+         * i.e. 256MB for a million points), Hamerly's a single one.
+         */
+        ELKAN_MAX_BRANCHING = 8,
+        /**
+         * Number of queries whose distances to the centers of the batched
+         * levels are computed together.
+         */
+        BATCH_SIZE = 64
+    };
+
     /** The branching factor used in the hierarchical k-means clustering */
     int branching_;
 
@@ -1113,6 +2120,33 @@ private:
     /** Algorithm for choosing the cluster centers */
     flann_centers_init_t centers_init_;
 
+    /** Number of threads used to build the tree (only used with TBB) */
+    int cores_;
+
+    /** Algorithm for assigning the points to the centers in the k-means iterations */
+    flann_kmeans_assignment_t assignment_;
+
+    /** Number of points sampled for the kmeans iterations in the larger nodes (0 uses all the points) */
+    int sample_size_;
+
+    /** If true, copies of the leaf points are stored contiguously in packed_points_ */
+    bool pack_leaves_;
+
+    /** Number of top levels whose center distances are computed for blocks of queries at once */
+    int batch_levels_;
+
+    /** Number of centers in the batched levels */
+    size_t batch_columns_;
+
+    /** Centers of the batched levels, transposed in blocks of branching_ centers */
+    std::vector<DistanceType> batch_centers_;
+
+    /** Squared norms of the centers of the batched levels */
+    std::vector<DistanceType> batch_norms_;
+
+    /** Set while the tree is built in parallel */
+    bool parallel_build_;
+
     /**
      * Cluster border index. This is used in the tree search phase when determining
      * the closest cluster to explore next. A zero value takes into account only
@@ -1124,12 +2158,8 @@ private:
     /**
      * The dataset used by this index
      */
-    Matrix<ElementType> dataset_;
+    ChunkedMatrix<ElementType> dataset_;
     
-    /**
-     *  Does the index have a copy of the dataset?
-     */
-    bool ownDataset_;
 
     /** Index parameters */
     IndexParams index_params_;
@@ -1143,6 +2173,21 @@ private:
      * Number of features in the dataset when the index was last built.
      */
     size_t size_at_build_;
+
+    /**
+     * Points removed from the index
+     */
+    DynamicBitset removed_points_;
+
+    /**
+     * Number of removed points still stored in the tree
+     */
+    size_t removed_count_;
+
+    /**
+     * Number of removed points left out of the tree when it was last built
+     */
+    size_t removed_at_build_;
     
     /**
      * Length of each feature.
@@ -1164,6 +2209,11 @@ private:
      */
     Distance distance_;
 
+    /**
+     * Copies of the points of the leaves, in leaf order (when pack_leaves_ is set)
+     */
+    std::vector<ElementType> packed_points_;
+
     /**
      * Pooled memory allocator.
      */
@@ -1173,6 +2223,13 @@ private:
      * Memory occupied by the index.
      */
     int memoryCounter_;    
+
+#ifdef TBB
+    /**
+     * Serializes the updates of memoryCounter_ by the build tasks
+     */
+    tbb::spin_mutex memory_mutex_;
+#endif
 };
 
 }
@@ -33,6 +33,7 @@
 
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
+#include "flann/util/chunked_matrix.h"
 
 namespace flann
 {
@@ -56,42 +57,15 @@ public:
 
     LinearIndex(const Matrix<ElementType>& input_data, const IndexParams& params = LinearIndexParams(),
                 Distance d = Distance()) :
-        dataset_(input_data), index_params_(params), distance_(d)
+        dataset_(input_data, get_param(params,"copy_dataset",false)), index_params_(params), distance_(d)
     {
-        ownDataset_ = get_param(index_params_, "copy_dataset", false);
-        if (ownDataset_) {
-            dataset_ = Matrix<ElementType>(new ElementType[input_data.rows * input_data.cols], input_data.rows, input_data.cols);
-            for (size_t i=0;i<input_data.rows;++i) {
-                std::copy(input_data[i], input_data[i]+input_data.cols, dataset_[i]);
-            }        
-        }
-    }
-    
-    ~LinearIndex()
-    {
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
     }
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
         assert(points.cols==veclen());
 
-        size_t rows = dataset_.rows + points.rows;
-        Matrix<ElementType> new_dataset(new ElementType[rows * veclen()], rows, veclen());
-        for (size_t i=0;i<dataset_.rows;++i) {
-            std::copy(dataset_[i], dataset_[i]+dataset_.cols, new_dataset[i]);
-        }
-        for (size_t i=0;i<points.rows;++i) {
-            std::copy(points[i], points[i]+points.cols, new_dataset[dataset_.rows+i]);
-        }
-        
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
-        dataset_ = new_dataset;
-        ownDataset_ = true;
+        dataset_.append(points);
     }
 
     
@@ -154,11 +128,9 @@ public:
 
 private:
     /** The dataset */
-    Matrix<ElementType> dataset_;
+    ChunkedMatrix<ElementType> dataset_;
     /** Index parameters */
     IndexParams index_params_;
-    /**  Does the index have a copy of the dataset? */
-    bool ownDataset_;    
     /** Index distance */
     Distance distance_;
 };
@@ -37,26 +37,38 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <limits>
 #include <map>
 #include <vector>
 
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
+#include "flann/algorithms/dist.h"
 #include "flann/util/matrix.h"
+#include "flann/util/chunked_matrix.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
 #include "flann/util/lsh_table.h"
 #include "flann/util/allocator.h"
 #include "flann/util/random.h"
 #include "flann/util/saving.h"
+#include "flann/util/visited_set.h"
+
+#ifdef TBB
+#include <tbb/task_scheduler_init.h>
+#include <tbb/task_group.h>
+#endif
 
 namespace flann
 {
 
 struct LshIndexParams : public IndexParams
 {
-    LshIndexParams(unsigned int table_number = 12, unsigned int key_size = 20, unsigned int multi_probe_level = 2)
+    LshIndexParams(unsigned int table_number = 12, unsigned int key_size = 20, unsigned int multi_probe_level = 2,
+                   flann_lsh_hash_t hash = FLANN_LSH_PSTABLE, float bucket_width = 0, int cores = 1,
+                   bool query_directed = false)
     {
         (* this)["algorithm"] = FLANN_INDEX_LSH;
         // The number of hash tables to use
@@ -65,9 +77,119 @@ struct LshIndexParams : public IndexParams
         (*this)["key_size"] = key_size;
         // Number of levels to use in multi-probe (0 for standard LSH)
         (*this)["multi_probe_level"] = multi_probe_level;
+        // Hash functions used for vectors of floats
+        (*this)["hash"] = hash;
+        // Width of the intervals of the FLANN_LSH_PSTABLE hash functions (0 to estimate it from the data)
+        (*this)["bucket_width"] = bucket_width;
+        // how many cores to use when building the tables (only used with TBB)
+        (*this)["cores"] = cores;
+        // probe the buckets of vectors of floats in query-directed order, checking at most the checks search parameter
+        (*this)["query_directed"] = query_directed;
+    }
+};
+
+namespace lsh
+{
+
+/** Computes the distances from a feature to a batch of features
+ * @param distance the distance used
+ * @param vec the feature to compare with
+ * @param points the features of the batch
+ * @param count the number of features in the batch
+ * @param veclen the size of the features
+ * @param dists receives the distances
+ */
+template<typename Distance>
+inline void computeDistances(const Distance& distance, const typename Distance::ElementType* vec,
+                             const typename Distance::ElementType* const* points, size_t count, size_t veclen,
+                             typename Distance::ResultType* dists)
+{
+    for (size_t i = 0; i < count; ++i) {
+        dists[i] = distance(vec, points[i], veclen);
+    }
+}
+
+#ifdef FLANN_PLATFORM_64_BIT
+/** Largest size, in 64 bit words, of the binary features whose batches
+ * have their own Hamming kernel
+ */
+const size_t MAX_BATCH_WORDS = 8;
+
+/** Hamming distances from the query words to a batch of features, as
+ * Hamming<unsigned char> computes them
+ */
+template<typename Popcount>
+inline void hammingDistances(const uint64_t* query, size_t words, const unsigned char* const* points, size_t count,
+                             unsigned int* dists, Popcount popcount)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t* point = reinterpret_cast<const uint64_t*>(points[i]);
+        unsigned int dist = 0;
+        for (size_t w = 0; w < words; ++w) {
+            dist += popcount(query[w] ^ point[w]);
+        }
+        dists[i] = dist;
     }
+}
+
+/** Population count of the Hamming distance, for CPUs without POPCNT */
+struct SoftwarePopcount
+{
+    explicit SoftwarePopcount(const Hamming<unsigned char>& distance) : distance_(distance) {}
+    unsigned int operator()(uint64_t n) const { return distance_.popcnt64(n); }
+    const Hamming<unsigned char>& distance_;
 };
 
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+/** Population count with the POPCNT instruction */
+struct HardwarePopcount
+{
+    __attribute__((target("popcnt")))
+    unsigned int operator()(uint64_t n) const { return (unsigned int)__builtin_popcountll(n); }
+};
+
+__attribute__((target("popcnt")))
+inline void hammingDistancesPopcnt(const uint64_t* query, size_t words, const unsigned char* const* points,
+                                   size_t count, unsigned int* dists)
+{
+    hammingDistances(query, words, points, count, dists, HardwarePopcount());
+}
+
+/** Tells if the CPU has the POPCNT instruction */
+inline bool hasPopcnt()
+{
+    static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+    return has_popcnt;
+}
+#endif
+
+/** Hamming distances of a batch: the query is loaded once for the whole
+ * batch, and the POPCNT instruction is used when the CPU has it
+ */
+inline void computeDistances(const Hamming<unsigned char>& distance, const unsigned char* vec,
+                             const unsigned char* const* points, size_t count, size_t veclen, unsigned int* dists)
+{
+    size_t words = veclen / sizeof(uint64_t);
+    if (words > MAX_BATCH_WORDS) {
+        for (size_t i = 0; i < count; ++i) {
+            dists[i] = distance(vec, points[i], veclen);
+        }
+        return;
+    }
+    uint64_t query[MAX_BATCH_WORDS];
+    std::memcpy(query, vec, words * sizeof(uint64_t));
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+    if (hasPopcnt()) {
+        hammingDistancesPopcnt(query, words, points, count, dists);
+        return;
+    }
+#endif
+    hammingDistances(query, words, points, count, dists, SoftwarePopcount(distance));
+}
+#endif
+
+}
+
 /**
  * Randomized kd-tree index
  *
@@ -88,30 +210,27 @@ public:
      */
     LshIndex(const Matrix<ElementType>& input_data, const IndexParams& params = LshIndexParams(),
              Distance d = Distance()) :
-        dataset_(input_data), index_params_(params), distance_(d)
+        dataset_(input_data, get_param(params,"copy_dataset",false)), index_params_(params), distance_(d)
     {
         table_number_ = get_param<unsigned int>(index_params_,"table_number",12);
         key_size_ = get_param<unsigned int>(index_params_,"key_size",20);
         multi_probe_level_ = get_param<unsigned int>(index_params_,"multi_probe_level",2);
-
-        ownDataset_ = get_param(index_params_, "copy_dataset", false);
-        if (ownDataset_) {
-            dataset_ = Matrix<ElementType>(new ElementType[input_data.rows * input_data.cols], input_data.rows, input_data.cols);
-            for (size_t i=0;i<input_data.rows;++i) {
-                std::copy(input_data[i], input_data[i]+input_data.cols, dataset_[i]);
-            }        
-        }
+        hash_ = get_param(index_params_,"hash",FLANN_LSH_PSTABLE);
+        bucket_width_ = get_param(index_params_,"bucket_width",0.0f);
+        query_directed_ = get_param(index_params_,"query_directed",false);
+        cores_ = get_param(index_params_,"cores",1);
 
         feature_size_ = dataset_.cols;
+        removed_points_.resize(dataset_.rows);
+        removed_count_ = 0;
+        removed_at_build_ = 0;
+        size_at_build_ = 0;
         fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
     }
 
     
     ~LshIndex()
     {
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
     }
 
     LshIndex(const LshIndex&);
@@ -122,16 +241,42 @@ public:
      */
     void buildIndex()
     {
+        if (removed_count_>0) {
+            dataset_.release(removed_points_);
+            removed_at_build_ += removed_count_;
+            removed_count_ = 0;
+        }
+        if (lsh::LshTable<ElementType>::usesProjections() && hash_==FLANN_LSH_PSTABLE && bucket_width_<=0) {
+            bucket_width_ = estimateBucketWidth();
+            index_params_["bucket_width"] = bucket_width_;
+        }
+        // the hash functions are drawn first, so that they do not depend on the number of threads
         tables_.resize(table_number_);
         for (unsigned int i = 0; i < table_number_; ++i) {
-            lsh::LshTable<ElementType>& table = tables_[i];
-            table = lsh::LshTable<ElementType>(feature_size_, key_size_);
+            tables_[i] = lsh::LshTable<ElementType>(feature_size_, key_size_, hash_, bucket_width_);
+        }
 
-            // Add the features to the table
-            table.add(dataset_);
+        // Add the features to the tables
+#ifdef TBB
+        if (cores_ == 1) {
+#endif
+            for (unsigned int i = 0; i < table_number_; ++i) {
+                tables_[i].add(dataset_, removed_points_);
+            }
+#ifdef TBB
+        }
+        else {
+            // Initialise the task scheduler for the use of Intel TBB parallel constructs
+            tbb::task_scheduler_init task_sched(cores_);
+            tbb::task_group group;
+            for (unsigned int i = 0; i < table_number_; ++i) {
+                group.run(FillTableTask(this, i));
+            }
+            group.wait();
         }
+#endif
         
-        size_at_build_ = dataset_.rows;;
+        size_at_build_ = dataset_.rows - removed_at_build_;
     }
     
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
@@ -139,32 +284,47 @@ public:
         assert(points.cols==veclen());
         size_t old_size = dataset_.rows;
 
-        size_t rows = dataset_.rows + points.rows;
-        Matrix<ElementType> new_dataset(new ElementType[rows * veclen()], rows, veclen());
-        for (size_t i=0;i<dataset_.rows;++i) {
-            std::copy(dataset_[i], dataset_[i]+dataset_.cols, new_dataset[i]);
-        }
-        for (size_t i=0;i<points.rows;++i) {
-            std::copy(points[i], points[i]+points.cols, new_dataset[dataset_.rows+i]);
-        }
+        dataset_.append(points);
+        removed_points_.resize(dataset_.rows);
         
-        if (ownDataset_) {
-            delete[] dataset_.ptr();
-        }
-        dataset_ = new_dataset;
-        ownDataset_ = true;
-        
-        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<dataset_.rows) {
+        if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<dataset_.rows-removed_at_build_-removed_count_) {
             buildIndex();
         }
         else {
+            // the tables keep the new points apart until they are a large enough
+            // part of them, so adding a few points does not rebuild the tables
             for (unsigned int i = 0; i < table_number_; ++i) {
                 lsh::LshTable<ElementType>& table = tables_[i];                
                 for (size_t i=0;i<points.rows;++i) {
                     table.add(old_size+i, points[i]);
                 }            
+                table.optimize();
+            }
+        }
+    }
+
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        removePoints(std::vector<size_t>(1, id), rebuild_threshold);
+    }
+
+    /**
+     * Marks points as removed, they are skipped by the searches. When the
+     * number of removed points exceeds rebuild_threshold times the number
+     * of points in the tables, the tables are rebuilt without them.
+     */
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        for (size_t i=0;i<ids.size();++i) {
+            if (ids[i]<dataset_.rows && !removed_points_.test(ids[i])) {
+                removed_points_.set(ids[i]);
+                removed_count_++;
             }
         }
+
+        if (rebuild_threshold>0 && removed_count_>size_at_build_*rebuild_threshold) {
+            buildIndex();
+        }
     }
 
 
@@ -176,25 +336,61 @@ public:
 
     void saveIndex(FILE* stream)
     {
+        // the removed points are saved since format 2
+        save_format(stream, "lsh 2");
         save_value(stream,table_number_);
         save_value(stream,key_size_);
         save_value(stream,multi_probe_level_);
+        save_value(stream,hash_);
+        save_value(stream,bucket_width_);
+        save_value(stream,query_directed_);
 //         save_value(stream, dataset_);
+        std::vector<size_t> removed;
+        for (size_t i=0; i<dataset_.rows; ++i) {
+            if (removed_points_.test(i)) removed.push_back(i);
+        }
+        save_value(stream, removed);
+        save_value(stream, removed_count_);
+        save_value(stream, size_at_build_);
+        for (size_t i = 0; i < tables_.size(); ++i) {
+            tables_[i].save(stream);
+        }
     }
 
     void loadIndex(FILE* stream)
     {
+        load_format(stream, "lsh 2");
         load_value(stream, table_number_);
         load_value(stream, key_size_);
         load_value(stream, multi_probe_level_);
+        load_value(stream, hash_);
+        load_value(stream, bucket_width_);
+        load_value(stream, query_directed_);
 //         load_value(stream, dataset_);
-        // Building the index is so fast we can afford not storing it
-        buildIndex();
+        std::vector<size_t> removed;
+        load_value(stream, removed);
+        removed_points_.resize(dataset_.rows);
+        removed_points_.reset();
+        for (size_t i=0; i<removed.size(); ++i) {
+            removed_points_.set(removed[i]);
+        }
+        load_value(stream, removed_count_);
+        load_value(stream, size_at_build_);
+        removed_at_build_ = removed.size() - removed_count_;
+        xor_masks_.clear();
+        fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
+        tables_.resize(table_number_);
+        for (size_t i = 0; i < tables_.size(); ++i) {
+            tables_[i].load(stream);
+        }
 
         index_params_["algorithm"] = getType();
         index_params_["table_number"] = table_number_;
         index_params_["key_size"] = key_size_;
         index_params_["multi_probe_level"] = multi_probe_level_;
+        index_params_["hash"] = hash_;
+        index_params_["bucket_width"] = bucket_width_;
+        index_params_["query_directed"] = query_directed_;
     }
 
     /**
@@ -228,126 +424,89 @@ public:
         return index_params_;
     }
 
-    /**
-     * \brief Perform k-nearest neighbor search
-     * \param[in] queries The query points for which to find the nearest neighbors
-     * \param[out] indices The indices of the nearest neighbors found
-     * \param[out] dists Distances to the nearest neighbors found
-     * \param[in] knn Number of nearest neighbors to return
-     * \param[in] params Search parameters
-     */
-    int knnSearch(const Matrix<ElementType>& queries,
-    					Matrix<int>& indices,
-    					Matrix<DistanceType>& dists,
-    					size_t knn,
-    					const SearchParams& params)
-    {
-        assert(queries.cols == veclen());
-        assert(indices.rows >= queries.rows);
-        assert(dists.rows >= queries.rows);
-        assert(indices.cols >= knn);
-        assert(dists.cols >= knn);
-
-        int count = 0;
-        if (params.use_heap==FLANN_True) {
-        	KNNUniqueResultSet<DistanceType> resultSet(knn);
-        	for (size_t i = 0; i < queries.rows; i++) {
-        		resultSet.clear();
-        		findNeighbors(resultSet, queries[i], params);
-        		resultSet.copy(indices[i], dists[i], knn, params.sorted);
-        		count += resultSet.size();
-        	}
-        }
-        else {
-        	KNNResultSet<DistanceType> resultSet(knn);
-        	for (size_t i = 0; i < queries.rows; i++) {
-        		resultSet.clear();
-        		findNeighbors(resultSet, queries[i], params);
-        		resultSet.copy(indices[i], dists[i], knn, params.sorted);
-        		count += resultSet.size();
-        	}
-        }
-
-        return count;
-    }
-
-    /**
-     * \brief Perform k-nearest neighbor search
-     * \param[in] queries The query points for which to find the nearest neighbors
-     * \param[out] indices The indices of the nearest neighbors found
-     * \param[out] dists Distances to the nearest neighbors found
-     * \param[in] knn Number of nearest neighbors to return
-     * \param[in] params Search parameters
-     */
-    int knnSearch(const Matrix<ElementType>& queries,
-					std::vector< std::vector<int> >& indices,
-					std::vector<std::vector<DistanceType> >& dists,
-    				size_t knn,
-    				const SearchParams& params)
-    {
-        assert(queries.cols == veclen());
-		if (indices.size() < queries.rows ) indices.resize(queries.rows);
-		if (dists.size() < queries.rows ) dists.resize(queries.rows);
-
-		int count = 0;
-		if (params.use_heap==FLANN_True) {
-			KNNUniqueResultSet<DistanceType> resultSet(knn);
-			for (size_t i = 0; i < queries.rows; i++) {
-				resultSet.clear();
-				findNeighbors(resultSet, queries[i], params);
-				size_t n = std::min(resultSet.size(), knn);
-				indices[i].resize(n);
-				dists[i].resize(n);
-				if (n > 0) {
-					resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-				}
-				count += n;
-			}
-		}
-		else {
-			KNNResultSet<DistanceType> resultSet(knn);
-			for (size_t i = 0; i < queries.rows; i++) {
-				resultSet.clear();
-				findNeighbors(resultSet, queries[i], params);
-				size_t n = std::min(resultSet.size(), knn);
-				indices[i].resize(n);
-				dists[i].resize(n);
-				if (n > 0) {
-					resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-				}
-				count += n;
-			}
-		}
-
-		return count;
-    }
-
     /**
      * Find set of nearest neighbors to vec. Their indices are stored inside
      * the result object.
      *
+     * For vectors of floats with the query_directed index parameter, a
+     * positive searchParams.checks limits the search to that many features,
+     * in the buckets most likely to hold neighbors. Otherwise all the
+     * multi-probe buckets of all the tables are checked.
+     *
      * Params:
      *     result = the result object in which the indices of the nearest-neighbors are stored
      *     vec = the vector for which to search the nearest neighbors
-     *     maxCheck = the maximum number of restarts (in a best-bin-first manner)
+     *     searchParams = the search parameters
      */
     template <typename ResultSet>
-    void findNeighbors(ResultSet& result, const ElementType* vec, const SearchParams& /*searchParams*/)
+    void findNeighbors(ResultSet& result, const ElementType* vec, const SearchParams& searchParams)
     {
-        getNeighbors(vec, result);
+        if (query_directed_ && lsh::LshTable<ElementType>::usesProjections() && searchParams.checks > 0) {
+            getNeighborsByMargins(vec, result, searchParams.checks);
+        }
+        else {
+            getNeighbors(vec, result);
+        }
     }
 
 private:
-    /** Defines the comparator on score and index
+#ifdef TBB
+    /**
+     * Adds the features to a table in a separate task
      */
-    typedef std::pair<float, unsigned int> ScoreIndexPair;
-    struct SortScoreIndexPairOnSecond
+    struct FillTableTask
     {
-        bool operator()(const ScoreIndexPair& left, const ScoreIndexPair& right) const
+        FillTableTask(LshIndex* index, unsigned int table) : index_(index), table_(table) {}
+
+        void operator()() const
         {
-            return left.second < right.second;
+            index_->tables_[table_].add(index_->dataset_, index_->removed_points_);
         }
+
+        LshIndex* index_;
+        unsigned int table_;
     };
+#endif
+
+    /** Estimates a width of the intervals cutting the random projections from
+     * the typical distance between a feature and its nearest neighbor, found
+     * by comparing a sample of the features to a larger sample. Intervals a
+     * few times wider than that distance keep most neighbors in the same or
+     * in the probed buckets.
+     * @return the bucket width
+     */
+    float estimateBucketWidth()
+    {
+        size_t n = dataset_.rows;
+        if (n < 2) return 1;
+        size_t sample_size = std::min(n, size_t(BUCKET_WIDTH_SAMPLE));
+        size_t reference_size = std::min(n, size_t(BUCKET_WIDTH_REFERENCES));
+        // the removed features are left out, their rows may have been released
+        std::vector<size_t> references;
+        references.reserve(reference_size);
+        for (size_t j = 0; j < reference_size; ++j) {
+            size_t reference = rand_int(int(n));
+            if (!removed_points_.test(reference)) references.push_back(reference);
+        }
+
+        std::vector<float> nearest;
+        for (size_t i = 0; i < sample_size; ++i) {
+            size_t index = rand_int(int(n));
+            if (removed_points_.test(index)) continue;
+            DistanceType best = (std::numeric_limits<DistanceType>::max)();
+            for (size_t j = 0; j < references.size(); ++j) {
+                if (references[j] == index) continue;
+                DistanceType dist = distance_(dataset_[index], dataset_[references[j]], dataset_.cols);
+                if (dist > 0 && dist < best) best = dist;
+            }
+            if (best < (std::numeric_limits<DistanceType>::max)()) {
+                nearest.push_back(is_squared_euclidean<Distance>::value ? sqrt(float(best)) : float(best));
+            }
+        }
+        if (nearest.empty()) return 1;
+        std::nth_element(nearest.begin(), nearest.begin() + nearest.size() / 2, nearest.end());
+        return BUCKET_WIDTH_FACTOR * nearest[nearest.size() / 2];
+    }
 
     /** Fills the different xor masks to use when getting the neighbors in multi-probe LSH
      * @param key the key we build neighbors from
@@ -362,129 +521,233 @@ private:
         if (level == 0) return;
         for (int index = lowest_index - 1; index >= 0; --index) {
             // Create a new key
-            lsh::BucketKey new_key = key | (1 << index);
+            lsh::BucketKey new_key = key | (lsh::BucketKey(1) << index);
             fill_xor_mask(new_key, index, level - 1, xor_masks);
         }
     }
 
     /** Performs the approximate nearest-neighbor search.
+     * It only reads the index, so several queries can be searched concurrently.
      * @param vec the feature to analyze
-     * @param do_radius flag indicating if we check the radius too
-     * @param radius the radius if it is a radius search
-     * @param do_k flag indicating if we limit the number of nn
-     * @param k_nn the number of nearest neighbors
-     * @param checked_average used for debugging
+     * @param result receives the neighbors found
      */
-    void getNeighbors(const ElementType* vec, bool do_radius, float radius, bool do_k, unsigned int k_nn,
-                      float& checked_average)
+    template<typename ResultSet>
+    void getNeighbors(const ElementType* vec, ResultSet& result)
     {
-        static std::vector<ScoreIndexPair> score_index_heap;
-
-        if (do_k) {
-            unsigned int worst_score = std::numeric_limits<unsigned int>::max();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-            for (; table != table_end; ++table) {
-                size_t key = table->getKey(vec);
-                std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-                std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-                for (; xor_mask != xor_mask_end; ++xor_mask) {
-                    size_t sub_key = key ^ (*xor_mask);
-                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                    if (bucket == 0) continue;
-
-                    // Go over each descriptor index
-                    std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                    std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                    DistanceType hamming_distance;
-
-                    // Process the rest of the candidates
-                    for (; training_index < last_training_index; ++training_index) {
-                        hamming_distance = distance_(vec, dataset_[*training_index], dataset_.cols);
-
-                        if (hamming_distance < worst_score) {
-                            // Insert the new element
-                            score_index_heap.push_back(ScoreIndexPair(hamming_distance, training_index));
-                            std::push_heap(score_index_heap.begin(), score_index_heap.end());
-
-                            if (score_index_heap.size() > (unsigned int)k_nn) {
-                                // Remove the highest distance value as we have too many elements
-                                std::pop_heap(score_index_heap.begin(), score_index_heap.end());
-                                score_index_heap.pop_back();
-                                // Keep track of the worst score
-                                worst_score = score_index_heap.front().first;
-                            }
-                        }
-                    }
+        std::vector<size_t> keys(tables_.size());
+        lsh::LshTable<ElementType>::getKeys(tables_, vec, keys.empty() ? NULL : &keys[0]);
+
+        // the buckets are looked up first, so that the set of the features
+        // checked is sized once for all of their features
+        std::vector<std::pair<const lsh::FeatureIndex*, const lsh::FeatureIndex*> > buckets;
+        size_t feature_count = 0;
+        typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
+        typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
+        for (size_t t = 0; table != table_end; ++table, ++t) {
+            size_t key = keys[t];
+            std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
+            std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
+            for (; xor_mask != xor_mask_end; ++xor_mask) {
+                const lsh::FeatureIndex* training_index;
+                const lsh::FeatureIndex* last_training_index;
+                if (table->getBucketFromKey(key ^ (*xor_mask), training_index, last_training_index)) {
+                    buckets.push_back(std::make_pair(training_index, last_training_index));
+                    feature_count += last_training_index - training_index;
                 }
-            }
-        }
-        else {
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-            for (; table != table_end; ++table) {
-                size_t key = table->getKey(vec);
-                std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-                std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-                for (; xor_mask != xor_mask_end; ++xor_mask) {
-                    size_t sub_key = key ^ (*xor_mask);
-                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                    if (bucket == 0) continue;
-
-                    // Go over each descriptor index
-                    std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                    std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                    DistanceType hamming_distance;
-
-                    // Process the rest of the candidates
-                    for (; training_index < last_training_index; ++training_index) {
-                        // Compute the Hamming distance
-                        hamming_distance = distance_(vec, dataset_[*training_index], dataset_.cols);
-                        if (hamming_distance < radius) score_index_heap.push_back(ScoreIndexPair(hamming_distance, training_index));
-                    }
+                if (table->getAddedBucketFromKey(key ^ (*xor_mask), training_index, last_training_index)) {
+                    buckets.push_back(std::make_pair(training_index, last_training_index));
+                    feature_count += last_training_index - training_index;
                 }
             }
         }
+
+        VisitedSet visited_set((tables_.size() > 1) ? feature_count : 0);
+        CandidateBatch<ResultSet> candidates(*this, vec, result, (tables_.size() > 1) ? &visited_set : NULL);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            candidates.add(buckets[i].first, buckets[i].second);
+        }
+        candidates.flush();
     }
 
-    /** Performs the approximate nearest-neighbor search.
-     * This is a slower version than the above as it uses the ResultSet
+    /** A bucket to probe: the key of a table flipped by a mask
+     */
+    struct ProbeSt
+    {
+        /** Sum of the squared margins of the flipped bits */
+        float score;
+        /** Table of the bucket */
+        unsigned int table;
+        /** Bits flipped in the key of the query */
+        lsh::BucketKey mask;
+        /** Rank, in the increasing order of the margins, of the last bit flipped */
+        unsigned int last;
+
+        ProbeSt(float score_, unsigned int table_, lsh::BucketKey mask_, unsigned int last_) :
+            score(score_), table(table_), mask(mask_), last(last_) {}
+        ProbeSt() {}
+
+        bool operator<(const ProbeSt& other) const
+        {
+            return score < other.score;
+        }
+    };
+
+    /** Query-directed multi-probe LSH (Lv et al., "Multi-Probe LSH: Efficient
+     * Indexing for High-Dimensional Similarity Search"): the buckets of all
+     * the tables are probed from the most to the least likely to hold
+     * neighbors of vec, as scored by the margins of the query to the
+     * boundaries of the bits flipped. Each popped set of flipped bits
+     * generates the next ones by shifting or adding its last bit.
      * @param vec the feature to analyze
+     * @param result receives the neighbors found
+     * @param maxChecks number of features, or of extra buckets probed, after
+     * which the search stops
      */
     template<typename ResultSet>
-    void getNeighbors(const ElementType* vec, ResultSet& result)
+    void getNeighborsByMargins(const ElementType* vec, ResultSet& result, int maxChecks)
     {
-        typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-        typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-        for (; table != table_end; ++table) {
-            size_t key = table->getKey(vec);
-            std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-            std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-            for (; xor_mask != xor_mask_end; ++xor_mask) {
-                size_t sub_key = key ^ (*xor_mask);
-                const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                if (bucket == 0) continue;
-
-                // Go over each descriptor index
-                std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                DistanceType hamming_distance;
-
-                // Process the rest of the candidates
-                for (; training_index < last_training_index; ++training_index) {
-                    // Compute the Hamming distance
-                    hamming_distance = distance_(vec, dataset_[*training_index], dataset_.cols);
-                    result.addPoint(hamming_distance, *training_index);
-                }
+        const unsigned int max_key_size = sizeof(lsh::BucketKey) * CHAR_BIT;
+        size_t table_count = tables_.size();
+        std::vector<size_t> keys(table_count);
+        // for each table, the squared margins in increasing order and the bits they belong to
+        std::vector<float> scores(table_count * key_size_);
+        std::vector<lsh::BucketKey> bits(table_count * key_size_);
+        std::pair<float, unsigned int> order[max_key_size];
+        float margins[max_key_size];
+
+        // each probe adds at most one bucket to the heap: it rarely grows
+        // much beyond the first bucket of every table. The heap and the set
+        // of the features checked start small and grow as needed, checks can
+        // be as large as INT_MAX.
+        size_t max_heap_size = table_count + 2 * size_t(maxChecks);
+        Heap<ProbeSt> heap(int(std::min(max_heap_size, size_t(std::numeric_limits<int>::max()))), int(2 * table_count));
+        VisitedSet visited_set((table_count > 1) ? std::min(size_t(maxChecks), size_t(VISITED_SET_RESERVED)) : 0);
+        CandidateBatch<ResultSet> candidates(*this, vec, result, (table_count > 1) ? &visited_set : NULL);
+        int checks = 0;
+        for (unsigned int t = 0; t < table_count; ++t) {
+            keys[t] = tables_[t].getKey(vec, margins);
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                order[i] = std::make_pair(margins[i] * margins[i], i);
+            }
+            std::sort(order, order + key_size_);
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                scores[t * key_size_ + i] = order[i].first;
+                bits[t * key_size_ + i] = lsh::BucketKey(1) << order[i].second;
             }
+            checks += checkBucket(tables_[t], keys[t], candidates);
+            if (key_size_ > 0) heap.insert(ProbeSt(scores[t * key_size_], t, bits[t * key_size_], 0));
         }
+
+        ProbeSt probe;
+        int probes = 0;
+        while (checks < maxChecks && probes < maxChecks && heap.popMin(probe)) {
+            checks += checkBucket(tables_[probe.table], keys[probe.table] ^ probe.mask, candidates);
+            ++probes;
+
+            unsigned int next = probe.last + 1;
+            if (next < key_size_) {
+                const float* table_scores = &scores[probe.table * key_size_];
+                const lsh::BucketKey* table_bits = &bits[probe.table * key_size_];
+                // shift: flip the next bit instead of the last one
+                heap.insert(ProbeSt(probe.score - table_scores[probe.last] + table_scores[next], probe.table,
+                                    probe.mask ^ table_bits[probe.last] ^ table_bits[next], next));
+                // expand: flip the next bit too
+                heap.insert(ProbeSt(probe.score + table_scores[next], probe.table,
+                                    probe.mask | table_bits[next], next));
+            }
+        }
+        candidates.flush();
+    }
+
+    /** The candidates of a search, whose distances to the query are computed
+     * in batches before being added to the result. A feature is in one bucket
+     * of each table, so with several tables the same feature is found again
+     * and again: the features already checked are skipped.
+     */
+    template<typename ResultSet>
+    class CandidateBatch
+    {
+    public:
+        /** Constructor
+         * @param index the index searched
+         * @param vec the feature to analyze
+         * @param result receives the neighbors found
+         * @param visited the features already checked, or NULL if a feature can't be found twice
+         */
+        CandidateBatch(const LshIndex& index, const ElementType* vec, ResultSet& result, VisitedSet* visited) :
+            index_(index), vec_(vec), result_(result), visited_(visited), count_(0) {}
+
+        /** Adds the features of a bucket that were not checked yet
+         * @return the number of features added
+         */
+        int add(const lsh::FeatureIndex* first, const lsh::FeatureIndex* last)
+        {
+            int added = 0;
+            for (; first < last; ++first) {
+                lsh::FeatureIndex feature = *first;
+                if (index_.removed_count_ > 0 && index_.removed_points_.test(feature)) continue;
+                if (visited_ != NULL && !visited_->insert(int(feature))) continue;
+                features_[count_] = feature;
+                points_[count_] = index_.dataset_[feature];
+                ++added;
+                if (++count_ == BATCH_SIZE) flush();
+            }
+            return added;
+        }
+
+        /** Computes the distances of the pending features and adds them to the result */
+        void flush()
+        {
+            lsh::computeDistances(index_.distance_, vec_, points_, count_, index_.dataset_.cols, dists_);
+            for (size_t i = 0; i < count_; ++i) {
+                result_.addPoint(dists_[i], features_[i]);
+            }
+            count_ = 0;
+        }
+
+    private:
+        enum
+        {
+            /** Number of features whose distances are computed together */
+            BATCH_SIZE = 32
+        };
+
+        const LshIndex& index_;
+        const ElementType* vec_;
+        ResultSet& result_;
+        VisitedSet* visited_;
+        lsh::FeatureIndex features_[BATCH_SIZE];
+        const ElementType* points_[BATCH_SIZE];
+        DistanceType dists_[BATCH_SIZE];
+        size_t count_;
+    };
+
+    /** Adds the features of a bucket to the candidates
+     * @param table the table of the bucket
+     * @param key the key of the bucket
+     * @param candidates receives the features of the bucket
+     * @return the number of features checked
+     */
+    template<typename ResultSet>
+    int checkBucket(const lsh::LshTable<ElementType>& table, size_t key, CandidateBatch<ResultSet>& candidates) const
+    {
+        const lsh::FeatureIndex* training_index;
+        const lsh::FeatureIndex* last_training_index;
+        int checks = 0;
+        if (table.getBucketFromKey(key, training_index, last_training_index)) {
+            checks += candidates.add(training_index, last_training_index);
+        }
+        if (table.getAddedBucketFromKey(key, training_index, last_training_index)) {
+            checks += candidates.add(training_index, last_training_index);
+        }
+        return checks;
     }
 
     /** The different hash tables */
     std::vector<lsh::LshTable<ElementType> > tables_;
 
     /** The data the LSH tables where built from */
-    Matrix<ElementType> dataset_;
+    ChunkedMatrix<ElementType> dataset_;
 
     /** The size of the features (as ElementType[]) */
     unsigned int feature_size_;
@@ -492,6 +755,15 @@ private:
     /** Number of features in the dataset when the index was last built. */
     size_t size_at_build_;
 
+    /** Points removed from the index */
+    DynamicBitset removed_points_;
+
+    /** Number of removed points still stored in the tables */
+    size_t removed_count_;
+
+    /** Number of removed points left out of the tables when they were last built */
+    size_t removed_at_build_;
+
     IndexParams index_params_;
 
     /** table number */
@@ -500,8 +772,26 @@ private:
     unsigned int key_size_;
     /** How far should we look for neighbors in multi-probe LSH */
     unsigned int multi_probe_level_;
-    /**  Does the index have a copy of the dataset? */
-    bool ownDataset_;
+    /** Hash functions used for vectors of floats */
+    flann_lsh_hash_t hash_;
+    /** Width of the intervals cutting the projections of FLANN_LSH_PSTABLE */
+    float bucket_width_;
+    /** If true, the searches of vectors of floats with a positive checks parameter probe the buckets in query-directed order */
+    bool query_directed_;
+    /** Number of threads used to build the tables (only used with TBB) */
+    int cores_;
+
+    enum
+    {
+        /** Number of features whose nearest neighbor distance is used to estimate the bucket width */
+        BUCKET_WIDTH_SAMPLE = 100,
+        /** Number of features among which these nearest neighbors are searched */
+        BUCKET_WIDTH_REFERENCES = 1000,
+        /** Ratio of the bucket width to the estimated nearest neighbor distance */
+        BUCKET_WIDTH_FACTOR = 3,
+        /** Number of features the set of the features checked by the query-directed search is first sized for */
+        VISITED_SET_RESERVED = 1024
+    };
 
 
     /** The XOR masks to apply to a key to get the neighboring buckets */
@@ -63,7 +63,17 @@ class NNIndex
 {
 public:
     
-    void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
+    void addPoints(const Matrix<ElementType>& /*points*/, float /*rebuild_threshold*/ = 2)
+    {
+        throw FLANNException("Functionality not supported by this index");
+    }
+
+    void removePoint(size_t /*id*/, float /*rebuild_threshold*/ = 0.5)
+    {
+        throw FLANNException("Functionality not supported by this index");
+    }
+
+    void removePoints(const std::vector<size_t>& /*ids*/, float /*rebuild_threshold*/ = 0.5)
     {
         throw FLANNException("Functionality not supported by this index");
     }
@@ -117,6 +117,26 @@ enum flann_centers_init_t
     FLANN_CENTERS_RANDOM = 0,
     FLANN_CENTERS_GONZALES = 1,
     FLANN_CENTERS_KMEANSPP = 2,
+    FLANN_CENTERS_KMEANSPARALLEL = 3,
+};
+
+/* Algorithm used to assign the points to the centers in the k-means iterations */
+enum flann_kmeans_assignment_t
+{
+    FLANN_KMEANS_LLOYD = 0,
+    FLANN_KMEANS_HAMERLY = 1,
+    FLANN_KMEANS_ELKAN = 2,
+    /* Elkan for small branching factors, Hamerly otherwise */
+    FLANN_KMEANS_ACCELERATED = 3,
+};
+
+/* Hash functions of the LSH index for vectors of floats */
+enum flann_lsh_hash_t
+{
+    /* random projections cut in intervals (p-stable LSH), for the Euclidean distance */
+    FLANN_LSH_PSTABLE = 0,
+    /* signs of random projections (SimHash), for the angle between the vectors */
+    FLANN_LSH_SIGN = 1,
 };
 
 enum flann_log_level_t
@@ -120,6 +120,24 @@ public:
         nnIndex_->addPoints(points, rebuild_threshold);
     }
 
+    /**
+     * Removes a point from the index. The ids of the other points do not change.
+     *
+     * Params:
+     *     id = the id of the point to remove
+     *     rebuild_threshold = the index is rebuilt without the removed points
+     *                         when the fraction of removed points exceeds this value
+     */
+    void removePoint(size_t id, float rebuild_threshold = 0.5)
+    {
+        nnIndex_->removePoint(id, rebuild_threshold);
+    }
+
+    void removePoints(const std::vector<size_t>& ids, float rebuild_threshold = 0.5)
+    {
+        nnIndex_->removePoints(ids, rebuild_threshold);
+    }
+
     void save(std::string filename)
     {
         FILE* fout = fopen(filename.c_str(), "wb");
@@ -0,0 +1,280 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_CHUNKED_MATRIX_H_
+#define FLANN_CHUNKED_MATRIX_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "flann/util/matrix.h"
+#include "flann/util/dynamic_bitset.h"
+
+namespace flann
+{
+
+/**
+ * Append-only row storage used by the indexes to hold their dataset.
+ *
+ * The rows are either referenced in an external matrix or copied into
+ * fixed-size chunks owned by this object. A row never moves once added, so
+ * appending new rows only writes those rows, and a row is reached through
+ * a single pointer lookup.
+ *
+ * It provides the same row access interface as flann::Matrix.
+ */
+template <typename T>
+class ChunkedMatrix
+{
+public:
+    typedef T type;
+
+    ChunkedMatrix() : rows(0), cols(0), chunk_free_(NULL), chunk_free_rows_(0), owned_rows_(0), referenced_rows_(0)
+    {
+    }
+
+    /**
+     * Constructs an empty object holding rows of a given length.
+     */
+    explicit ChunkedMatrix(size_t cols_) :
+        rows(0), cols(cols_), chunk_free_(NULL), chunk_free_rows_(0), owned_rows_(0), referenced_rows_(0)
+    {
+    }
+
+    /**
+     * Constructor.
+     *
+     * Params:
+     *     data = the initial rows
+     *     copy = if true the rows are copied, otherwise they are referenced
+     */
+    ChunkedMatrix(const Matrix<T>& data, bool copy) :
+        rows(0), cols(0), chunk_free_(NULL), chunk_free_rows_(0), owned_rows_(0), referenced_rows_(0)
+    {
+        assign(data, copy);
+    }
+
+    ~ChunkedMatrix()
+    {
+        clear();
+    }
+
+    /**
+     * Operator that returns a (pointer to a) row of the data.
+     */
+    inline T* operator[](size_t index) const
+    {
+        return rows_[index];
+    }
+
+    /**
+     * Replaces the content with the rows of a matrix.
+     *
+     * Params:
+     *     data = the new rows
+     *     copy = if true the rows are copied, otherwise they are referenced
+     */
+    void assign(const Matrix<T>& data, bool copy)
+    {
+        clear();
+        cols = data.cols;
+        if (copy) {
+            append(data);
+        }
+        else {
+            rows_.resize(data.rows);
+            for (size_t i=0; i<data.rows; ++i) {
+                rows_[i] = data[i];
+            }
+            rows = data.rows;
+            referenced_rows_ = data.rows;
+        }
+    }
+
+    /**
+     * Appends copies of the rows of a matrix.
+     */
+    void append(const Matrix<T>& data)
+    {
+        // growing geometrically, so that appending small batches stays linear
+        if (rows+data.rows>rows_.capacity()) {
+            rows_.reserve(std::max(rows+data.rows, 2*rows_.capacity()));
+        }
+        for (size_t i=0; i<data.rows; ++i) {
+            push_back(data[i], data.rows-i);
+        }
+    }
+
+    /**
+     * Appends a copy of a row.
+     *
+     * Params:
+     *     row = the row to copy
+     *     expected = number of rows expected to be appended, including
+     *                this one, used to size a new chunk
+     */
+    void push_back(const T* row, size_t expected = 1)
+    {
+        if (chunk_free_rows_==0) {
+            size_t chunk_rows = std::max(expected, std::max(size_t(1), size_t(CHUNK_SIZE)/(cols*sizeof(T)+1)));
+            chunk_free_ = new T[chunk_rows*cols];
+            chunk_free_rows_ = chunk_rows;
+            chunks_.push_back(chunk_free_);
+        }
+        std::copy(row, row+cols, chunk_free_);
+        rows_.push_back(chunk_free_);
+        chunk_free_ += cols;
+        --chunk_free_rows_;
+        ++owned_rows_;
+        ++rows;
+    }
+
+    /**
+     * Releases the storage of some rows. The released rows keep their
+     * position but must not be accessed any more; the other rows owned by
+     * this object are copied into new chunks and the old chunks are freed.
+     *
+     * Params:
+     *     released = bitset marking the rows to release
+     */
+    void release(const DynamicBitset& released)
+    {
+        std::vector<T*> old_chunks;
+        old_chunks.swap(chunks_);
+        chunk_free_ = NULL;
+        chunk_free_rows_ = 0;
+        size_t kept = 0;
+        for (size_t i=referenced_rows_; i<rows; ++i) {
+            if (!released.test(i)) ++kept;
+        }
+        owned_rows_ = 0;
+        for (size_t i=0; i<rows; ++i) {
+            if (released.test(i)) {
+                rows_[i] = NULL;
+            }
+            else if (i>=referenced_rows_) {
+                if (chunk_free_rows_==0) {
+                    chunk_free_ = new T[kept*cols];
+                    chunk_free_rows_ = kept;
+                    chunks_.push_back(chunk_free_);
+                }
+                std::copy(rows_[i], rows_[i]+cols, chunk_free_);
+                rows_[i] = chunk_free_;
+                chunk_free_ += cols;
+                --chunk_free_rows_;
+                ++owned_rows_;
+            }
+        }
+        for (size_t i=0; i<old_chunks.size(); ++i) {
+            delete[] old_chunks[i];
+        }
+    }
+
+    /**
+     * Removes all the rows and frees the owned chunks.
+     */
+    void clear()
+    {
+        for (size_t i=0; i<chunks_.size(); ++i) {
+            delete[] chunks_[i];
+        }
+        chunks_.clear();
+        std::vector<T*>().swap(rows_);
+        chunk_free_ = NULL;
+        chunk_free_rows_ = 0;
+        owned_rows_ = 0;
+        referenced_rows_ = 0;
+        rows = 0;
+    }
+
+    /**
+     * Exchanges the content with another object.
+     */
+    void swap(ChunkedMatrix& other)
+    {
+        std::swap(rows, other.rows);
+        std::swap(cols, other.cols);
+        rows_.swap(other.rows_);
+        chunks_.swap(other.chunks_);
+        std::swap(chunk_free_, other.chunk_free_);
+        std::swap(chunk_free_rows_, other.chunk_free_rows_);
+        std::swap(owned_rows_, other.owned_rows_);
+        std::swap(referenced_rows_, other.referenced_rows_);
+    }
+
+    /**
+     * Returns the memory used by the row pointers and the owned chunks.
+     */
+    size_t usedMemory() const
+    {
+        return rows_.capacity()*sizeof(T*)+(owned_rows_+chunk_free_rows_)*cols*sizeof(T);
+    }
+
+    size_t rows;
+    size_t cols;
+
+private:
+    ChunkedMatrix(const ChunkedMatrix&);
+    ChunkedMatrix& operator=(const ChunkedMatrix&);
+
+    enum
+    {
+        /**
+         * Preferred size (in bytes) of a chunk.
+         */
+        CHUNK_SIZE = 1<<20
+    };
+
+    /**
+     * Pointers to the rows.
+     */
+    std::vector<T*> rows_;
+    /**
+     * Chunks owned by this object.
+     */
+    std::vector<T*> chunks_;
+    /**
+     * Free space remaining in the last chunk.
+     */
+    T* chunk_free_;
+    size_t chunk_free_rows_;
+    /**
+     * Number of rows stored in the owned chunks.
+     */
+    size_t owned_rows_;
+    /**
+     * Number of rows (at the beginning) referenced in an external matrix.
+     */
+    size_t referenced_rows_;
+};
+
+}
+
+#endif //FLANN_CHUNKED_MATRIX_H_
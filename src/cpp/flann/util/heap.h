@@ -68,12 +68,14 @@ public:
      *
      * Params:
      *     size = heap size
+     *     reserved = number of elements for which storage is allocated up
+     *                front (the whole heap size if negative)
      */
 
-    Heap(int size)
+    Heap(int size, int reserved = -1)
     {
         length = size;
-        heap.reserve(length);
+        heap.reserve((reserved>=0 && reserved<length) ? reserved : length);
         count = 0;
     }
 
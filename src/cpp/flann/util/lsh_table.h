@@ -47,9 +47,23 @@
 #endif
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
+// The bits of the keys of binary features are extracted with the BMI2 PEXT
+// instruction when the CPU running the code supports it (the compiler must
+// support the target function attribute)
+#if defined(__x86_64__) && !defined(FLANN_NO_PEXT) && \
+    ((defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+     (!defined(__clang__) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define FLANN_LSH_PEXT 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
+#include "flann/general.h"
 #include "flann/util/dynamic_bitset.h"
 #include "flann/util/matrix.h"
+#include "flann/util/random.h"
+#include "flann/util/saving.h"
 
 namespace flann
 {
@@ -66,10 +80,105 @@ typedef uint32_t FeatureIndex;
  */
 typedef unsigned int BucketKey;
 
-/** A bucket in an LSH table
+/** A bucket in an LSH table, while features are added to it
  */
 typedef std::vector<FeatureIndex> Bucket;
 
+/** Where the features of a bucket are, in a table that is not modified anymore
+ */
+struct BucketSlot
+{
+    /** The key of the bucket */
+    BucketKey key_;
+    /** Range of the features of the bucket in the array of all the features, empty for a free slot */
+    FeatureIndex begin_;
+    FeatureIndex end_;
+
+    BucketSlot() : key_(0), begin_(0), end_(0) {}
+};
+
+/** Gathers the bits of the feature blocks selected by the mask blocks in the
+ * low bits of the key
+ * Given the feature ABCDEF, and the mask 001011, the output will be 000CEF
+ */
+inline size_t extractKey(const size_t* feature_block_ptr, const size_t* mask_block_ptr, size_t block_count)
+{
+    size_t subsignature = 0;
+    size_t bit_index = 1;
+    for (size_t i = 0; i < block_count; ++i) {
+        // get the mask and signature blocks
+        size_t feature_block = feature_block_ptr[i];
+        size_t mask_block = mask_block_ptr[i];
+        while (mask_block) {
+            // Get the lowest set bit in the mask block
+            size_t lowest_bit = mask_block & (-(ptrdiff_t)mask_block);
+            // Add it to the current subsignature if necessary
+            subsignature += (feature_block & lowest_bit) ? bit_index : 0;
+            // Reset the bit in the mask block
+            mask_block ^= lowest_bit;
+            // increment the bit index for the subsignature
+            bit_index <<= 1;
+        }
+    }
+    return subsignature;
+}
+
+#ifdef FLANN_LSH_PEXT
+/** Tells if the CPU has the BMI2 instructions, PEXT among them
+ */
+inline bool hasPext()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7) return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 8)) != 0;
+}
+
+/** Tells if the CPU is an AMD or Hygon CPU older than Zen 3 (family 0x19),
+ * which implement PEXT in microcode
+ */
+inline bool isSlowPextVendor()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(0, eax, ebx, ecx, edx);
+    // the vendor string is in ebx, edx, ecx: "AuthenticAMD" or "HygonGenuine"
+    bool amd = (ebx == 0x68747541u && edx == 0x69746e65u && ecx == 0x444d4163u);
+    bool hygon = (ebx == 0x6f677948u && edx == 0x6e65476eu && ecx == 0x656e6975u);
+    if (!amd && !hygon) return false;
+    __cpuid(1, eax, ebx, ecx, edx);
+    unsigned int family = (eax >> 8) & 0xf;
+    if (family == 0xf) family += (eax >> 20) & 0xff;
+    return family < 0x19;
+}
+
+/** Tells if the CPU has a fast PEXT instruction (on the older AMD CPUs it
+ * is much slower than testing the bits one by one).
+ * All the CPUs with BMI2 also have POPCNT.
+ */
+inline bool hasFastPext()
+{
+    static const bool has_fast_pext = hasPext() && !isSlowPextVendor();
+    return has_fast_pext;
+}
+
+/** Gathers the bits of the feature blocks selected by the mask blocks in the
+ * low bits of the key with PEXT, the same key as extractKey
+ */
+__attribute__((target("bmi2,popcnt")))
+inline size_t extractKeyPext(const size_t* feature_block_ptr, const size_t* mask_block_ptr, size_t block_count)
+{
+    size_t subsignature = 0;
+    unsigned int shift = 0;
+    for (size_t i = 0; i < block_count; ++i) {
+        size_t mask_block = mask_block_ptr[i];
+        if (mask_block == 0) continue;
+        subsignature |= size_t(_pext_u64(feature_block_ptr[i], mask_block)) << shift;
+        shift += (unsigned int)_mm_popcnt_u64(mask_block);
+    }
+    return subsignature;
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /** POD for stats about an LSH table
@@ -125,7 +234,7 @@ template<typename ElementType>
 class LshTable
 {
 public:
-    /** A container of all the feature indices. Optimized for space
+    /** A container of all the feature indices, while features are added
      */
 #if USE_UNORDERED_MAP
     typedef std::unordered_map<BucketKey, Bucket> BucketsSpace;
@@ -133,13 +242,9 @@ public:
     typedef std::map<BucketKey, Bucket> BucketsSpace;
 #endif
 
-    /** A container of all the feature indices. Optimized for speed
-     */
-    typedef std::vector<Bucket> BucketsSpeed;
-
     /** Default constructor
      */
-    LshTable()
+    LshTable() : added_count_(0)
     {
     }
 
@@ -147,11 +252,21 @@ public:
      * Create the mask and allocate the memory
      * @param feature_size is the size of the feature (considered as a ElementType[])
      * @param key_size is the number of bits that are turned on in the feature
+     * @param hash the hash functions, for the features that are vectors of floats
+     * @param bucket_width the width of the intervals cutting the projections of FLANN_LSH_PSTABLE
+     */
+    LshTable(unsigned int /*feature_size*/, unsigned int /*key_size*/, flann_lsh_hash_t /*hash*/ = FLANN_LSH_PSTABLE,
+             float /*bucket_width*/ = 0)
+    {
+        throw FLANNException("LSH is not implemented for that type");
+    }
+
+    /** Tells if the keys are computed from random projections of the features,
+     * whose hash functions depend on the bucket width
      */
-    LshTable(unsigned int /*feature_size*/, unsigned int /*key_size*/)
+    static bool usesProjections()
     {
-        std::cerr << "LSH is not implemented for that type" << std::endl;
-        throw;
+        return false;
     }
 
     /** Add a feature to the table
@@ -162,78 +277,162 @@ public:
     {
         // Add the value to the corresponding bucket
         BucketKey key = getKey(feature);
-
-        switch (speed_level_) {
-        case kArray:
-            // That means we get the buckets from an array
-            buckets_speed_[key].push_back(value);
-            break;
-        case kBitsetHash:
-            // That means we can check the bitset for the presence of a key
-            key_bitset_.set(key);
-            buckets_space_[key].push_back(value);
-            break;
-        case kHash:
-        {
-            // That means we have to check for the hash table for the presence of a key
-            buckets_space_[key].push_back(value);
-            break;
-        }
-        }
+        buckets_space_[key].push_back(value);
+        // The features added to a frozen table stay in the map until they are a
+        // large enough part of the table, so that adding them costs O(1) amortized
+        if (speed_level_ != kBuilding && ++added_count_ * MERGE_RATIO > features_.size()) merge();
     }
 
     /** Add a set of features to the table
      * @param dataset the values to store
      */
-    void add(Matrix<ElementType> dataset)
+    template <typename Dataset>
+    void add(const Dataset& dataset)
     {
-#if USE_UNORDERED_MAP
-        buckets_space_.rehash((buckets_space_.size() + dataset.rows) * 1.2);
-#endif
-        // Add the features to the table
-        for (unsigned int i = 0; i < dataset.rows; ++i) add(i, dataset[i]);
-        // Now that the table is full, optimize it for speed/space
-        optimize();
+        addAll(dataset, NULL);
+    }
+
+    /** Add a set of features to the table, leaving out some of them
+     * @param dataset the values to store
+     * @param removed the features not to store
+     */
+    template <typename Dataset>
+    void add(const Dataset& dataset, const DynamicBitset& removed)
+    {
+        addAll(dataset, &removed);
     }
 
     /** Get a bucket given the key
-     * @param key
-     * @return
+     * @param key the key of the bucket
+     * @param first receives the first of the features of the bucket
+     * @param last receives the end of the features of the bucket
+     * @return false if the bucket is empty
      */
-    inline const Bucket* getBucketFromKey(BucketKey key) const
+    inline bool getBucketFromKey(BucketKey key, const FeatureIndex*& first, const FeatureIndex*& last) const
     {
-        // Generate other buckets
         switch (speed_level_) {
         case kArray:
-            // That means we get the buckets from an array
-            return &buckets_speed_[key];
-            break;
+        {
+            // That means we get the range of the bucket from an array
+            FeatureIndex begin = bucket_offsets_[key];
+            FeatureIndex end = bucket_offsets_[key + 1];
+            if (begin == end) return false;
+            first = &features_[begin];
+            last = first + (end - begin);
+            return true;
+        }
         case kBitsetHash:
             // That means we can check the bitset for the presence of a key
-            if (key_bitset_.test(key)) return &buckets_space_.find(key)->second;
-            else return 0;
-            break;
+            if (!key_bitset_.test(key)) return false;
+            // fall through
         case kHash:
         {
-            // That means we have to check for the hash table for the presence of a key
-            BucketsSpace::const_iterator bucket_it, bucket_end = buckets_space_.end();
-            bucket_it = buckets_space_.find(key);
-            // Stop here if that bucket does not exist
-            if (bucket_it == bucket_end) return 0;
-            else return &bucket_it->second;
-            break;
+            // That means we have to check the hash table for the presence of a key
+            size_t mask = bucket_slots_.size() - 1;
+            for (size_t pos = hashKey(key) & mask; bucket_slots_[pos].begin_ != bucket_slots_[pos].end_;
+                 pos = (pos + 1) & mask) {
+                if (bucket_slots_[pos].key_ == key) {
+                    first = &features_[bucket_slots_[pos].begin_];
+                    last = first + (bucket_slots_[pos].end_ - bucket_slots_[pos].begin_);
+                    return true;
+                }
+            }
+            return false;
         }
+        case kBuilding:
+            return getMapBucket(key, first, last);
         }
-        return 0;
+        return false;
+    }
+
+    /** Get the bucket of a key among the features added to the table since it
+     * was frozen, which are not returned by getBucketFromKey
+     * @param key the key of the bucket
+     * @param first receives the first of the features of the bucket
+     * @param last receives the end of the features of the bucket
+     * @return false if the bucket is empty
+     */
+    inline bool getAddedBucketFromKey(BucketKey key, const FeatureIndex*& first, const FeatureIndex*& last) const
+    {
+        if (speed_level_ == kBuilding || added_count_ == 0) return false;
+        return getMapBucket(key, first, last);
+    }
+
+    /** Optimize the table for speed/space, once all the features are added:
+     * the buckets are frozen in one array of features, found from an array of
+     * offsets when most keys are used or from an open addressing hash table
+     * otherwise. The features added afterwards are kept apart in a map, and
+     * frozen with the others when they reach 1/MERGE_RATIO of the table.
+     */
+    void optimize()
+    {
+        if (speed_level_ == kBuilding) merge();
+    }
+
+    /** Save the table, freezing all its features first
+     * @param stream the stream to save to
+     */
+    void save(FILE* stream)
+    {
+        if (speed_level_ == kBuilding || added_count_ > 0) merge();
+        save_value(stream, key_size_);
+        save_value(stream, speed_level_);
+        save_value(stream, features_);
+        save_value(stream, bucket_offsets_);
+        save_value(stream, bucket_slots_);
+        save_value(stream, mask_);
+        save_value(stream, projections_);
+        save_value(stream, offsets_);
+        save_value(stream, bucket_width_);
+    }
+
+    /** Load a table saved with save()
+     * @param stream the stream to load from
+     */
+    void load(FILE* stream)
+    {
+        load_value(stream, key_size_);
+        load_value(stream, speed_level_);
+        load_value(stream, features_);
+        load_value(stream, bucket_offsets_);
+        load_value(stream, bucket_slots_);
+        load_value(stream, mask_);
+        load_value(stream, projections_);
+        load_value(stream, offsets_);
+        load_value(stream, bucket_width_);
+        buckets_space_.clear();
+        added_count_ = 0;
+        if (speed_level_ != kArray) setKeyBitset();
     }
 
     /** Compute the sub-signature of a feature
      */
     size_t getKey(const ElementType* /*feature*/) const
     {
-        std::cerr << "LSH is not implemented for that type" << std::endl;
-        throw;
-        return 1;
+        throw FLANNException("LSH is not implemented for that type");
+    }
+
+    /** Compute the sub-signatures of a feature in several tables at once
+     * @param tables the tables
+     * @param feature the feature to analyze
+     * @param keys receives the sub-signature in each table
+     */
+    static void getKeys(const std::vector<LshTable>& tables, const ElementType* feature, size_t* keys)
+    {
+        for (size_t i = 0; i < tables.size(); ++i) keys[i] = tables[i].getKey(feature);
+    }
+
+    /** Compute the sub-signature of a feature and the margins of its bits,
+     * i.e. how far the feature is from the boundary that would flip each bit.
+     * Only the hash functions based on projections have margins, they are all
+     * 0 otherwise.
+     * @param feature the feature to analyze
+     * @param margins receives the margins of the key_size bits
+     */
+    size_t getKey(const ElementType* feature, float* margins) const
+    {
+        std::fill(margins, margins + key_size_, 0.0f);
+        return getKey(feature);
     }
 
     /** Get statistics about the table
@@ -243,51 +442,231 @@ public:
 
 private:
     /** defines the speed fo the implementation
-     * kArray uses a vector for storing data
-     * kBitsetHash uses a hash map but checks for the validity of a key with a bitset
-     * kHash uses a hash map only
+     * kArray finds the frozen buckets from an array of offsets indexed by the key
+     * kBitsetHash finds the frozen buckets from a hash table but checks for the validity of a key with a bitset
+     * kHash finds the frozen buckets from a hash table only
+     * kBuilding uses a map of buckets, to which features can be added
      */
     enum SpeedLevel
     {
-        kArray, kBitsetHash, kHash
+        kArray, kBitsetHash, kHash, kBuilding
+    };
+
+    enum
+    {
+        /** Minimum size of the hash table of the frozen buckets */
+        MIN_SLOT_COUNT = 16,
+        /** The features added to a frozen table are frozen with the others
+         * when they are more than 1/MERGE_RATIO of them */
+        MERGE_RATIO = 8
     };
 
     /** Initialize some variables
      */
     void initialize(size_t key_size)
     {
-        speed_level_ = kHash;
+        speed_level_ = kBuilding;
         key_size_ = key_size;
+        added_count_ = 0;
     }
 
-    /** Optimize the table for speed/space
+    enum
+    {
+        /** Number of bits of the key sorted in each pass of the radix sort */
+        RADIX_BITS = 11
+    };
+
+    /** Add a set of features to the table and optimize it. The keys are
+     * computed for all the features and sorted, rather than inserted one by
+     * one in the map. Filling the table takes 12 bytes per feature until it
+     * is frozen (the keys, the features and the buffer of the radix sort),
+     * and the frozen table keeps 4 of them.
+     * @param dataset the values to store
+     * @param removed the features not to store, if not NULL
      */
-    void optimize()
+    template <typename Dataset>
+    void addAll(const Dataset& dataset, const DynamicBitset* removed)
     {
-        // If we are already using the fast storage, no need to do anything
-        if (speed_level_ == kArray) return;
+        std::vector<BucketKey> keys;
+        std::vector<FeatureIndex> features;
+        takeFrozen(keys, features);
+        takeBuckets(keys, features);
+        if (keys.size() < dataset.rows) keys.resize(dataset.rows);
+        features.reserve(features.size() + dataset.rows);
+        for (unsigned int i = 0; i < dataset.rows; ++i) {
+            if (removed != NULL && removed->test(i)) continue;
+            keys[i] = BucketKey(getKey(dataset[i]));
+            features.push_back(i);
+        }
+        freeze(keys, features);
+    }
 
-        // Use an array if it will be more than half full
-        if (buckets_space_.size() > (unsigned int)((1 << key_size_) / 2)) {
-            speed_level_ = kArray;
-            // Fill the array version of it
-            buckets_speed_.resize(1 << key_size_);
-            for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) buckets_speed_[key_bucket->first] = key_bucket->second;
+    /** Move the features of the map to a list of features, bucket by bucket,
+     * storing their keys in an array indexed by feature
+     */
+    void takeBuckets(std::vector<BucketKey>& keys, std::vector<FeatureIndex>& features)
+    {
+        size_t feature_count = 0;
+        size_t key_count = keys.size();
+        for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) {
+            feature_count += key_bucket->second.size();
+            for (Bucket::const_iterator feature = key_bucket->second.begin(); feature != key_bucket->second.end(); ++feature) {
+                key_count = std::max(key_count, size_t(*feature) + 1);
+            }
+        }
+        keys.resize(key_count);
+        features.reserve(features.size() + feature_count);
+        for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) {
+            for (Bucket::const_iterator feature = key_bucket->second.begin(); feature != key_bucket->second.end(); ++feature) {
+                keys[*feature] = key_bucket->first;
+                features.push_back(*feature);
+            }
+        }
+        BucketsSpace().swap(buckets_space_);
+    }
+
+    /** Freeze all the features of the table, the frozen ones and the ones of the map
+     */
+    void merge()
+    {
+        std::vector<BucketKey> keys;
+        std::vector<FeatureIndex> features;
+        takeFrozen(keys, features);
+        takeBuckets(keys, features);
+        freeze(keys, features);
+    }
+
+    /** Get the bucket of a key from the map
+     */
+    bool getMapBucket(BucketKey key, const FeatureIndex*& first, const FeatureIndex*& last) const
+    {
+        BucketsSpace::const_iterator bucket_it = buckets_space_.find(key);
+        // Stop here if that bucket does not exist
+        if (bucket_it == buckets_space_.end() || bucket_it->second.empty()) return false;
+        first = &bucket_it->second[0];
+        last = first + bucket_it->second.size();
+        return true;
+    }
+
+    /** Sort features by key with a LSD radix sort. Only the features are
+     * moved, their keys are read from the array indexed by feature, so that
+     * the sort needs a buffer of 4 bytes per feature. It is stable, so the
+     * features of a bucket stay in the order they were added.
+     */
+    void sortByKey(const std::vector<BucketKey>& keys, std::vector<FeatureIndex>& features) const
+    {
+        if (features.empty()) return;
+        // the counts of the digits of all the passes are computed at once,
+        // while the features are still in order
+        size_t digit_count = size_t(1) << RADIX_BITS;
+        size_t pass_count = (key_size_ + RADIX_BITS - 1) / RADIX_BITS;
+        std::vector<size_t> all_counts(pass_count * digit_count, 0);
+        for (size_t i = 0; i < features.size(); ++i) {
+            BucketKey key = keys[features[i]];
+            for (size_t pass = 0; pass < pass_count; ++pass) {
+                ++all_counts[pass * digit_count + keyDigit(key, (unsigned int)(pass * RADIX_BITS))];
+            }
+        }
+        std::vector<FeatureIndex> sorted(features.size());
+        for (size_t pass = 0; pass < pass_count; ++pass) {
+            unsigned int shift = (unsigned int)(pass * RADIX_BITS);
+            size_t* counts = &all_counts[pass * digit_count];
+            // nothing to do if all the keys have the same digit
+            if (counts[keyDigit(keys[features[0]], shift)] == features.size()) continue;
+            size_t offset = 0;
+            for (size_t digit = 0; digit < digit_count; ++digit) {
+                size_t count = counts[digit];
+                counts[digit] = offset;
+                offset += count;
+            }
+            for (size_t i = 0; i < features.size(); ++i) sorted[counts[keyDigit(keys[features[i]], shift)]++] = features[i];
+            features.swap(sorted);
+        }
+    }
+
+    /** The digit of a key starting at a bit
+     */
+    static size_t keyDigit(BucketKey key, unsigned int shift)
+    {
+        return size_t(key >> shift) & ((size_t(1) << RADIX_BITS) - 1);
+    }
+
+    /** Freeze the buckets of a list of features: the features are stored in
+     * one array, sorted by key, and the buckets are found from an array of
+     * offsets when most keys are used or from an open addressing hash table
+     * otherwise
+     * @param keys the keys of the features, indexed by feature
+     * @param features the features to freeze, in the order they were added
+     */
+    void freeze(std::vector<BucketKey>& keys, std::vector<FeatureIndex>& features)
+    {
+        sortByKey(keys, features);
+        features_.swap(features);
+        std::vector<FeatureIndex>().swap(features);
+        size_t bucket_count = 0;
+        for (size_t i = 0; i < features_.size(); ++i) {
+            if (i == 0 || keys[features_[i]] != keys[features_[i - 1]]) ++bucket_count;
+        }
 
-            // Empty the hash table
-            buckets_space_.clear();
-            return;
+        size_t key_count = size_t(1) << key_size_;
+        size_t slot_count = MIN_SLOT_COUNT;
+        while (slot_count < 2 * bucket_count) slot_count <<= 1;
+
+        // Use an array of offsets if it is smaller than the hash table
+        if ((key_count + 1) * sizeof(FeatureIndex) <= slot_count * sizeof(BucketSlot)) {
+            speed_level_ = kArray;
+            bucket_offsets_.assign(key_count + 1, 0);
+            for (size_t i = 0; i < features_.size(); ++i) ++bucket_offsets_[keys[features_[i]] + 1];
+            for (size_t key = 0; key < key_count; ++key) bucket_offsets_[key + 1] += bucket_offsets_[key];
         }
+        else {
+            bucket_slots_.assign(slot_count, BucketSlot());
+            for (size_t begin = 0, end; begin < features_.size(); begin = end) {
+                BucketKey key = keys[features_[begin]];
+                for (end = begin + 1; end < features_.size() && keys[features_[end]] == key; ++end) ;
+                BucketSlot slot;
+                slot.key_ = key;
+                slot.begin_ = FeatureIndex(begin);
+                slot.end_ = FeatureIndex(end);
+                insertSlot(slot);
+            }
+            setKeyBitset();
+        }
+        std::vector<BucketKey>().swap(keys);
+        added_count_ = 0;
+    }
 
-        // If the bitset is going to use less than 10% of the RAM of the hash map (at least 1 size_t for the key and two
-        // for the vector) or less than 512MB (key_size_ <= 30)
-        if (((std::max(buckets_space_.size(), buckets_speed_.size()) * CHAR_BIT * 3 * sizeof(BucketKey)) / 10
-             >= size_t(1 << key_size_)) || (key_size_ <= 32)) {
+    /** Hash function of the keys in the hash table of the frozen buckets
+     */
+    static size_t hashKey(BucketKey key)
+    {
+        unsigned int h = (unsigned int)key * 0x9e3779b1u;
+        return h ^ (h >> 16);
+    }
+
+    /** Insert a bucket in the hash table of the frozen buckets (linear probing)
+     */
+    void insertSlot(const BucketSlot& slot)
+    {
+        size_t mask = bucket_slots_.size() - 1;
+        size_t pos = hashKey(slot.key_) & mask;
+        while (bucket_slots_[pos].begin_ != bucket_slots_[pos].end_) pos = (pos + 1) & mask;
+        bucket_slots_[pos] = slot;
+    }
+
+    /** Keep track of the keys of the hash table in a bitset, if it is not
+     * larger than the hash table itself
+     */
+    void setKeyBitset()
+    {
+        size_t key_count = size_t(1) << key_size_;
+        if (key_count / CHAR_BIT <= bucket_slots_.size() * sizeof(BucketSlot)) {
             speed_level_ = kBitsetHash;
-            key_bitset_.resize(1 << key_size_);
+            key_bitset_.resize(key_count);
             key_bitset_.reset();
-            // Try with the BucketsSpace
-            for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) key_bitset_.set(key_bucket->first);
+            for (size_t pos = 0; pos < bucket_slots_.size(); ++pos) {
+                if (bucket_slots_[pos].begin_ != bucket_slots_[pos].end_) key_bitset_.set(bucket_slots_[pos].key_);
+            }
         }
         else {
             speed_level_ = kHash;
@@ -295,14 +674,77 @@ private:
         }
     }
 
-    /** The vector of all the buckets if they are held for speed
+    /** Move the frozen buckets to a list of features, storing their keys in
+     * an array indexed by feature, before they are frozen again with other
+     * features. The features are kept in the order of their keys.
+     */
+    void takeFrozen(std::vector<BucketKey>& keys, std::vector<FeatureIndex>& features)
+    {
+        if (speed_level_ == kBuilding) return;
+        size_t key_count = keys.size();
+        for (size_t i = 0; i < features_.size(); ++i) key_count = std::max(key_count, size_t(features_[i]) + 1);
+        keys.resize(key_count);
+        if (speed_level_ == kArray) {
+            for (size_t key = 0; key + 1 < bucket_offsets_.size(); ++key) {
+                for (FeatureIndex i = bucket_offsets_[key]; i < bucket_offsets_[key + 1]; ++i) {
+                    keys[features_[i]] = BucketKey(key);
+                }
+            }
+        }
+        else {
+            for (size_t pos = 0; pos < bucket_slots_.size(); ++pos) {
+                const BucketSlot& slot = bucket_slots_[pos];
+                for (FeatureIndex i = slot.begin_; i < slot.end_; ++i) {
+                    keys[features_[i]] = slot.key_;
+                }
+            }
+        }
+        if (features.empty()) features.swap(features_);
+        else features.insert(features.end(), features_.begin(), features_.end());
+        std::vector<FeatureIndex>().swap(features_);
+        std::vector<FeatureIndex>().swap(bucket_offsets_);
+        std::vector<BucketSlot>().swap(bucket_slots_);
+        key_bitset_.clear();
+        speed_level_ = kBuilding;
+    }
+
+    /** Compute the projections of a feature on the random directions
+     * Only used in the float case
+     * @param feature the feature to project
+     * @param dots receives the key_size projections
      */
-    BucketsSpeed buckets_speed_;
+    void project(const ElementType* feature, float* dots) const;
+
+    /** The number of features added since the table was frozen in the bucket of a key
+     */
+    size_t addedBucketSize(BucketKey key) const
+    {
+        const FeatureIndex* first;
+        const FeatureIndex* last;
+        return getAddedBucketFromKey(key, first, last) ? size_t(last - first) : 0;
+    }
 
-    /** The hash table of all the buckets in case we cannot use the speed version
+    /** The map of all the buckets while features are added, or of the features
+     * added since the table was frozen
      */
     BucketsSpace buckets_space_;
 
+    /** The number of features added since the table was frozen
+     */
+    size_t added_count_;
+
+    /** The features of all the frozen buckets, one bucket after the other
+     */
+    std::vector<FeatureIndex> features_;
+
+    /** For kArray, the offset in features_ of the bucket of each key (and the end of the last one)
+     */
+    std::vector<FeatureIndex> bucket_offsets_;
+
+    /** For kBitsetHash and kHash, the hash table of the frozen buckets
+     */
+    std::vector<BucketSlot> bucket_slots_;
+
     /** What is used to store the data */
     SpeedLevel speed_level_;
 
@@ -320,15 +762,32 @@ private:
      * Only used in the unsigned char case
      */
     std::vector<size_t> mask_;
+
+    // Members only used for the float specialization
+    /** The random projection directions, one per bit of the key, stored
+     * transposed (feature_size rows of key_size values) so that all the
+     * projections of a feature are accumulated in one pass over it
+     */
+    std::vector<float> projections_;
+
+    /** The random offsets of the intervals of each projection (FLANN_LSH_PSTABLE only)
+     */
+    std::vector<float> offsets_;
+
+    /** The width of the intervals cutting the projections, 0 for sign projections
+     */
+    float bucket_width_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Specialization for unsigned char
 
 template<>
-inline LshTable<unsigned char>::LshTable(unsigned int feature_size, unsigned int subsignature_size)
+inline LshTable<unsigned char>::LshTable(unsigned int feature_size, unsigned int subsignature_size,
+                                         flann_lsh_hash_t /*hash*/, float /*bucket_width*/)
 {
     initialize(subsignature_size);
+    bucket_width_ = 0;
     // Allocate the mask
     mask_ = std::vector<size_t>((size_t)ceil((float)(feature_size * sizeof(char)) / (float)sizeof(size_t)), 0);
 
@@ -372,39 +831,158 @@ inline size_t LshTable<unsigned char>::getKey(const unsigned char* feature) cons
     // no need to check if T is dividable by sizeof(size_t) like in the Hamming
     // distance computation as we have a mask
     const size_t* feature_block_ptr = reinterpret_cast<const size_t*> (feature);
+#ifdef FLANN_LSH_PEXT
+    if (hasFastPext()) return extractKeyPext(feature_block_ptr, &mask_[0], mask_.size());
+#endif
+    return extractKey(feature_block_ptr, &mask_[0], mask_.size());
+}
 
-    // Figure out the subsignature of the feature
-    // Given the feature ABCDEF, and the mask 001011, the output will be
-    // 000CEF
-    size_t subsignature = 0;
-    size_t bit_index = 1;
+/** Compute the sub-signatures of a feature in several tables at once
+ * The instruction set is chosen once for all the tables
+ * @param tables the tables
+ * @param feature the feature to analyze
+ * @param keys receives the sub-signature in each table
+ */
+template<>
+inline void LshTable<unsigned char>::getKeys(const std::vector<LshTable>& tables, const unsigned char* feature,
+                                             size_t* keys)
+{
+#ifdef FLANN_LSH_PEXT
+    if (hasFastPext()) {
+        const size_t* feature_block_ptr = reinterpret_cast<const size_t*> (feature);
+        for (size_t i = 0; i < tables.size(); ++i) {
+            keys[i] = extractKeyPext(feature_block_ptr, &tables[i].mask_[0], tables[i].mask_.size());
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < tables.size(); ++i) keys[i] = tables[i].getKey(feature);
+}
 
-    for (std::vector<size_t>::const_iterator pmask_block = mask_.begin(); pmask_block != mask_.end(); ++pmask_block) {
-        // get the mask and signature blocks
-        size_t feature_block = *feature_block_ptr;
-        size_t mask_block = *pmask_block;
-        while (mask_block) {
-            // Get the lowest set bit in the mask block
-            size_t lowest_bit = mask_block & (-(ptrdiff_t)mask_block);
-            // Add it to the current subsignature if necessary
-            subsignature += (feature_block & lowest_bit) ? bit_index : 0;
-            // Reset the bit in the mask block
-            mask_block ^= lowest_bit;
-            // increment the bit index for the subsignature
-            bit_index <<= 1;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Specialization for float
+
+template<>
+inline LshTable<float>::LshTable(unsigned int feature_size, unsigned int key_size, flann_lsh_hash_t hash,
+                                 float bucket_width)
+{
+    if (key_size > sizeof(BucketKey) * CHAR_BIT) {
+        throw FLANNException("The LSH key size can't be larger than 32 bits");
+    }
+    if (hash == FLANN_LSH_PSTABLE && bucket_width <= 0) {
+        throw FLANNException("The LSH bucket width must be positive");
+    }
+    initialize(key_size);
+    bucket_width_ = (hash == FLANN_LSH_PSTABLE) ? bucket_width : 0;
+
+    // Gaussian directions are 2-stable: the projections of two features differ
+    // by their Euclidean distance times a standard normal variable
+    projections_.resize(size_t(feature_size) * key_size);
+    for (size_t i = 0; i < projections_.size(); ++i) projections_[i] = float(rand_normal());
+    if (bucket_width_ > 0) {
+        offsets_.resize(key_size);
+        for (unsigned int i = 0; i < key_size; ++i) offsets_[i] = float(rand_double(bucket_width_));
+    }
+}
+
+template<>
+inline bool LshTable<float>::usesProjections()
+{
+    return true;
+}
+
+template<>
+inline void LshTable<float>::project(const float* feature, float* dots) const
+{
+    std::fill(dots, dots + key_size_, 0.0f);
+
+    // the inner loop runs over contiguous projections and is vectorized
+    const float* projection = projections_.empty() ? NULL : &projections_[0];
+    size_t feature_size = projections_.size() / key_size_;
+    for (size_t k = 0; k < feature_size; ++k, projection += key_size_) {
+        float value = feature[k];
+        for (unsigned int i = 0; i < key_size_; ++i) dots[i] += value * projection[i];
+    }
+}
+
+/** Return the Subsignature of a feature and the margins of its bits
+ * Each bit of the key is given by one random projection of the feature:
+ * its sign for FLANN_LSH_SIGN, the parity of the interval it falls in for
+ * FLANN_LSH_PSTABLE. Flipping a bit of the key (as multi-probe LSH does)
+ * thus probes the features whose projection is in a neighboring interval,
+ * and the margin of the bit is the distance of the projection to the
+ * closest end of its interval.
+ * @param feature the feature to analyze
+ * @param margins receives the margins of the key_size bits
+ */
+template<>
+inline size_t LshTable<float>::getKey(const float* feature, float* margins) const
+{
+    float dots[sizeof(BucketKey) * CHAR_BIT];
+    project(feature, dots);
+
+    size_t subsignature = 0;
+    if (bucket_width_ > 0) {
+        for (unsigned int i = 0; i < key_size_; ++i) {
+            float position = (dots[i] + offsets_[i]) / bucket_width_;
+            float interval = floor(position);
+            subsignature |= size_t((long)interval & 1) << i;
+            float offset = position - interval;
+            margins[i] = bucket_width_ * std::min(offset, 1 - offset);
+        }
+    }
+    else {
+        for (unsigned int i = 0; i < key_size_; ++i) {
+            subsignature |= size_t(dots[i] >= 0) << i;
+            margins[i] = fabs(dots[i]);
         }
-        // Check the next feature block
-        ++feature_block_ptr;
     }
     return subsignature;
 }
 
+/** Return the Subsignature of a feature
+ * @param feature the feature to analyze
+ */
 template<>
-inline LshStats LshTable<unsigned char>::getStats() const
+inline size_t LshTable<float>::getKey(const float* feature) const
+{
+    float margins[sizeof(BucketKey) * CHAR_BIT];
+    return getKey(feature, margins);
+}
+
+template<typename ElementType>
+inline LshStats LshTable<ElementType>::getStats() const
 {
     LshStats stats;
     stats.bucket_size_mean_ = 0;
-    if ((buckets_speed_.empty()) && (buckets_space_.empty())) {
+    switch (speed_level_) {
+    case kArray:
+        for (size_t key = 0; key + 1 < bucket_offsets_.size(); ++key) {
+            stats.bucket_sizes_.push_back(bucket_offsets_[key + 1] - bucket_offsets_[key] + addedBucketSize(key));
+        }
+        break;
+    case kBitsetHash:
+    case kHash:
+        for (size_t pos = 0; pos < bucket_slots_.size(); ++pos) {
+            if (bucket_slots_[pos].begin_ == bucket_slots_[pos].end_) continue;
+            stats.bucket_sizes_.push_back(bucket_slots_[pos].end_ - bucket_slots_[pos].begin_ +
+                                          addedBucketSize(bucket_slots_[pos].key_));
+        }
+        // the buckets that only hold added features
+        for (BucketsSpace::const_iterator x = buckets_space_.begin(); x != buckets_space_.end(); ++x) {
+            const FeatureIndex* first;
+            const FeatureIndex* last;
+            if (!getBucketFromKey(x->first, first, last)) stats.bucket_sizes_.push_back(x->second.size());
+        }
+        break;
+    case kBuilding:
+        for (BucketsSpace::const_iterator x = buckets_space_.begin(); x != buckets_space_.end(); ++x) {
+            stats.bucket_sizes_.push_back(x->second.size());
+        }
+        break;
+    }
+
+    if (stats.bucket_sizes_.empty()) {
         stats.n_buckets_ = 0;
         stats.bucket_size_median_ = 0;
         stats.bucket_size_min_ = 0;
@@ -412,22 +990,9 @@ inline LshStats LshTable<unsigned char>::getStats() const
         return stats;
     }
 
-    if (!buckets_speed_.empty()) {
-        for (BucketsSpeed::const_iterator pbucket = buckets_speed_.begin(); pbucket != buckets_speed_.end(); ++pbucket) {
-            stats.bucket_sizes_.push_back(pbucket->size());
-            stats.bucket_size_mean_ += pbucket->size();
-        }
-        stats.bucket_size_mean_ /= buckets_speed_.size();
-        stats.n_buckets_ = buckets_speed_.size();
-    }
-    else {
-        for (BucketsSpace::const_iterator x = buckets_space_.begin(); x != buckets_space_.end(); ++x) {
-            stats.bucket_sizes_.push_back(x->second.size());
-            stats.bucket_size_mean_ += x->second.size();
-        }
-        stats.bucket_size_mean_ /= buckets_space_.size();
-        stats.n_buckets_ = buckets_space_.size();
-    }
+    for (size_t i = 0; i < stats.bucket_sizes_.size(); ++i) stats.bucket_size_mean_ += stats.bucket_sizes_[i];
+    stats.bucket_size_mean_ /= stats.bucket_sizes_.size();
+    stats.n_buckets_ = stats.bucket_sizes_.size();
 
     std::sort(stats.bucket_sizes_.begin(), stats.bucket_sizes_.end());
 
@@ -32,6 +32,7 @@
 #define FLANN_RANDOM_H
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <cstddef>
 #include <vector>
@@ -76,6 +77,72 @@ inline int rand_int(int high = RAND_MAX, int low = 0)
 }
 
 
+/**
+ * Generates a random value from the standard normal distribution.
+ * @return Random value with mean 0 and variance 1
+ */
+inline double rand_normal()
+{
+    // Box-Muller transform, 1-rand_double() is never 0
+    double u = 1.0 - rand_double();
+    double v = rand_double();
+    return sqrt(-2.0*log(u))*cos(2.0*3.14159265358979323846*v);
+}
+
+
+/**
+ * Random number generator with its own state, for the computations that
+ * draw random numbers from several threads and must give the same results
+ * whatever the order the threads run in.
+ */
+class RandomState
+{
+    unsigned int state_;
+
+public:
+    /**
+     * Constructor.
+     * @param seed Random seed
+     */
+    explicit RandomState(unsigned int seed) : state_(seed)
+    {
+        next();
+    }
+
+    /**
+     * Generates a random 32 bit value (linear congruential generator).
+     * @return Random value
+     */
+    unsigned int next()
+    {
+        state_ = state_*1664525u + 1013904223u;
+        return state_;
+    }
+
+    /**
+     * Generates a random double value.
+     * @param high Upper limit
+     * @param low Lower limit
+     * @return Random double value
+     */
+    double rand_double(double high = 1.0, double low = 0)
+    {
+        return low + ((high-low) * (next() / 4294967296.0));
+    }
+
+    /**
+     * Generates a random integer value.
+     * @param high Upper limit
+     * @param low Lower limit
+     * @return Random integer value
+     */
+    int rand_int(int high = RAND_MAX, int low = 0)
+    {
+        return low + (int) ( double(high-low) * (next() / 4294967296.0));
+    }
+};
+
+
 class RandomGenerator
 {
 public:
@@ -243,6 +243,7 @@ public:
                     if (dist_index_[j].index_ == index) {
                         return;
                     }
+                    if (j == 0) break;
                     --j;
                 }
                 break;
@@ -103,6 +103,37 @@ inline IndexHeader load_header(FILE* stream)
 }
 
 
+/**
+ * Saves the tag of the format of the index data that follows
+ *
+ * @param stream - Stream to save to
+ * @param format - The format tag, at most 16 characters
+ */
+inline void save_format(FILE* stream, const char* format)
+{
+    char tag[16];
+    memset(tag, 0, sizeof(tag));
+    strncpy(tag, format, sizeof(tag));
+    fwrite(tag, sizeof(tag), 1, stream);
+}
+
+
+/**
+ * Checks the tag of the format of the index data that follows, so that
+ * an index saved in another format is not loaded as garbage
+ *
+ * @param stream - Stream to load from
+ * @param format - The expected format tag
+ */
+inline void load_format(FILE* stream, const char* format)
+{
+    char tag[16];
+    if (fread(tag, sizeof(tag), 1, stream) != 1 || strncmp(tag, format, sizeof(tag)) != 0) {
+        throw FLANNException("Invalid index file, saved in another format");
+    }
+}
+
+
 template<typename T>
 void save_value(FILE* stream, const T& value, size_t count = 1)
 {
@@ -113,7 +144,7 @@ template<typename T>
 void save_value(FILE* stream, const flann::Matrix<T>& value)
 {
     fwrite(&value, sizeof(value),1, stream);
-    fwrite(value.ptr(), sizeof(T),value.rows*value.cols, stream);
+    fwrite(value.ptr(), value.stride,value.rows, stream);
 }
 
 template<typename T>
@@ -140,9 +171,9 @@ void load_value(FILE* stream, flann::Matrix<T>& value)
     if (read_cnt != 1) {
         throw FLANNException("Cannot read from file");
     }
-    value = Matrix<T>(new T[value.rows*value.cols], value.rows, value.cols);
-    read_cnt = fread(value.ptr(), sizeof(T), value.rows*value.cols, stream);
-    if (read_cnt != value.rows*value.cols) {
+    value = Matrix<T>(new T[value.rows*value.stride/sizeof(T)], value.rows, value.cols, value.stride);
+    read_cnt = fread(value.ptr(), value.stride, value.rows, stream);
+    if (read_cnt != value.rows) {
         throw FLANNException("Cannot read from file");
     }
 }
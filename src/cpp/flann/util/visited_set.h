@@ -0,0 +1,148 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2011  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2011  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_VISITED_SET_H_
+#define FLANN_VISITED_SET_H_
+
+#include <algorithm>
+#include <vector>
+
+namespace flann
+{
+
+/**
+ * Set of point indices visited by a search.
+ *
+ * It is an open-addressing hash table sized to the number of points
+ * expected to be visited rather than to the dataset, so creating and
+ * clearing it cost as much as the search itself and not a pass over all
+ * the points. It grows when it becomes half full.
+ */
+class VisitedSet
+{
+public:
+    /**
+     * Constructor.
+     *
+     * Params:
+     *     expected = number of indices expected to be inserted
+     */
+    explicit VisitedSet(size_t expected = 0) : count_(0)
+    {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity<2*expected) capacity <<= 1;
+        slots_.assign(capacity, EMPTY);
+        mask_ = capacity-1;
+    }
+
+    /**
+     * Inserts an index.
+     *
+     * Returns: true if the index was not in the set yet
+     */
+    bool insert(int index)
+    {
+        if (2*(count_+1)>slots_.size()) {
+            grow();
+        }
+        size_t pos = hash(index)&mask_;
+        while (slots_[pos]!=EMPTY) {
+            if (slots_[pos]==index) return false;
+            pos = (pos+1)&mask_;
+        }
+        slots_[pos] = index;
+        ++count_;
+        return true;
+    }
+
+    /**
+     * Tests if an index is in the set.
+     */
+    bool test(int index) const
+    {
+        size_t pos = hash(index)&mask_;
+        while (slots_[pos]!=EMPTY) {
+            if (slots_[pos]==index) return true;
+            pos = (pos+1)&mask_;
+        }
+        return false;
+    }
+
+    /**
+     * Removes all the indices, keeping the capacity.
+     */
+    void clear()
+    {
+        if (count_>0) {
+            std::fill(slots_.begin(), slots_.end(), int(EMPTY));
+            count_ = 0;
+        }
+    }
+
+    /**
+     * Returns the number of indices in the set.
+     */
+    size_t size() const
+    {
+        return count_;
+    }
+
+private:
+    enum
+    {
+        EMPTY = -1,
+        MIN_CAPACITY = 64
+    };
+
+    static size_t hash(int index)
+    {
+        unsigned int h = (unsigned int)index*0x9e3779b1u;
+        return h ^ (h >> 16);
+    }
+
+    void grow()
+    {
+        std::vector<int> old_slots(slots_.size()*2, int(EMPTY));
+        old_slots.swap(slots_);
+        mask_ = slots_.size()-1;
+        count_ = 0;
+        for (size_t i=0; i<old_slots.size(); ++i) {
+            if (old_slots[i]!=EMPTY) {
+                insert(old_slots[i]);
+            }
+        }
+    }
+
+    std::vector<int> slots_;
+    size_t mask_;
+    size_t count_;
+};
+
+}
+
+#endif //FLANN_VISITED_SET_H_
@@ -35,7 +35,7 @@ function [indices, dists] = flann_search(data, testset, n, search_params)
 
 
     algos = struct( 'linear', 0, 'kdtree', 1, 'kmeans', 2, 'composite', 3, 'saved', 254, 'autotuned', 255 );
-    center_algos = struct('random', 0, 'gonzales', 1, 'kmeanspp', 2 );
+    center_algos = struct('random', 0, 'gonzales', 1, 'kmeanspp', 2, 'kmeansparallel', 3 );
     log_levels = struct('none', 0, 'fatal', 1, 'error', 2, 'warning', 3, 'info', 4);
     function value = id2value(map, id)
         fields = fieldnames(map);
@@ -122,7 +122,7 @@ class FLANNParameters(CustomStructure):
   }
     _translation_ = {
             "algorithm"     : {"linear"    : 0, "kdtree"    : 1, "kmeans"    : 2, "composite" : 3, "kdtree_simple" : 4, "saved": 254, "autotuned" : 255, "default"   : 1},
-        "centers_init"  : {"random"    : 0, "gonzales"  : 1, "kmeanspp"  : 2, "default"   : 0},
+        "centers_init"  : {"random"    : 0, "gonzales"  : 1, "kmeanspp"  : 2, "kmeansparallel" : 3, "default"   : 0},
         "log_level"     : {"none"      : 0, "fatal"     : 1, "error"     : 2, "warning"   : 3, "info"      : 4, "default"   : 2}
     }
     
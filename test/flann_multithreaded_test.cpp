@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <time.h>
+#include <tbb/tick_count.h>
 
 #include <flann/flann.h>
 #include <flann/io/hdf5.h>
@@ -240,6 +241,77 @@ TEST_F(FlannCompareKnnTest, CompareMultiSingleCoreKnnSearchUnsorted)
 }
 
 
+TEST_F(FlannCompareKnnTest, CompareMultiSingleCoreBuild)
+{
+    flann::Index<L2_Simple<float> > index_single(data, flann::KDTreeSingleIndexParams(50, false, 1));
+    start_timer("Building kd-tree index (single core)...");
+    index_single.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::Index<L2_Simple<float> > index_multi(data, flann::KDTreeSingleIndexParams(50, false, -1));
+    start_timer("Building kd-tree index (multi core)...");
+    index_multi.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    SearchParams params(32);
+    int single_neighbor_count = index_single.knnSearch(query, indices_single, dists_single, GetNN(), params);
+    int multi_neighbor_count = index_multi.knnSearch(query, indices_multi, dists_multi, GetNN(), params);
+
+    EXPECT_EQ(single_neighbor_count, multi_neighbor_count);
+
+    // both builds produce the same tree, so even approximate searches match
+    float precision = compute_precision(indices_single, indices_multi);
+    EXPECT_GE(precision, 0.99);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(FlannCompareKnnTest, CompareMultiSingleCoreKMeansBuild)
+{
+    // each node of the tree draws its random numbers from a generator seeded
+    // by its parent, so with the same seed both builds produce the same tree
+    flann::seed_random(42);
+    flann::Index<L2_Simple<float> > index_single(data, flann::KMeansIndexParams(32, 11, FLANN_CENTERS_RANDOM, 0.2, 1));
+    start_timer("Building kmeans index (single core)...");
+    index_single.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::seed_random(42);
+    flann::Index<L2_Simple<float> > index_multi(data, flann::KMeansIndexParams(32, 11, FLANN_CENTERS_RANDOM, 0.2, -1));
+    start_timer("Building kmeans index (multi core)...");
+    index_multi.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    // approximate searches only match if the trees are the same
+    SearchParams params(32);
+    int single_neighbor_count = index_single.knnSearch(query, indices_single, dists_single, GetNN(), params);
+    int multi_neighbor_count = index_multi.knnSearch(query, indices_multi, dists_multi, GetNN(), params);
+
+    EXPECT_EQ(single_neighbor_count, multi_neighbor_count);
+    float precision = compute_precision(indices_single, indices_multi);
+    EXPECT_EQ(precision, 1);
+}
+
+TEST_F(FlannCompareKnnTest, CompareMultiSingleCoreHierarchicalBuild)
+{
+    flann::Index<L2_Simple<float> > index_single(data, flann::KDTreeSingleIndexParams(50, false));
+    index_single.buildIndex();
+
+    flann::Index<L2_Simple<float> > index_multi(data, flann::HierarchicalClusteringIndexParams(32, FLANN_CENTERS_RANDOM,
+            4, 100, false, -1));
+    start_timer("Building hierarchical clustering index (multi core)...");
+    index_multi.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    int single_neighbor_count = index_single.knnSearch(query, indices_single, dists_single, GetNN(), SearchParams(-1));
+    int multi_neighbor_count = index_multi.knnSearch(query, indices_multi, dists_multi, GetNN(), SearchParams(2048));
+
+    EXPECT_EQ(single_neighbor_count, multi_neighbor_count);
+
+    float precision = compute_precision(indices_single, indices_multi);
+    EXPECT_GE(precision, 0.9);
+    printf("Precision: %g\n", precision);
+}
+
 /* Test Fixture which loads the cloud.h5 cloud as data and query matrix and holds two dists
    and indices matrices for comparing single and multi core radius search */
 class FlannCompareRadiusTest : public FLANNTestFixture {
@@ -352,6 +424,108 @@ TEST_F(FlannCompareRadiusTest, CompareMultiSingleCoreRadiusSearchUnsorted)
 }
 
 
+/* Test Fixture which loads the brief100K binary features as data and query matrix and holds two dists
+   and indices matrices for comparing single and multi core LSH search */
+class FlannCompareLshTest : public FLANNTestFixture {
+protected:
+    typedef flann::Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+    flann::Matrix<unsigned char> data;
+    flann::Matrix<unsigned char> query;
+    flann::Matrix<DistanceType> dists_single;
+    flann::Matrix<int> indices_single;
+    flann::Matrix<DistanceType> dists_multi;
+    flann::Matrix<int> indices_multi;
+
+    int nn;
+
+    void SetUp()
+    {
+        nn = 3;
+
+        printf("Reading test data...");
+        fflush(stdout);
+        flann::load_from_file(data, "brief100K.h5", "dataset");
+        flann::load_from_file(query, "brief100K.h5", "query");
+
+        dists_single = flann::Matrix<DistanceType>(new DistanceType[query.rows*nn], query.rows, nn);
+        indices_single = flann::Matrix<int>(new int[query.rows*nn], query.rows, nn);
+        dists_multi = flann::Matrix<DistanceType>(new DistanceType[query.rows*nn], query.rows, nn);
+        indices_multi = flann::Matrix<int>(new int[query.rows*nn], query.rows, nn);
+
+        printf("done\n");
+    }
+
+    void TearDown()
+    {
+        delete[] data.ptr();
+        delete[] query.ptr();
+        delete[] dists_single.ptr();
+        delete[] indices_single.ptr();
+        delete[] dists_multi.ptr();
+        delete[] indices_multi.ptr();
+    }
+
+    int GetNN() { return nn; }
+};
+
+TEST_F(FlannCompareLshTest, CompareMultiSingleCoreLshSearch)
+{
+    flann::Index<Distance> index(data, flann::LshIndexParams(12, 20, 2));
+    start_timer("Building LSH index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    SearchParams params(-1);
+    params.cores = 1;
+    tbb::tick_count start = tbb::tick_count::now();
+    int single_neighbor_count = index.knnSearch(query, indices_single, dists_single, GetNN(), params);
+    double single_time = (tbb::tick_count::now()-start).seconds();
+    printf("Searching KNN (1 core): %g seconds\n", single_time);
+
+    // the searches only read the index, so the threads find the same neighbors
+    // (2 threads are always run to compare their neighbors, even on one core)
+    int max_cores = tbb::task_scheduler_init::default_num_threads();
+    for (int cores=2; cores<=std::max(2, max_cores); cores*=2) {
+        params.cores = cores;
+        start = tbb::tick_count::now();
+        int multi_neighbor_count = index.knnSearch(query, indices_multi, dists_multi, GetNN(), params);
+        double multi_time = (tbb::tick_count::now()-start).seconds();
+        double speedup = single_time/multi_time;
+        printf("Searching KNN (%d cores): %g seconds, speedup %g\n", cores, multi_time, speedup);
+
+        EXPECT_EQ(single_neighbor_count, multi_neighbor_count);
+        float precision = compute_precision(indices_single, indices_multi);
+        EXPECT_EQ(precision, 1);
+    }
+}
+
+
+TEST_F(FlannCompareLshTest, CompareMultiSingleCoreLshBuild)
+{
+    // the hash functions are drawn before the tables are filled, so with the
+    // same seed both indices hold the same tables
+    flann::seed_random(42);
+    flann::Index<Distance> index_single(data, flann::LshIndexParams(12, 20, 2));
+    start_timer("Building LSH index (single core)...");
+    index_single.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::seed_random(42);
+    flann::Index<Distance> index_multi(data, flann::LshIndexParams(12, 20, 2, FLANN_LSH_PSTABLE, 0, -1));
+    start_timer("Building LSH index (multi core)...");
+    index_multi.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    int single_neighbor_count = index_single.knnSearch(query, indices_single, dists_single, GetNN(), SearchParams(-1));
+    int multi_neighbor_count = index_multi.knnSearch(query, indices_multi, dists_multi, GetNN(), SearchParams(-1));
+
+    EXPECT_EQ(single_neighbor_count, multi_neighbor_count);
+    float precision = compute_precision(indices_single, indices_multi);
+    EXPECT_EQ(precision, 1);
+}
+
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);
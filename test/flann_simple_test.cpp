@@ -3,6 +3,7 @@
 
 #include <gtest/gtest.h>
 #include <time.h>
+#include <set>
 
 #include <flann/flann.h>
 #include <flann/io/hdf5.h>
@@ -63,6 +64,81 @@ float computePrecisionDiscrete(const flann::Matrix<T>& gt_dists, const flann::Ma
   return float(count) / (nn * gt_dists.rows);
 }
 
+/** @brief Count the neighbors found that are among the removed points */
+int count_removed(const flann::Matrix<int>& indices, const std::set<size_t>& removed)
+{
+    int count = 0;
+    for (size_t i=0;i<indices.rows;++i) {
+        for (size_t j=0;j<indices.cols;++j) {
+            if (removed.count(size_t(indices[i][j]))>0) count++;
+        }
+    }
+    return count;
+}
+
+long file_size(const char* filename)
+{
+    FILE* fin = fopen(filename, "rb");
+    if (fin==NULL) return -1;
+    fseek(fin, 0, SEEK_END);
+    long size = ftell(fin);
+    fclose(fin);
+    return size;
+}
+
+/** @brief Check that the removed points are never returned, are kept by
+ * saving and loading the index, and that removing more than the rebuild
+ * threshold rebuilds the index (its saved size goes down)
+ */
+template<typename Distance>
+void test_remove_points(const flann::Matrix<typename Distance::ElementType>& data,
+                        const flann::Matrix<typename Distance::ElementType>& query,
+                        const flann::Matrix<int>& match,
+                        flann::Matrix<int>& indices,
+                        flann::Matrix<typename Distance::ResultType>& dists,
+                        const flann::IndexParams& params,
+                        const flann::SearchParams& search_params,
+                        const char* filename)
+{
+    flann::Index<Distance> index(data, params);
+    index.buildIndex();
+
+    // remove the exact nearest neighbor of each query, without a rebuild
+    std::set<size_t> removed;
+    std::vector<size_t> ids;
+    for (size_t i=0;i<match.rows;++i) {
+        if (removed.insert(match[i][0]).second) ids.push_back(match[i][0]);
+    }
+    index.removePoints(ids, 0);
+    index.knnSearch(query, indices, dists, indices.cols, search_params);
+    EXPECT_EQ(count_removed(indices, removed), 0);
+
+    index.save(filename);
+    long size_before_rebuild = file_size(filename);
+    {
+        flann::Index<Distance> index_loaded(data, flann::SavedIndexParams(filename));
+        index_loaded.knnSearch(query, indices, dists, indices.cols, search_params);
+        EXPECT_EQ(count_removed(indices, removed), 0);
+    }
+
+    // removing two thirds of the points goes past the default threshold of a half
+    ids.clear();
+    for (size_t i=0;i<data.rows;++i) {
+        if (i%3!=0 && removed.insert(i).second) ids.push_back(i);
+    }
+    index.removePoints(ids);
+    index.knnSearch(query, indices, dists, indices.cols, search_params);
+    EXPECT_EQ(count_removed(indices, removed), 0);
+
+    index.save(filename);
+    EXPECT_LT(file_size(filename), size_before_rebuild);
+    {
+        flann::Index<Distance> index_loaded(data, flann::SavedIndexParams(filename));
+        index_loaded.knnSearch(query, indices, dists, indices.cols, search_params);
+        EXPECT_EQ(count_removed(indices, removed), 0);
+    }
+}
+
 class FLANNTestFixture : public ::testing::Test {
 protected:
     clock_t start_time_;
@@ -192,6 +268,185 @@ TEST_F(Flann_SIFT10K_Test, KDTreeTestIncremental2)
 }
 
 
+TEST_F(Flann_SIFT10K_Test, KDTreeTestLeafBuckets)
+{
+    size_t size1 = data.rows/2;
+    size_t size2 = data.rows-size1;
+    Matrix<float> data1(data[0], size1, data.cols);
+    Matrix<float> data2(data[size1], size2, data.cols);
+    Index<L2<float> > index(data1, flann::KDTreeIndexParams(4, 8));
+    start_timer("Building randomised kd-tree index...");
+    index.buildIndex();
+    index.addPoints(data2);
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(1024));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, KDTreeTestReordered)
+{
+    Index<L2<float> > index(data, flann::KDTreeIndexParams(4, 8, true));
+    start_timer("Building randomised kd-tree index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(1024));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, KDTreeTestRotated)
+{
+    Index<L2<float> > index(data, flann::KDTreeIndexParams(4, 1, false, true));
+    start_timer("Building rotated kd-tree index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(256));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, KDTreeTestRemove)
+{
+    Index<L2<float> > index(data, flann::KDTreeIndexParams(4));
+    start_timer("Building randomised kd-tree index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    // remove the exact nearest neighbor of each query
+    std::vector<size_t> removed;
+    for (size_t i=0;i<match.rows;++i) {
+        removed.push_back(match[i][0]);
+    }
+    index.removePoints(removed);
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(256));
+    printf("done (%g seconds)\n", stop_timer());
+
+    int found = 0;
+    for (size_t i=0;i<indices.rows;++i) {
+        for (int j=0;j<nn;++j) {
+            if (std::find(removed.begin(), removed.end(), size_t(indices[i][j]))!=removed.end()) {
+                found++;
+            }
+        }
+    }
+    EXPECT_EQ(found, 0);
+}
+
+TEST_F(Flann_SIFT10K_Test, KDTreeTestSaved)
+{
+    // the last points are added to the built trees, so that the saved node
+    // arrays also hold the nodes added after the build
+    size_t size1 = data.rows-100;
+    Matrix<float> data1(data[0], size1, data.cols);
+    Matrix<float> data2(data[size1], data.rows-size1, data.cols);
+    Index<L2<float> > index(data1, flann::KDTreeIndexParams(4));
+    start_timer("Building randomised kd-tree index...");
+    index.buildIndex();
+    index.addPoints(data2);
+    printf("done (%g seconds)\n", stop_timer());
+
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(256));
+    index.save("kdtree_sift.idx");
+
+    printf("Loading kd-tree index\n");
+    Index<L2<float> > index_saved(data, flann::SavedIndexParams("kdtree_sift.idx"));
+    flann::Matrix<int> indices_saved(new int[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists_saved(new float[query.rows*nn], query.rows, nn);
+    start_timer("Searching KNN...");
+    index_saved.knnSearch(query, indices_saved, dists_saved, nn, flann::SearchParams(256));
+    printf("done (%g seconds)\n", stop_timer());
+
+    // the same trees give the same approximate neighbors
+    int different = 0;
+    for (size_t i=0;i<query.rows;++i) {
+        for (int j=0;j<nn;++j) {
+            if (indices[i][j]!=indices_saved[i][j] || dists[i][j]!=dists_saved[i][j]) different++;
+        }
+    }
+    EXPECT_EQ(different, 0);
+
+    delete[] indices_saved.ptr();
+    delete[] dists_saved.ptr();
+}
+
+TEST_F(Flann_SIFT10K_Test, ChunkedMatrix)
+{
+    // the first half is referenced, the second half is copied one row at a
+    // time, so that it spans several chunks
+    size_t size1 = data.rows/2;
+    flann::ChunkedMatrix<float> points(Matrix<float>(data[0], size1, data.cols), false);
+    std::vector<float*> appended;
+    for (size_t i=size1;i<data.rows;++i) {
+        points.push_back(data[i]);
+        appended.push_back(points[i]);
+    }
+    ASSERT_EQ(points.rows, data.rows);
+    ASSERT_EQ(points.cols, data.cols);
+
+    int wrong = 0;
+    for (size_t i=0;i<data.rows;++i) {
+        if (i<size1 && points[i]!=data[i]) wrong++;
+        if (i>=size1 && (points[i]==data[i] || points[i]!=appended[i-size1])) wrong++;
+        if (!std::equal(data[i], data[i]+data.cols, points[i])) wrong++;
+    }
+    EXPECT_EQ(wrong, 0);
+
+    // release every third row, referenced or owned
+    flann::DynamicBitset released(data.rows);
+    for (size_t i=0;i<data.rows;i+=3) {
+        released.set(i);
+    }
+    size_t memory = points.usedMemory();
+    points.release(released);
+    EXPECT_LT(points.usedMemory(), memory);
+    EXPECT_EQ(points.rows, data.rows);
+
+    wrong = 0;
+    for (size_t i=0;i<data.rows;++i) {
+        if (released.test(i)) {
+            if (points[i]!=NULL) wrong++;
+        }
+        else {
+            if (i<size1 && points[i]!=data[i]) wrong++;
+            if (i>=size1 && points[i]==data[i]) wrong++;
+            if (!std::equal(data[i], data[i]+data.cols, points[i])) wrong++;
+        }
+    }
+    EXPECT_EQ(wrong, 0);
+
+    // the rows appended after a release go on in the same object
+    points.append(Matrix<float>(data[0], 10, data.cols));
+    ASSERT_EQ(points.rows, data.rows+10);
+    EXPECT_TRUE(std::equal(data[9], data[9]+data.cols, points[data.rows+9]));
+
+    flann::ChunkedMatrix<float> other;
+    float* row = points[1];
+    other.swap(points);
+    EXPECT_EQ(points.rows, size_t(0));
+    EXPECT_EQ(other.rows, data.rows+10);
+    EXPECT_EQ(other.cols, data.cols);
+    EXPECT_EQ(other[1], row);
+    EXPECT_TRUE(std::equal(data[data.rows-2], data[data.rows-2]+data.cols, other[data.rows-2]));
+}
+
 TEST_F(Flann_SIFT10K_Test, KMeansTree)
 {
     Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4));
@@ -209,6 +464,142 @@ TEST_F(Flann_SIFT10K_Test, KMeansTree)
 }
 
 
+TEST_F(Flann_SIFT10K_Test, KMeansTreeKMeansParallel)
+{
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_KMEANSPARALLEL, 0.4));
+    start_timer("Building hierarchical k-means index with k-means|| seeding...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+
+TEST_F(Flann_SIFT10K_Test, KMeansParallelCenterCount)
+{
+    // k-means|| must return k distinct centers whenever there are at least
+    // k distinct points, even when its rounds sample fewer candidates
+    flann::ChunkedMatrix<float> points(data, false);
+    L2<float> distance;
+    int wrong_count = 0;
+    for (int trial = 0; trial < 200; ++trial) {
+        int k = 2 + trial % 16;
+        // a few distinct points, each repeated several times
+        int distinct = 1 + trial % 24;
+        std::vector<int> point_indices(100);
+        for (size_t i = 0; i < point_indices.size(); ++i) {
+            point_indices[i] = int(i) % distinct;
+        }
+        std::vector<int> centers(k);
+        int centers_length;
+        flann::RandomState random(trial);
+        flann::KMeansParallelCenterChooser<L2<float> > chooser(distance, points, false, random);
+        chooser(k, &point_indices[0], (int)point_indices.size(), &centers[0], centers_length);
+
+        std::sort(centers.begin(), centers.begin() + centers_length);
+        int unique_length = int(std::unique(centers.begin(), centers.begin() + centers_length) - centers.begin());
+        if (centers_length != std::min(k, distinct) || unique_length != centers_length) ++wrong_count;
+    }
+    EXPECT_EQ(wrong_count, 0);
+}
+
+TEST_F(Flann_SIFT10K_Test, KMeansTreeAccelerated)
+{
+    flann::seed_random(42);
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4));
+    index.buildIndex();
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128) );
+
+    flann::Matrix<int> indices_accelerated(new int[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists_accelerated(new float[query.rows*nn], query.rows, nn);
+
+    flann_kmeans_assignment_t assignments[] = { FLANN_KMEANS_HAMERLY, FLANN_KMEANS_ELKAN };
+    for (size_t i=0; i<FLANN_ARRAY_LEN(assignments); ++i) {
+        flann::seed_random(42);
+        Index<L2<float> > index_accelerated(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4, 1, assignments[i]));
+        start_timer("Building hierarchical k-means index (accelerated assignment)...");
+        index_accelerated.buildIndex();
+        printf("done (%g seconds)\n", stop_timer());
+        index_accelerated.knnSearch(query, indices_accelerated, dists_accelerated, nn, flann::SearchParams(128) );
+
+        // the accelerated assignment builds the same tree
+        float precision = compute_precision(indices, indices_accelerated);
+        EXPECT_EQ(precision, 1);
+        printf("Precision: %g\n", precision);
+    }
+
+    delete[] indices_accelerated.ptr();
+    delete[] dists_accelerated.ptr();
+}
+
+TEST_F(Flann_SIFT10K_Test, KMeansTreeSampled)
+{
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4, 1, FLANN_KMEANS_LLOYD, 1000));
+    start_timer("Building hierarchical k-means index from samples...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, KMeansTreePackedLeaves)
+{
+    flann::seed_random(42);
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4));
+    index.buildIndex();
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128) );
+
+    flann::seed_random(42);
+    Index<L2<float> > index_packed(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4, 1,
+            FLANN_KMEANS_LLOYD, 0, true));
+    start_timer("Building hierarchical k-means index with packed leaves...");
+    index_packed.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::Matrix<int> indices_packed(new int[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists_packed(new float[query.rows*nn], query.rows, nn);
+    start_timer("Searching KNN...");
+    index_packed.knnSearch(query, indices_packed, dists_packed, nn, flann::SearchParams(128) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    // the packed leaves hold the same points
+    float precision = compute_precision(indices, indices_packed);
+    EXPECT_EQ(precision, 1);
+    printf("Precision: %g\n", precision);
+
+    delete[] indices_packed.ptr();
+    delete[] dists_packed.ptr();
+}
+
+TEST_F(Flann_SIFT10K_Test, KMeansTreeBatched)
+{
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4, 1,
+            FLANN_KMEANS_LLOYD, 0, false, 2));
+    start_timer("Building hierarchical k-means index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN with batched center distances...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
 TEST_F(Flann_SIFT10K_Test, KMeansTreeIncremental)
 {
     size_t size1 = data.rows/2-1;
@@ -251,6 +642,130 @@ TEST_F(Flann_SIFT10K_Test, KMeansTreeIncremental2)
     printf("Precision: %g\n", precision);
 }
 
+TEST_F(Flann_SIFT10K_Test, KMeansTreeRemove)
+{
+    Index<L2<float> > index(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4));
+    start_timer("Building hierarchical k-means index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    // remove the exact nearest neighbor of each query
+    std::vector<size_t> removed;
+    for (size_t i=0;i<match.rows;++i) {
+        removed.push_back(match[i][0]);
+    }
+    index.removePoints(removed);
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(128));
+    printf("done (%g seconds)\n", stop_timer());
+
+    int found = 0;
+    for (size_t i=0;i<indices.rows;++i) {
+        for (int j=0;j<nn;++j) {
+            if (std::find(removed.begin(), removed.end(), size_t(indices[i][j]))!=removed.end()) {
+                found++;
+            }
+        }
+    }
+    EXPECT_EQ(found, 0);
+}
+
+TEST_F(Flann_SIFT10K_Test, LshTest)
+{
+    Index<L2<float> > index(data, flann::LshIndexParams(12, 16, 2));
+    start_timer("Building LSH index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(-1));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, LshTestDefaultChecks)
+{
+    // without query-directed probing the checks parameter is ignored, as for binary features
+    Index<L2<float> > index(data, flann::LshIndexParams(12, 16, 2));
+    index.buildIndex();
+
+    flann::Matrix<int> indices_unlimited(new int[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists_unlimited(new float[query.rows*nn], query.rows, nn);
+    index.knnSearch(query, indices_unlimited, dists_unlimited, nn, flann::SearchParams(-1));
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams());
+
+    float precision = compute_precision(indices_unlimited, indices);
+    EXPECT_EQ(precision, 1);
+    printf("Precision: %g\n", precision);
+
+    delete[] indices_unlimited.ptr();
+    delete[] dists_unlimited.ptr();
+}
+
+TEST_F(Flann_SIFT10K_Test, LshTestQueryDirected)
+{
+    Index<L2<float> > index(data, flann::LshIndexParams(4, 16, 2, FLANN_LSH_PSTABLE, 0, 1, true));
+    start_timer("Building LSH index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN with query-directed probing...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(1000));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_SIFT10K_Test, LshTestRemoveBeforeBuild)
+{
+    // the bucket width is then estimated on the points left, as the rows
+    // of the removed points are released
+    Index<L2<float> > index(data, flann::LshIndexParams(12, 16, 2));
+    std::set<size_t> removed;
+    std::vector<size_t> ids;
+    for (size_t i=0;i<match.rows;++i) {
+        if (removed.insert(match[i][0]).second) ids.push_back(match[i][0]);
+    }
+    index.removePoints(ids);
+    index.buildIndex();
+
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(-1));
+    EXPECT_EQ(count_removed(indices, removed), 0);
+}
+
+TEST_F(Flann_SIFT10K_Test, LshTestSaved)
+{
+    Index<L2<float> > index(data, flann::LshIndexParams(12, 16, 2));
+    start_timer("Building LSH index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(-1));
+    index.save("lsh_sift.idx");
+
+    printf("Loading LSH index\n");
+    Index<L2<float> > index_saved(data, flann::SavedIndexParams("lsh_sift.idx"));
+    flann::Matrix<int> indices_saved(new int[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists_saved(new float[query.rows*nn], query.rows, nn);
+    start_timer("Searching KNN...");
+    index_saved.knnSearch(query, indices_saved, dists_saved, nn, flann::SearchParams(-1));
+    printf("done (%g seconds)\n", stop_timer());
+
+    // the hash tables are saved, not drawn again
+    float precision = compute_precision(indices, indices_saved);
+    EXPECT_EQ(precision, 1.0);
+    printf("Precision: %g\n", precision);
+
+    delete[] indices_saved.ptr();
+    delete[] dists_saved.ptr();
+}
+
 
 class Flann_SIFT10K_Test_byte : public FLANNTestFixture {
 protected:
@@ -794,6 +1309,37 @@ TEST_F(Flann_3D, SavedTest2)
     printf("Precision: %g\n", precision);
 }
 
+TEST_F(Flann_3D, KDTreeSingleJoin)
+{
+    flann::KDTreeSingleIndex<L2_Simple<float> > index(data, flann::KDTreeSingleIndexParams(12, true));
+    start_timer("Building kd-tree index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN (dual-tree)...");
+    index.knnJoin(query, indices, dists, 5, flann::SearchParams(-1) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.99);
+    printf("Precision: %g\n", precision);
+
+    // the radius join must find the same neighbors as the radius search
+    float radius = dists[0][4];
+    std::vector<std::vector<int> > indices_search, indices_join;
+    std::vector<std::vector<float> > dists_search, dists_join;
+    int count_search = index.radiusSearch(query, indices_search, dists_search, radius, flann::SearchParams(-1));
+    int count_join = index.radiusJoin(query, indices_join, dists_join, radius, flann::SearchParams(-1));
+    EXPECT_EQ(count_search, count_join);
+    size_t different = 0;
+    for (size_t i=0;i<query.rows;++i) {
+        std::sort(indices_search[i].begin(), indices_search[i].end());
+        std::sort(indices_join[i].begin(), indices_join[i].end());
+        if (indices_search[i] != indices_join[i]) ++different;
+    }
+    EXPECT_EQ(different, 0u);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 class Flann_Brief100K_Test : public FLANNTestFixture
@@ -865,6 +1411,44 @@ TEST_F(Flann_Brief100K_Test, HierarchicalClusteringTest)
     printf("Precision: %g\n", precision);
 }
 
+TEST_F(Flann_Brief100K_Test, HierarchicalClusteringTestRemove)
+{
+    test_remove_points<Distance>(data, query, match, indices, dists, flann::HierarchicalClusteringIndexParams(),
+                                 flann::SearchParams(2000), "hierarchical_clustering_brief_removed.idx");
+}
+
+TEST_F(Flann_Brief100K_Test, HierarchicalClusteringKMeansParallel)
+{
+    flann::Index<Distance> index(data, flann::HierarchicalClusteringIndexParams(32, FLANN_CENTERS_KMEANSPARALLEL));
+    start_timer("Building hierarchical clustering index with k-means|| seeding...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, k_nn_, flann::SearchParams(2000));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = computePrecisionDiscrete(gt_dists, dists);
+    EXPECT_GE(precision, 0.9);
+    printf("Precision: %g\n", precision);
+}
+
+TEST_F(Flann_Brief100K_Test, HierarchicalClusteringPackedLeaves)
+{
+    flann::Index<Distance> index(data, flann::HierarchicalClusteringIndexParams(32, FLANN_CENTERS_RANDOM, 4, 100, true));
+    start_timer("Building hierarchical clustering index with packed leaves...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, k_nn_, flann::SearchParams(2000));
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = computePrecisionDiscrete(gt_dists, dists);
+    EXPECT_GE(precision, 0.9);
+    printf("Precision: %g\n", precision);
+}
+
 TEST_F(Flann_Brief100K_Test, HierarchicalClusteringTestIncremental)
 {
     size_t size1 = data.rows/2-1;
@@ -933,6 +1517,114 @@ TEST_F(Flann_Brief100K_Test, LshTest)
 }
 
 
+TEST_F(Flann_Brief100K_Test, LshTableLongKeys)
+{
+    // the keys longer than the digits of the radix sort building the tables
+    // must still find every feature in its own bucket
+    unsigned int key_sizes[] = { 24, 32 };
+    for (size_t k = 0; k < sizeof(key_sizes)/sizeof(key_sizes[0]); ++k) {
+        flann::lsh::LshTable<ElementType> table(data.cols, key_sizes[k]);
+        table.add(data);
+
+        size_t missing = 0;
+        for (size_t i = 0; i < data.rows; ++i) {
+            const flann::lsh::FeatureIndex* first;
+            const flann::lsh::FeatureIndex* last;
+            bool found = false;
+            if (table.getBucketFromKey(table.getKey(data[i]), first, last)) {
+                found = std::find(first, last, flann::lsh::FeatureIndex(i)) != last;
+            }
+            if (!found) ++missing;
+        }
+        printf("Key size %u: %lu features missing from their bucket\n", key_sizes[k], (unsigned long)missing);
+        EXPECT_EQ(missing, 0u);
+    }
+}
+
+#ifdef FLANN_LSH_PEXT
+TEST_F(Flann_Brief100K_Test, LshKeyPext)
+{
+    // the keys extracted with PEXT are the same as the ones of the portable loop
+    if (!flann::lsh::hasPext()) {
+        printf("The CPU has no PEXT instruction, skipping\n");
+        return;
+    }
+    flann::seed_random(42);
+    size_t block_count = data.cols / sizeof(size_t);
+    std::vector<size_t> mask(block_count);
+    size_t different = 0;
+    for (int m = 0; m < 100; ++m) {
+        // random masks of up to 32 bits spread over the blocks
+        std::fill(mask.begin(), mask.end(), size_t(0));
+        int bits = 1 + flann::rand_int(32);
+        for (int b = 0; b < bits; ++b) {
+            size_t bit = flann::rand_int(int(data.cols * CHAR_BIT));
+            mask[bit / (sizeof(size_t) * CHAR_BIT)] |= size_t(1) << (bit % (sizeof(size_t) * CHAR_BIT));
+        }
+        for (size_t i = 0; i < data.rows; i += 97) {
+            const size_t* feature = reinterpret_cast<const size_t*>(data[i]);
+            if (flann::lsh::extractKeyPext(feature, &mask[0], block_count) !=
+                flann::lsh::extractKey(feature, &mask[0], block_count)) ++different;
+        }
+    }
+    EXPECT_EQ(different, 0u);
+}
+#endif
+
+/** Hamming distance counting the evaluations that repeat one of the current query
+ */
+struct RepeatCountingHamming : public flann::Hamming<unsigned char>
+{
+    std::set<const unsigned char*>* checked;
+    size_t* repeats;
+
+    RepeatCountingHamming(std::set<const unsigned char*>* checked_ = NULL, size_t* repeats_ = NULL) :
+        checked(checked_), repeats(repeats_) {}
+
+    template <typename Iterator1, typename Iterator2>
+    ResultType operator()(Iterator1 a, Iterator2 b, size_t size, ResultType worst_dist = -1) const
+    {
+        if (checked != NULL && !checked->insert(b).second) ++*repeats;
+        return flann::Hamming<unsigned char>::operator()(a, b, size, worst_dist);
+    }
+};
+
+TEST_F(Flann_Brief100K_Test, LshTestUniqueNeighbors)
+{
+    // a feature found in several tables has its distance to the query computed once
+    std::set<const unsigned char*> checked;
+    size_t repeats = 0;
+    flann::Index<RepeatCountingHamming> index(data, flann::LshIndexParams(12, 20, 2),
+                                              RepeatCountingHamming(&checked, &repeats));
+    start_timer("Building LSH index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    for (size_t i = 0; i < query.rows; ++i) {
+        checked.clear();
+        flann::Matrix<ElementType> single_query(query[i], 1, query.cols);
+        flann::Matrix<int> single_indices(indices[i], 1, k_nn_);
+        flann::Matrix<DistanceType> single_dists(dists[i], 1, k_nn_);
+        index.knnSearch(single_query, single_indices, single_dists, k_nn_, flann::SearchParams(-1));
+    }
+    printf("done (%g seconds)\n", stop_timer());
+
+    printf("Repeated distance evaluations: %lu\n", (unsigned long)repeats);
+    EXPECT_EQ(repeats, 0u);
+
+    float precision = computePrecisionDiscrete(gt_dists, dists);
+    EXPECT_GE(precision, 0.9);
+    printf("Precision: %g\n", precision);
+}
+
+
+TEST_F(Flann_Brief100K_Test, LshTestRemove)
+{
+    test_remove_points<Distance>(data, query, match, indices, dists, flann::LshIndexParams(12, 20, 2),
+                                 flann::SearchParams(-1), "lsh_brief_removed.idx");
+}
+
 TEST_F(Flann_Brief100K_Test, LshTestIncremental)
 {
     size_t size1 = data.rows/2-1;
@@ -978,6 +1670,38 @@ TEST_F(Flann_Brief100K_Test, LshTestIncremental2)
 }
 
 
+TEST_F(Flann_Brief100K_Test, LshTestIncrementalSmallBatches)
+{
+    // the points added in small batches are found as if the tables were built with them
+    size_t size1 = data.rows*9/10;
+    Matrix<ElementType> data1(data[0], size1, data.cols);
+
+    flann::seed_random(42);
+    flann::Index<Distance> index(data1, flann::LshIndexParams(12, 20, 2));
+    start_timer("Building LSH index and adding points in batches of 10...");
+    index.buildIndex();
+    for (size_t i = size1; i < data.rows; i += 10) {
+        Matrix<ElementType> batch(data[i], std::min(size_t(10), data.rows-i), data.cols);
+        index.addPoints(batch, 0);
+    }
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::seed_random(42);
+    flann::Index<Distance> index_all(data, flann::LshIndexParams(12, 20, 2));
+    index_all.buildIndex();
+
+    flann::Matrix<DistanceType> dists_all(new DistanceType[query.rows * k_nn_], query.rows, k_nn_);
+    index.knnSearch(query, indices, dists, k_nn_, flann::SearchParams(-1));
+    index_all.knnSearch(query, indices, dists_all, k_nn_, flann::SearchParams(-1));
+    EXPECT_TRUE(std::equal(dists.ptr(), dists.ptr() + query.rows * k_nn_, dists_all.ptr()));
+    delete[] dists_all.ptr();
+
+    float precision = computePrecisionDiscrete(gt_dists, dists);
+    EXPECT_GE(precision, 0.9);
+    printf("Precision: %g\n", precision);
+}
+
+
 TEST_F(Flann_Brief100K_Test, SavedTest)
 {
     printf("Loading hierarchical clustering index\n");